@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "stats.h"
+
+#ifdef WIN32
+#include <malloc.h>
+#endif
+
+/* Every block starts on a page; its bookkeeping takes the start of it */
+struct arena_block {
+    struct arena_block *next;
+    size_t             size;
+    size_t             used;
+};
+
+static void *alloc_pages(size_t size)
+{
+    void *data = NULL;
+
+    stats_count_alloc();
+#ifdef WIN32
+    data = _aligned_malloc(size, ARENA_PAGE_SIZE);
+#else
+    if(posix_memalign(&data, ARENA_PAGE_SIZE, size) != 0) {
+        data = NULL;
+    }
+#endif
+    return data;
+}
+
+static void free_pages(void *data)
+{
+#ifdef WIN32
+    _aligned_free(data);
+#else
+    free(data);
+#endif
+}
+
+void arena_init(struct arena *arena)
+{
+    arena->first = NULL;
+    arena->current = NULL;
+}
+
+/* Takes size bytes at the given alignment from the block, or returns NULL if they do not fit */
+static void *take(struct arena_block *block, size_t size, size_t alignment)
+{
+    size_t offset = (block->used + alignment - 1) & ~(alignment - 1);
+
+    if(offset > block->size || size > block->size - offset) {
+        return NULL;
+    }
+    block->used = offset + size;
+    return (uint8_t *) block + offset;
+}
+
+static void *arena_take(struct arena *arena, size_t size, size_t alignment)
+{
+    struct arena_block *block = NULL;
+    struct arena_block **link = NULL;
+    void               *data = NULL;
+    size_t             block_size = ARENA_BLOCK_SIZE;
+
+    /* Blocks kept by arena_reset() are used again in order before any new one */
+    for(block = arena->current; block != NULL; block = block->next) {
+        if((data = take(block, size, alignment)) != NULL) {
+            arena->current = block;
+            return data;
+        }
+    }
+
+    /* A request larger than a block gets a block of its own */
+    if(size > ARENA_BLOCK_SIZE - ARENA_PAGE_SIZE) {
+        block_size = (size + 2 * ARENA_PAGE_SIZE - 1) & ~(size_t) (ARENA_PAGE_SIZE - 1);
+    }
+
+    if((block = alloc_pages(block_size)) == NULL) {
+        return NULL;
+    }
+    block->next = NULL;
+    block->size = block_size;
+    block->used = sizeof(struct arena_block);
+
+    for(link = &arena->first; *link != NULL; link = &(*link)->next) {
+    }
+    *link = block;
+    arena->current = block;
+    return take(block, size, alignment);
+}
+
+/* Memory for small objects and strings, aligned for any type */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    return arena_take(arena, size, 16);
+}
+
+/* A page-aligned buffer for I/O */
+void *arena_scratch(struct arena *arena, size_t size)
+{
+    return arena_take(arena, size, ARENA_PAGE_SIZE);
+}
+
+/* A copy of string with room for extra more characters */
+char *arena_strdup(struct arena *arena, const char *string, size_t extra)
+{
+    size_t length = strlen(string);
+    char   *copy = arena_alloc(arena, length + extra + 1);
+
+    if(copy != NULL) {
+        memcpy(copy, string, length + 1);
+    }
+    return copy;
+}
+
+/* Frees everything allocated so far at once, keeping the blocks */
+void arena_reset(struct arena *arena)
+{
+    for(struct arena_block *block = arena->first; block != NULL; block = block->next) {
+        block->used = sizeof(struct arena_block);
+    }
+    arena->current = arena->first;
+}
+
+void arena_destroy(struct arena *arena)
+{
+    struct arena_block *block = arena->first;
+
+    while(block != NULL) {
+        struct arena_block *next = block->next;
+
+        free_pages(block);
+        block = next;
+    }
+    arena_init(arena);
+}
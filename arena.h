@@ -0,0 +1,33 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * An arena for the transient buffers of one operation. Allocations are
+ * carved out of large blocks and never freed one by one; arena_reset()
+ * makes all of them reusable at once and keeps the blocks, so a worker
+ * that runs one operation after another stops allocating once it has
+ * seen its largest one. Scratch buffers are page aligned, which O_DIRECT
+ * needs. An arena is not thread safe: take what worker threads need up
+ * front.
+ */
+#define ARENA_PAGE_SIZE  4096
+#define ARENA_BLOCK_SIZE (4 * 1024 * 1024)
+
+struct arena_block;
+
+struct arena {
+    struct arena_block *first;
+    struct arena_block *current;
+};
+
+void  arena_init(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_scratch(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *string, size_t extra);
+void  arena_reset(struct arena *arena);
+void  arena_destroy(struct arena *arena);
+
+#endif
@@ -0,0 +1,816 @@
+#include <fcntl.h>
+#include <openssl/bn.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "avb.h"
+#include "bootimgtool.h"
+#include "file_io.h"
+#include "layout.h"
+#include "stats.h"
+#include "thread_pool.h"
+
+#ifdef WIN32
+#include "win32.h"
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/param_build.h>
+#endif
+
+/* Blocks of a hashtree level hashed by one job */
+#define TREE_JOB_BLOCKS 256
+
+/* Signing algorithms by algorithm_type */
+struct avb_algorithm {
+    const char *name;
+    int        sha512;
+    uint32_t   key_bits;    /* 0 for an unsigned struct */
+};
+
+static const struct avb_algorithm algorithms[] = {
+    { "NONE",           0, 0 },
+    { "SHA256_RSA2048", 0, 2048 },
+    { "SHA256_RSA4096", 0, 4096 },
+    { "SHA256_RSA8192", 0, 8192 },
+    { "SHA512_RSA2048", 1, 2048 },
+    { "SHA512_RSA4096", 1, 4096 },
+    { "SHA512_RSA8192", 1, 8192 },
+};
+
+/* SHA-256 or SHA-512; a salted state is copied into a context of its own per block */
+struct avb_hash {
+    int        sha512;
+    EVP_MD_CTX *ctx;
+};
+
+static const EVP_MD *hash_md(int sha512)
+{
+    return sha512 ? EVP_sha512() : EVP_sha256();
+}
+
+static int hash_init(struct avb_hash *hash, int sha512)
+{
+    hash->sha512 = sha512;
+    if((hash->ctx = EVP_MD_CTX_new()) == NULL || EVP_DigestInit_ex(hash->ctx, hash_md(sha512), NULL) != 1) {
+        EVP_MD_CTX_free(hash->ctx);
+        hash->ctx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Makes hash a copy of from, reusing the context hash already has */
+static int hash_copy(struct avb_hash *hash, const struct avb_hash *from)
+{
+    hash->sha512 = from->sha512;
+    if(hash->ctx == NULL && (hash->ctx = EVP_MD_CTX_new()) == NULL) {
+        return -1;
+    }
+    return EVP_MD_CTX_copy_ex(hash->ctx, from->ctx) == 1 ? 0 : -1;
+}
+
+static void hash_update(struct avb_hash *hash, const void *data, size_t size)
+{
+    EVP_DigestUpdate(hash->ctx, data, size);
+}
+
+/* Returns the size of the digest written to md, which must hold 64 bytes, or 0 if it failed */
+static size_t hash_final(struct avb_hash *hash, uint8_t *md)
+{
+    unsigned int size = 0;
+
+    return EVP_DigestFinal_ex(hash->ctx, md, &size) == 1 ? size : 0;
+}
+
+static void hash_free(struct avb_hash *hash)
+{
+    EVP_MD_CTX_free(hash->ctx);
+    hash->ctx = NULL;
+}
+
+static int fail(char *error, size_t error_size, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(error, error_size, format, args);
+    va_end(args);
+    return -1;
+}
+
+static uint32_t be32(const uint8_t *data)
+{
+    return (uint32_t) data[0] << 24 | (uint32_t) data[1] << 16 | (uint32_t) data[2] << 8 | data[3];
+}
+
+static uint64_t be64(const uint8_t *data)
+{
+    return (uint64_t) be32(data) << 32 | be32(data + 4);
+}
+
+/* Whether size bytes at offset lie within limit bytes, without overflowing */
+static int fits(uint64_t offset, uint64_t size, uint64_t limit)
+{
+    return offset <= limit && size <= limit - offset;
+}
+
+static void print_hex(FILE *out, const uint8_t *data, size_t size)
+{
+    for(size_t i = 0; i < size; i++) {
+        fprintf(out, "%02x", data[i]);
+    }
+}
+
+static int parse_vbmeta(const uint8_t *data, uint64_t size, struct avb_vbmeta *vbmeta, char *error,
+                        size_t error_size)
+{
+    struct avb_vbmeta_header *header = &vbmeta->header;
+
+    if(size < AVB_VBMETA_HEADER_SIZE || memcmp(data, AVB_MAGIC, AVB_MAGIC_SIZE) != 0) {
+        return fail(error, error_size, "no vbmeta struct where the footer points");
+    }
+
+    memset(vbmeta, 0, sizeof(struct avb_vbmeta));
+    header->required_libavb_version_major = be32(data + 4);
+    header->required_libavb_version_minor = be32(data + 8);
+    header->authentication_data_block_size = be64(data + 12);
+    header->auxiliary_data_block_size = be64(data + 20);
+    header->algorithm_type = be32(data + 28);
+    header->hash_offset = be64(data + 32);
+    header->hash_size = be64(data + 40);
+    header->signature_offset = be64(data + 48);
+    header->signature_size = be64(data + 56);
+    header->public_key_offset = be64(data + 64);
+    header->public_key_size = be64(data + 72);
+    header->public_key_metadata_offset = be64(data + 80);
+    header->public_key_metadata_size = be64(data + 88);
+    header->descriptors_offset = be64(data + 96);
+    header->descriptors_size = be64(data + 104);
+    header->rollback_index = be64(data + 112);
+    header->flags = be32(data + 120);
+    header->rollback_index_location = be32(data + 124);
+    memcpy(header->release_string, data + 128, sizeof(header->release_string) - 1);
+
+    if(header->required_libavb_version_major != 1) {
+        return fail(error, error_size, "unsupported libavb version %u.%u", header->required_libavb_version_major,
+                    header->required_libavb_version_minor);
+    }
+
+    if(!fits(AVB_VBMETA_HEADER_SIZE, header->authentication_data_block_size, size) ||
+       !fits(AVB_VBMETA_HEADER_SIZE + header->authentication_data_block_size,
+             header->auxiliary_data_block_size, size) ||
+       !fits(header->hash_offset, header->hash_size, header->authentication_data_block_size) ||
+       !fits(header->signature_offset, header->signature_size, header->authentication_data_block_size) ||
+       !fits(header->public_key_offset, header->public_key_size, header->auxiliary_data_block_size) ||
+       !fits(header->public_key_metadata_offset, header->public_key_metadata_size,
+             header->auxiliary_data_block_size) ||
+       !fits(header->descriptors_offset, header->descriptors_size, header->auxiliary_data_block_size)) {
+        return fail(error, error_size, "vbmeta struct has blocks outside it");
+    }
+
+    if(header->algorithm_type >= sizeof(algorithms) / sizeof(algorithms[0])) {
+        return fail(error, error_size, "unknown vbmeta algorithm %u", header->algorithm_type);
+    }
+
+    vbmeta->data = data;
+    vbmeta->authentication = data + AVB_VBMETA_HEADER_SIZE;
+    vbmeta->auxiliary = vbmeta->authentication + header->authentication_data_block_size;
+    return 0;
+}
+
+/*
+ * Looks for AVB metadata in an image: a footer in its last 64 bytes, or
+ * a vbmeta struct at its start. Returns the enum avb_container that was
+ * found, with footer and vbmeta filled in, or -1 with error set if the
+ * metadata is there but broken.
+ */
+int avb_find_vbmeta(const struct image_map *map, struct avb_footer *footer, struct avb_vbmeta *vbmeta,
+                    char *error, size_t error_size)
+{
+    const uint8_t *data = NULL;
+
+    memset(footer, 0, sizeof(struct avb_footer));
+
+    if(map->size >= AVB_VBMETA_HEADER_SIZE && memcmp(map->data, AVB_MAGIC, AVB_MAGIC_SIZE) == 0) {
+        footer->vbmeta_size = map->size;
+        return parse_vbmeta(map->data, map->size, vbmeta, error, error_size) < 0 ? -1 : AVB_VBMETA_IMAGE;
+    }
+
+    if(map->size < AVB_FOOTER_SIZE) {
+        return AVB_NONE;
+    }
+
+    data = map->data + map->size - AVB_FOOTER_SIZE;
+    if(memcmp(data, AVB_FOOTER_MAGIC, AVB_MAGIC_SIZE) != 0) {
+        return AVB_NONE;
+    }
+
+    footer->version_major = be32(data + 4);
+    footer->version_minor = be32(data + 8);
+    footer->original_image_size = be64(data + 12);
+    footer->vbmeta_offset = be64(data + 20);
+    footer->vbmeta_size = be64(data + 28);
+
+    if(footer->version_major != 1) {
+        return fail(error, error_size, "unsupported AVB footer version %u.%u", footer->version_major,
+                    footer->version_minor);
+    }
+
+    if(!fits(footer->vbmeta_offset, footer->vbmeta_size, map->size - AVB_FOOTER_SIZE) ||
+       footer->original_image_size > footer->vbmeta_offset) {
+        return fail(error, error_size, "AVB footer points outside the image");
+    }
+
+    if(parse_vbmeta(map->data + footer->vbmeta_offset, footer->vbmeta_size, vbmeta, error, error_size) < 0) {
+        return -1;
+    }
+    return AVB_FOOTER;
+}
+
+/*
+ * Steps through the descriptors of vbmeta. offset starts at 0; returns
+ * 1 with the next descriptor, 0 after the last one and -1 if one does
+ * not fit.
+ */
+int avb_next_descriptor(const struct avb_vbmeta *vbmeta, uint64_t *offset, struct avb_descriptor *descriptor)
+{
+    const uint8_t *descriptors = vbmeta->auxiliary + vbmeta->header.descriptors_offset;
+    uint64_t      size = vbmeta->header.descriptors_size;
+
+    if(*offset >= size) {
+        return 0;
+    }
+
+    if(!fits(*offset, 16, size)) {
+        return -1;
+    }
+    descriptor->tag = be64(descriptors + *offset);
+    descriptor->size = be64(descriptors + *offset + 8);
+    descriptor->data = descriptors + *offset + 16;
+
+    if(!fits(*offset + 16, descriptor->size, size)) {
+        return -1;
+    }
+    *offset += 16 + descriptor->size;
+    return 1;
+}
+
+/* Fills hash from a hash or hashtree descriptor. Returns -1 for any other or a truncated one. */
+int avb_parse_hash_descriptor(const struct avb_descriptor *descriptor, struct avb_hash_descriptor *hash)
+{
+    const uint8_t *data = descriptor->data;
+    uint64_t      fixed = 0;
+
+    memset(hash, 0, sizeof(struct avb_hash_descriptor));
+
+    if(descriptor->tag == AVB_DESCRIPTOR_HASH && descriptor->size >= 116) {
+        hash->image_size = be64(data);
+        memcpy(hash->hash_algorithm, data + 8, 32);
+        hash->partition_name_len = be32(data + 40);
+        hash->salt_len = be32(data + 44);
+        hash->digest_len = be32(data + 48);
+        hash->flags = be32(data + 52);
+        fixed = 116;
+    } else if(descriptor->tag == AVB_DESCRIPTOR_HASHTREE && descriptor->size >= 164) {
+        hash->hashtree = 1;
+        hash->dm_verity_version = be32(data);
+        hash->image_size = be64(data + 4);
+        hash->tree_offset = be64(data + 12);
+        hash->tree_size = be64(data + 20);
+        hash->data_block_size = be32(data + 28);
+        hash->hash_block_size = be32(data + 32);
+        memcpy(hash->hash_algorithm, data + 56, 32);
+        hash->partition_name_len = be32(data + 88);
+        hash->salt_len = be32(data + 92);
+        hash->digest_len = be32(data + 96);
+        hash->flags = be32(data + 100);
+        fixed = 164;
+    } else {
+        return -1;
+    }
+
+    if((uint64_t) hash->partition_name_len + hash->salt_len + hash->digest_len > descriptor->size - fixed) {
+        return -1;
+    }
+    hash->partition_name = data + fixed;
+    hash->salt = hash->partition_name + hash->partition_name_len;
+    hash->digest = hash->salt + hash->salt_len;
+    return 0;
+}
+
+/* An RSA public key with the big-endian modulus and AVB's exponent of 65537 */
+static EVP_PKEY *load_public_key(const uint8_t *modulus, size_t size)
+{
+    EVP_PKEY       *pkey = NULL;
+    BIGNUM         *n = BN_bin2bn(modulus, size, NULL);
+    BIGNUM         *e = BN_new();
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM_BLD *bld = OSSL_PARAM_BLD_new();
+    OSSL_PARAM     *params = NULL;
+    EVP_PKEY_CTX   *ctx = EVP_PKEY_CTX_new_from_name(NULL, "RSA", NULL);
+
+    if(n != NULL && e != NULL && bld != NULL && ctx != NULL && BN_set_word(e, RSA_F4) == 1 &&
+       OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_N, n) == 1 &&
+       OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_E, e) == 1 &&
+       (params = OSSL_PARAM_BLD_to_param(bld)) != NULL && EVP_PKEY_fromdata_init(ctx) == 1 &&
+       EVP_PKEY_fromdata(ctx, &pkey, EVP_PKEY_PUBLIC_KEY, params) != 1) {
+        pkey = NULL;
+    }
+    OSSL_PARAM_free(params);
+    OSSL_PARAM_BLD_free(bld);
+    EVP_PKEY_CTX_free(ctx);
+#else
+    RSA            *rsa = RSA_new();
+
+    /* rsa owns n and e once they are set */
+    if(rsa != NULL && n != NULL && e != NULL && BN_set_word(e, RSA_F4) == 1 && RSA_set0_key(rsa, n, e, NULL) == 1) {
+        n = NULL;
+        e = NULL;
+        if((pkey = EVP_PKEY_new()) != NULL && EVP_PKEY_set1_RSA(pkey, rsa) != 1) {
+            EVP_PKEY_free(pkey);
+            pkey = NULL;
+        }
+    }
+    RSA_free(rsa);
+#endif
+    BN_free(n);
+    BN_free(e);
+    return pkey;
+}
+
+/*
+ * Checks the hash in the authentication block against the header and
+ * auxiliary block, and the signature against the public key embedded in
+ * the auxiliary block. Which key that is, and whether to trust it, is up
+ * to the caller.
+ */
+int avb_verify_vbmeta(const struct avb_vbmeta *vbmeta, char *error, size_t error_size)
+{
+    const struct avb_vbmeta_header *header = &vbmeta->header;
+    const struct avb_algorithm     *algorithm = &algorithms[header->algorithm_type];
+    const uint8_t                  *key = vbmeta->auxiliary + header->public_key_offset;
+    struct avb_hash                hash;
+    uint8_t                        md[SHA512_DIGEST_LENGTH];
+    size_t                         md_size = 0;
+    uint32_t                       key_bytes = 0;
+    EVP_PKEY                       *pkey = NULL;
+    EVP_MD_CTX                     *ctx = NULL;
+    int                            ret = -1;
+
+    if(algorithm->key_bits == 0) {
+        return 0;
+    }
+
+    if(hash_init(&hash, algorithm->sha512) == 0) {
+        hash_update(&hash, vbmeta->data, AVB_VBMETA_HEADER_SIZE);
+        hash_update(&hash, vbmeta->auxiliary, header->auxiliary_data_block_size);
+        md_size = hash_final(&hash, md);
+        hash_free(&hash);
+    }
+
+    if(header->hash_size != md_size || memcmp(md, vbmeta->authentication + header->hash_offset, md_size) != 0) {
+        return fail(error, error_size, "vbmeta hash does not match its contents");
+    }
+
+    /* The key is its size in bits, n0inv, the modulus and then rr, of which only the modulus is needed */
+    key_bytes = algorithm->key_bits / 8;
+    if(header->public_key_size < 8 + 2 * (uint64_t) key_bytes || be32(key) != algorithm->key_bits ||
+       header->signature_size != key_bytes) {
+        return fail(error, error_size, "vbmeta public key or signature does not fit %s", algorithm->name);
+    }
+
+    if((pkey = load_public_key(key + 8, key_bytes)) == NULL) {
+        return fail(error, error_size, "could not load the vbmeta public key");
+    }
+
+    /* The signature covers the same header and auxiliary block as the hash */
+    if((ctx = EVP_MD_CTX_new()) == NULL ||
+       EVP_DigestVerifyInit(ctx, NULL, hash_md(algorithm->sha512), NULL, pkey) != 1 ||
+       EVP_DigestVerifyUpdate(ctx, vbmeta->data, AVB_VBMETA_HEADER_SIZE) != 1 ||
+       EVP_DigestVerifyUpdate(ctx, vbmeta->auxiliary, header->auxiliary_data_block_size) != 1 ||
+       EVP_DigestVerifyFinal(ctx, vbmeta->authentication + header->signature_offset, header->signature_size) != 1) {
+        fail(error, error_size, "vbmeta signature does not verify with its public key");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    EVP_MD_CTX_free(ctx);
+    EVP_PKEY_free(pkey);
+    return ret;
+}
+
+/* One level of a hashtree, hashed TREE_JOB_BLOCKS blocks per job */
+struct tree_level {
+    const uint8_t         *src;
+    uint64_t              src_size;
+    uint8_t               *out;
+    uint32_t              block_size;
+    size_t                digest_size;
+    const struct avb_hash *salted;
+};
+
+static void hash_tree_blocks(size_t index, void *arg)
+{
+    const struct tree_level *level = arg;
+    uint64_t                block = (uint64_t) index * TREE_JOB_BLOCKS;
+    uint8_t                 *zeros = NULL;
+    struct avb_hash         hash = { 0, NULL };
+
+    for(uint64_t i = 0; i < TREE_JOB_BLOCKS && block * level->block_size < level->src_size; i++, block++) {
+        uint64_t        offset = block * level->block_size;
+        uint64_t        size = level->src_size - offset < level->block_size ? level->src_size - offset
+                                                                             : level->block_size;
+        uint8_t         md[SHA512_DIGEST_LENGTH];
+
+        /* A block left all zeros fails the comparison with the stored tree */
+        if(hash_copy(&hash, level->salted) < 0) {
+            break;
+        }
+        hash_update(&hash, level->src + offset, size);
+
+        /* Only the last block can be short, and it is hashed as if padded with zeros */
+        if(size < level->block_size) {
+            zeros = calloc(1, level->block_size - size);
+            if(zeros != NULL) {
+                hash_update(&hash, zeros, level->block_size - size);
+            }
+            free(zeros);
+        }
+        if(hash_final(&hash, md) == level->digest_size) {
+            memcpy(level->out + block * level->digest_size, md, level->digest_size);
+        }
+    }
+    hash_free(&hash);
+}
+
+/*
+ * Rebuilds the dm-verity hashtree of the first image_size bytes of image
+ * the way avbtool does, the lowest level first, and checks it against
+ * both the root digest and the tree stored in the image. Each level is
+ * hashed on up to threads threads, a run of blocks per job; most of the
+ * work is the lowest level, which hashes the whole image.
+ */
+static int verify_hashtree(const struct avb_hash_descriptor *desc, const struct avb_hash *salted,
+                           const uint8_t *image, uint64_t size, unsigned int threads, char *error,
+                           size_t error_size)
+{
+    uint64_t      level_sizes[32];
+    uint64_t      level_offsets[32];
+    size_t        levels = 0;
+    uint64_t      tree_size = 0;
+    uint64_t      level_size = desc->image_size;
+    uint32_t      block_size = desc->data_block_size;
+    size_t        digest_size = salted->sha512 ? SHA512_DIGEST_LENGTH : SHA256_DIGEST_LENGTH;
+    uint8_t       *tree = NULL;
+    const uint8_t *top = image;
+    uint64_t      top_size = desc->image_size;
+    struct avb_hash hash = { 0, NULL };
+    uint8_t       md[SHA512_DIGEST_LENGTH];
+    size_t        md_size = 0;
+
+    if(block_size == 0 || block_size != desc->hash_block_size || block_size % digest_size != 0) {
+        return fail(error, error_size, "unsupported hashtree block sizes %u and %u", desc->data_block_size,
+                    desc->hash_block_size);
+    }
+
+    if(!fits(desc->tree_offset, desc->tree_size, size)) {
+        return fail(error, error_size, "hashtree lies outside the image");
+    }
+
+    while(level_size > block_size && levels < sizeof(level_sizes) / sizeof(level_sizes[0])) {
+        level_size = page_align(level_size, block_size) / block_size * digest_size;
+        level_size = page_align(level_size, block_size);
+        level_sizes[levels++] = level_size;
+        tree_size += level_size;
+    }
+
+    if(tree_size != desc->tree_size) {
+        return fail(error, error_size, "hashtree is %llu bytes, the image needs %llu",
+                    (unsigned long long) desc->tree_size, (unsigned long long) tree_size);
+    }
+
+    /* Levels are stored top first */
+    for(size_t i = 0; i < levels; i++) {
+        level_offsets[i] = 0;
+        for(size_t j = i + 1; j < levels; j++) {
+            level_offsets[i] += level_sizes[j];
+        }
+    }
+
+    if(tree_size != 0 && (tree = stats_malloc(tree_size)) == NULL) {
+        return fail(error, error_size, "out of memory for the hashtree");
+    }
+    if(tree_size != 0) {
+        memset(tree, 0, tree_size);
+    }
+
+    for(size_t i = 0; i < levels; i++) {
+        struct tree_level level = { top, top_size, tree + level_offsets[i], block_size, digest_size, salted };
+        uint64_t          blocks = (top_size + block_size - 1) / block_size;
+
+        thread_pool_run(threads, (blocks + TREE_JOB_BLOCKS - 1) / TREE_JOB_BLOCKS, hash_tree_blocks, &level);
+        top = tree + level_offsets[i];
+        top_size = level_sizes[i];
+    }
+
+    if(hash_copy(&hash, salted) == 0) {
+        hash_update(&hash, top, top_size);
+        md_size = hash_final(&hash, md);
+    }
+    hash_free(&hash);
+
+    if(md_size != digest_size || desc->digest_len != digest_size || memcmp(md, desc->digest, digest_size) != 0) {
+        free(tree);
+        return fail(error, error_size, "hashtree root digest does not match");
+    }
+
+    if(tree_size != 0 && memcmp(tree, image + desc->tree_offset, tree_size) != 0) {
+        free(tree);
+        return fail(error, error_size, "stored hashtree does not match the image");
+    }
+    free(tree);
+    return 0;
+}
+
+/*
+ * Checks the partition image against a hash descriptor, which is a
+ * digest of the salt and the image, or a hashtree descriptor. A hash is
+ * a single streaming pass; a hashtree is rebuilt on up to threads
+ * threads.
+ */
+int avb_verify_partition(const struct avb_hash_descriptor *desc, const uint8_t *image, uint64_t size,
+                         unsigned int threads, char *error, size_t error_size)
+{
+    struct avb_hash    salted;
+    struct stats_timer timer;
+    uint8_t            md[SHA512_DIGEST_LENGTH];
+    size_t             md_size = 0;
+    int                ret = 0;
+
+    if(strcmp(desc->hash_algorithm, "sha256") != 0 && strcmp(desc->hash_algorithm, "sha512") != 0) {
+        return fail(error, error_size, "unsupported hash algorithm %s", desc->hash_algorithm);
+    }
+
+    if(desc->image_size > size) {
+        return fail(error, error_size, "descriptor covers %llu bytes, the image has %llu",
+                    (unsigned long long) desc->image_size, (unsigned long long) size);
+    }
+
+    if(hash_init(&salted, !strcmp(desc->hash_algorithm, "sha512")) < 0) {
+        return fail(error, error_size, "could not set up %s", desc->hash_algorithm);
+    }
+    hash_update(&salted, desc->salt, desc->salt_len);
+
+    stats_begin(&timer);
+    stats_count_read(desc->image_size);
+    if(desc->hashtree) {
+        ret = verify_hashtree(desc, &salted, image, size, threads, error, error_size);
+    } else {
+        hash_update(&salted, image, desc->image_size);
+        md_size = hash_final(&salted, md);
+
+        if(desc->digest_len != md_size || memcmp(md, desc->digest, md_size) != 0) {
+            ret = fail(error, error_size, "%s digest does not match", desc->hash_algorithm);
+        }
+    }
+    stats_end(&timer, STATS_HASH);
+    hash_free(&salted);
+    return ret;
+}
+
+/*
+ * Finds the image a descriptor describes: the one holding it if it is
+ * the image's own, if its partition name is empty or if the name matches
+ * the file's, else <partition name><extension> next to it as avbtool
+ * looks for it. Returns 1 with other mapped if it opened a sibling, 0 if
+ * the descriptor is for this image and -1 if the sibling is not there.
+ */
+static int open_partition(const char *filename, const struct avb_hash_descriptor *desc, int own,
+                          struct image_map *other)
+{
+    const char *base = strrchr(filename, '/');
+    const char *ext = NULL;
+    size_t     dir_len = 0;
+    size_t     stem_len = 0;
+    char       *path = NULL;
+    int        fd = -1;
+    int        ret = -1;
+
+    base = base != NULL ? base + 1 : filename;
+    dir_len = base - filename;
+    ext = strrchr(base, '.');
+    ext = ext != NULL ? ext : base + strlen(base);
+    stem_len = ext - base;
+
+    if(own || desc->partition_name_len == 0 ||
+       (desc->partition_name_len == stem_len && memcmp(desc->partition_name, base, stem_len) == 0)) {
+        return 0;
+    }
+
+    path = stats_malloc(dir_len + desc->partition_name_len + strlen(ext) + 1);
+    if(path == NULL) {
+        return -1;
+    }
+    memcpy(path, filename, dir_len);
+    memcpy(path + dir_len, desc->partition_name, desc->partition_name_len);
+    strcpy(path + dir_len + desc->partition_name_len, ext);
+
+    fd = io_open(path, O_RDONLY, 0);
+    if(fd >= 0) {
+        ret = map_image(fd, other) < 0 ? -1 : 1;
+        io_close(fd);
+    }
+    free(path);
+    return ret;
+}
+
+/*
+ * Verifies the AVB metadata of an image mapped as map: the vbmeta hash
+ * and signature, and every hash and hashtree descriptor against the
+ * partition it describes, found as open_partition() does. Partitions
+ * that are not there are skipped. A line per check goes to out unless
+ * it is NULL. Returns 0 if everything checked verifies or there is no
+ * metadata, and -1 with error set otherwise.
+ */
+int avb_verify_image(const char *filename, const struct image_map *map, unsigned int threads, FILE *out,
+                     char *error, size_t error_size)
+{
+    struct avb_footer     footer;
+    struct avb_vbmeta     vbmeta;
+    struct avb_descriptor descriptor;
+    uint64_t              offset = 0;
+    int                   found = avb_find_vbmeta(map, &footer, &vbmeta, error, error_size);
+    int                   own = found == AVB_FOOTER;
+    int                   ret = 0;
+
+    if(found <= 0) {
+        return found;
+    }
+
+    if(avb_verify_vbmeta(&vbmeta, error, error_size) < 0) {
+        return -1;
+    }
+    if(out != NULL) {
+        fprintf(out, "vbmeta: verified %s\n", vbmeta.header.algorithm_type == 0 ? "unsigned struct" :
+                algorithms[vbmeta.header.algorithm_type].name);
+    }
+
+    while(ret == 0 && (ret = avb_next_descriptor(&vbmeta, &offset, &descriptor)) > 0) {
+        struct avb_hash_descriptor desc;
+        struct image_map           other;
+        const struct image_map     *partition = map;
+        int                        opened = 0;
+
+        ret = 0;
+        if(descriptor.tag != AVB_DESCRIPTOR_HASH && descriptor.tag != AVB_DESCRIPTOR_HASHTREE) {
+            continue;
+        }
+
+        if(avb_parse_hash_descriptor(&descriptor, &desc) < 0) {
+            return fail(error, error_size, "truncated %s descriptor",
+                        descriptor.tag == AVB_DESCRIPTOR_HASH ? "hash" : "hashtree");
+        }
+
+        /* avbtool puts the footer's own descriptor before any it includes from other images */
+        opened = open_partition(filename, &desc, own, &other);
+        own = 0;
+        if(opened < 0) {
+            if(out != NULL) {
+                fprintf(out, "%.*s: skipped, no image for the partition\n", (int) desc.partition_name_len,
+                        desc.partition_name);
+            }
+            continue;
+        }
+        if(opened > 0) {
+            partition = &other;
+        }
+
+        ret = avb_verify_partition(&desc, partition->data, partition->size, threads, error, error_size);
+        if(ret == 0 && out != NULL) {
+            fprintf(out, "%.*s: verified %s %s of %llu bytes\n", (int) desc.partition_name_len, desc.partition_name,
+                    desc.hash_algorithm, desc.hashtree ? "hashtree" : "hash", (unsigned long long) desc.image_size);
+        }
+        if(opened > 0) {
+            unmap_image(&other);
+        }
+    }
+
+    if(ret < 0 && error[0] == '\0') {
+        fail(error, error_size, "truncated descriptor");
+    }
+    return ret < 0 ? -1 : 0;
+}
+
+static void show_descriptor(FILE *out, const struct avb_descriptor *descriptor)
+{
+    struct avb_hash_descriptor hash;
+    const uint8_t              *data = descriptor->data;
+
+    if(avb_parse_hash_descriptor(descriptor, &hash) == 0) {
+        fprintf(out, "%s descriptor:\n", hash.hashtree ? "hashtree" : "hash");
+        fprintf(out, "  partition name = %.*s\n", (int) hash.partition_name_len, hash.partition_name);
+        fprintf(out, "  image size = %llu\n", (unsigned long long) hash.image_size);
+        if(hash.hashtree) {
+            fprintf(out, "  tree offset = %llu\n", (unsigned long long) hash.tree_offset);
+            fprintf(out, "  tree size = %llu\n", (unsigned long long) hash.tree_size);
+            fprintf(out, "  block size = %u\n", hash.data_block_size);
+        }
+        fprintf(out, "  hash algorithm = %s\n", hash.hash_algorithm);
+        fprintf(out, "  salt = ");
+        print_hex(out, hash.salt, hash.salt_len);
+        fprintf(out, "\n  %s = ", hash.hashtree ? "root digest" : "digest");
+        print_hex(out, hash.digest, hash.digest_len);
+        fprintf(out, "\n");
+    } else if(descriptor->tag == AVB_DESCRIPTOR_PROPERTY && descriptor->size >= 16 &&
+              be64(data) <= descriptor->size - 16 && be64(data + 8) <= descriptor->size - 16 - be64(data) - 1) {
+        fprintf(out, "property = %.*s: %.*s\n", (int) be64(data), data + 16, (int) be64(data + 8),
+                data + 16 + be64(data) + 1);
+    } else if(descriptor->tag == AVB_DESCRIPTOR_KERNEL_CMDLINE && descriptor->size >= 8 &&
+              be32(data + 4) <= descriptor->size - 8) {
+        fprintf(out, "kernel cmdline = %.*s\n", (int) be32(data + 4), data + 8);
+    } else if(descriptor->tag == AVB_DESCRIPTOR_CHAIN_PARTITION && descriptor->size >= 76 &&
+              be32(data + 4) <= descriptor->size - 76) {
+        fprintf(out, "chain partition = %.*s (rollback index location %u)\n", (int) be32(data + 4), data + 76,
+                be32(data));
+    } else {
+        fprintf(out, "descriptor tag %llu, %llu bytes\n", (unsigned long long) descriptor->tag,
+                (unsigned long long) descriptor->size);
+    }
+}
+
+/*
+ * The avb command: prints the footer, vbmeta header and descriptors of
+ * filename and verifies them as avb_verify_image() does. Returns 0 if
+ * everything verifies and 1 otherwise, matching its exit status.
+ */
+int avb_image(const char *filename, unsigned int threads, FILE *out)
+{
+    struct avb_footer     footer;
+    struct avb_vbmeta     vbmeta;
+    struct avb_descriptor descriptor;
+    struct image_map      map;
+    uint64_t              offset = 0;
+    char                  error[256] = "";
+    int                   found = 0;
+    int                   status = 1;
+    int                   fd = io_open(filename, O_RDONLY, 0);
+
+    if(fd == -1) {
+        fprintf(error_stream(), "avb: could not open file %s\n", filename);
+        return 1;
+    }
+
+    if(map_image(fd, &map) < 0) {
+        fprintf(error_stream(), "avb: could not map image %s\n", filename);
+        io_close(fd);
+        return 1;
+    }
+
+    found = avb_find_vbmeta(&map, &footer, &vbmeta, error, sizeof(error));
+    if(found == AVB_NONE) {
+        fprintf(error_stream(), "avb: %s has no AVB footer or vbmeta struct\n", filename);
+        goto out;
+    }
+    if(found < 0) {
+        fprintf(error_stream(), "avb: %s: %s\n", filename, error);
+        goto out;
+    }
+
+    if(found == AVB_FOOTER) {
+        fprintf(out, "footer version = %u.%u\n", footer.version_major, footer.version_minor);
+        fprintf(out, "original image size = %llu\n", (unsigned long long) footer.original_image_size);
+        fprintf(out, "vbmeta offset = %llu\n", (unsigned long long) footer.vbmeta_offset);
+        fprintf(out, "vbmeta size = %llu\n", (unsigned long long) footer.vbmeta_size);
+    }
+    fprintf(out, "minimum libavb version = %u.%u\n", vbmeta.header.required_libavb_version_major,
+            vbmeta.header.required_libavb_version_minor);
+    fprintf(out, "authentication block = %llu bytes\n",
+            (unsigned long long) vbmeta.header.authentication_data_block_size);
+    fprintf(out, "auxiliary block = %llu bytes\n", (unsigned long long) vbmeta.header.auxiliary_data_block_size);
+    fprintf(out, "algorithm = %s\n", algorithms[vbmeta.header.algorithm_type].name);
+    fprintf(out, "rollback index = %llu\n", (unsigned long long) vbmeta.header.rollback_index);
+    fprintf(out, "flags = %u\n", vbmeta.header.flags);
+    fprintf(out, "release string = %s\n", vbmeta.header.release_string);
+
+    while(avb_next_descriptor(&vbmeta, &offset, &descriptor) > 0) {
+        show_descriptor(out, &descriptor);
+    }
+
+    if(avb_verify_image(filename, &map, threads, out, error, sizeof(error)) < 0) {
+        fprintf(error_stream(), "avb: %s: %s\n", filename, error);
+        goto out;
+    }
+    status = 0;
+
+out:
+    unmap_image(&map);
+    io_close(fd);
+    return status;
+}
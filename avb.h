@@ -0,0 +1,114 @@
+#ifndef AVB_H
+#define AVB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "image_map.h"
+
+/*
+ * Android Verified Boot metadata. A partition image signed by avbtool
+ * ends in a footer that points at a vbmeta struct stored after the
+ * original image; a vbmeta partition image is the struct on its own.
+ * The struct is a 256 byte header, an authentication block holding the
+ * hash and signature of the header and the auxiliary block, and the
+ * auxiliary block holding the public key and the descriptors. All of it
+ * is big-endian on disk and host order in the structs below.
+ */
+#define AVB_FOOTER_MAGIC       "AVBf"
+#define AVB_MAGIC              "AVB0"
+#define AVB_MAGIC_SIZE         4
+#define AVB_FOOTER_SIZE        64
+#define AVB_VBMETA_HEADER_SIZE 256
+
+/* What avb_find_vbmeta() found */
+enum avb_container {
+    AVB_NONE,           /* no AVB metadata */
+    AVB_FOOTER,         /* a partition image with a footer */
+    AVB_VBMETA_IMAGE    /* a vbmeta struct at the start of the file */
+};
+
+struct avb_footer {
+    uint32_t version_major;
+    uint32_t version_minor;
+    uint64_t original_image_size;
+    uint64_t vbmeta_offset;
+    uint64_t vbmeta_size;
+};
+
+struct avb_vbmeta_header {
+    uint32_t required_libavb_version_major;
+    uint32_t required_libavb_version_minor;
+    uint64_t authentication_data_block_size;
+    uint64_t auxiliary_data_block_size;
+    uint32_t algorithm_type;
+    uint64_t hash_offset;
+    uint64_t hash_size;
+    uint64_t signature_offset;
+    uint64_t signature_size;
+    uint64_t public_key_offset;
+    uint64_t public_key_size;
+    uint64_t public_key_metadata_offset;
+    uint64_t public_key_metadata_size;
+    uint64_t descriptors_offset;
+    uint64_t descriptors_size;
+    uint64_t rollback_index;
+    uint32_t flags;
+    uint32_t rollback_index_location;
+    char     release_string[49];
+};
+
+/* A vbmeta struct: its header and where its blocks are in memory */
+struct avb_vbmeta {
+    struct avb_vbmeta_header header;
+    const uint8_t            *data;            /* the header as it is on disk */
+    const uint8_t            *authentication;
+    const uint8_t            *auxiliary;
+};
+
+enum avb_descriptor_tag {
+    AVB_DESCRIPTOR_PROPERTY,
+    AVB_DESCRIPTOR_HASHTREE,
+    AVB_DESCRIPTOR_HASH,
+    AVB_DESCRIPTOR_KERNEL_CMDLINE,
+    AVB_DESCRIPTOR_CHAIN_PARTITION
+};
+
+struct avb_descriptor {
+    uint64_t      tag;
+    const uint8_t *data;        /* what follows the tag and size */
+    uint64_t      size;
+};
+
+/* A hash or hashtree descriptor: what a partition's contents must hash to */
+struct avb_hash_descriptor {
+    int           hashtree;
+    uint64_t      image_size;
+    char          hash_algorithm[33];
+    const uint8_t *partition_name;
+    uint32_t      partition_name_len;
+    const uint8_t *salt;
+    uint32_t      salt_len;
+    const uint8_t *digest;          /* the root digest of a hashtree */
+    uint32_t      digest_len;
+    uint32_t      flags;
+    uint32_t      dm_verity_version;    /* hashtree only, like the fields below */
+    uint64_t      tree_offset;
+    uint64_t      tree_size;
+    uint32_t      data_block_size;
+    uint32_t      hash_block_size;
+};
+
+int avb_find_vbmeta(const struct image_map *map, struct avb_footer *footer, struct avb_vbmeta *vbmeta,
+                    char *error, size_t error_size);
+int avb_next_descriptor(const struct avb_vbmeta *vbmeta, uint64_t *offset, struct avb_descriptor *descriptor);
+int avb_parse_hash_descriptor(const struct avb_descriptor *descriptor, struct avb_hash_descriptor *hash);
+int avb_verify_vbmeta(const struct avb_vbmeta *vbmeta, char *error, size_t error_size);
+int avb_verify_partition(const struct avb_hash_descriptor *hash, const uint8_t *image, uint64_t size,
+                         unsigned int threads, char *error, size_t error_size);
+int avb_verify_image(const char *filename, const struct image_map *map, unsigned int threads, FILE *out,
+                     char *error, size_t error_size);
+int avb_image(const char *filename, unsigned int threads, FILE *out);
+
+#endif
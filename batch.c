@@ -0,0 +1,283 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "bootimgtool.h"
+#include "create_image.h"
+#include "disassemble.h"
+#include "recipe.h"
+#include "thread_pool.h"
+#include "verify.h"
+
+#ifdef WIN32
+#include "win32.h"
+#endif
+
+/*
+ * A manifest is a text file with one job per line, as described in
+ * batch.h. Blank lines and lines starting with '#' are ignored. The
+ * output directory of a disassemble job is created if needed, and the
+ * files a create job reads are looked up in its recipe directory.
+ */
+struct batch {
+    struct batch_job *jobs;
+    size_t           count;
+    pthread_mutex_t  output_lock;
+};
+
+static int open_dir(const char *path, int create)
+{
+    if(create && mkdir(path, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    return open(path, O_RDONLY | O_DIRECTORY);
+}
+
+static int batch_verify(const struct batch_job *job, FILE *out)
+{
+    struct verify_result result;
+
+    if(verify_image(job->args[0], &result) < 0) {
+        fprintf(out, "FAILED: %s\n", result.error);
+        return 1;
+    }
+    fprintf(out, "OK\n");
+    return 0;
+}
+
+static int batch_disassemble(const struct batch_job *job)
+{
+    int dir_fd = open_dir(job->args[1], 1);
+    int status = 0;
+
+    if(dir_fd == -1) {
+        fprintf(error_stream(), "batch: could not create directory %s\n", job->args[1]);
+        return 1;
+    }
+    status = disassemble_image(job->args[0], dir_fd, NULL);
+    close(dir_fd);
+    return status;
+}
+
+static int batch_create(const struct batch_job *job, struct arena *arena)
+{
+    struct create_options options = { 1, ID_HASH_SHA1, CREATE_RAW, COMPRESSION_NONE, -1 };
+    struct bootimg_params params;
+    int                   dir_fd = open_dir(job->args[0], 0);
+    int                   recipe_fd = -1;
+    int                   status = 0;
+
+    if(dir_fd == -1) {
+        fprintf(error_stream(), "batch: could not open directory %s\n", job->args[0]);
+        return 1;
+    }
+
+    recipe_fd = openat(dir_fd, "recipe.cfg", O_RDONLY);
+
+    if(recipe_fd == -1) {
+        fprintf(error_stream(), "batch: no recipe.cfg in %s\n", job->args[0]);
+        close(dir_fd);
+        return 1;
+    }
+
+    memset(&params, 0, sizeof(struct bootimg_params));
+    parse_recipe(recipe_fd, &params);
+    options.arena = arena;
+    status = create_image_at(dir_fd, &params, &options, job->args[1]);
+    close(dir_fd);
+    return status;
+}
+
+/*
+ * Runs one job, writing what info and verify print to out. A create job
+ * takes its buffers from arena if it is not NULL.
+ */
+int run_batch_job(const struct batch_job *job, struct arena *arena, FILE *out)
+{
+    switch(job->op) {
+        case BATCH_INFO:
+            return info_image(job->args[0], out);
+        case BATCH_DISASSEMBLE:
+            return batch_disassemble(job);
+        case BATCH_CREATE:
+            return batch_create(job, arena);
+        case BATCH_VERIFY:
+            return batch_verify(job, out);
+    }
+    return 1;
+}
+
+static void run_job(size_t index, void *arg)
+{
+    struct batch     *batch = arg;
+    struct batch_job *job = &batch->jobs[index];
+    char             *text = NULL;
+    size_t           size = 0;
+    FILE             *out = open_memstream(&text, &size);
+
+    if(out == NULL) {
+        job->status = 1;
+        return;
+    }
+    job->status = run_batch_job(job, NULL, out);
+    fclose(out);
+
+    if(size > 0) {
+        pthread_mutex_lock(&batch->output_lock);
+        fprintf(stdout, "%s:\n%s\n", job->args[0], text);
+        pthread_mutex_unlock(&batch->output_lock);
+    }
+    free(text);
+}
+
+/*
+ * Parses one line into job. Returns 1 for a job, 0 for a blank line or
+ * a comment and -1 if the line is not valid.
+ */
+int parse_batch_line(char *line, unsigned int lineno, struct batch_job *job)
+{
+    char *save = NULL;
+    char *op = strtok_r(line, " \t\r\n", &save);
+    int  nargs = 2;
+
+    if(op == NULL || op[0] == '#') {
+        return 0;
+    }
+
+    if(!strcmp(op, "info")) {
+        job->op = BATCH_INFO;
+        nargs = 1;
+    } else if(!strcmp(op, "disassemble")) {
+        job->op = BATCH_DISASSEMBLE;
+    } else if(!strcmp(op, "create")) {
+        job->op = BATCH_CREATE;
+    } else if(!strcmp(op, "verify")) {
+        job->op = BATCH_VERIFY;
+        nargs = 1;
+    } else {
+        fprintf(error_stream(), "batch: line %u: unknown operation %s\n", lineno, op);
+        return -1;
+    }
+
+    job->args[0] = job->args[1] = NULL;
+    for(int i = 0; i < nargs; i++) {
+        job->args[i] = strtok_r(NULL, " \t\r\n", &save);
+
+        if(job->args[i] == NULL) {
+            fprintf(error_stream(), "batch: line %u: %s needs %d argument(s)\n", lineno, op, nargs);
+            return -1;
+        }
+    }
+    job->line = lineno;
+    job->status = 0;
+    return 1;
+}
+
+static char *load_manifest(const char *manifest)
+{
+    FILE   *fs = fopen(manifest, "r");
+    char   *data = NULL;
+    size_t size = 0;
+    long   file_size = 0;
+
+    if(fs == NULL) {
+        return NULL;
+    }
+
+    if(fseek(fs, 0, SEEK_END) == 0 && (file_size = ftell(fs)) >= 0) {
+        rewind(fs);
+        data = malloc(file_size + 1);
+
+        if(data != NULL) {
+            size = fread(data, 1, file_size, fs);
+            data[size] = '\0';
+        }
+    }
+    fclose(fs);
+    return data;
+}
+
+/*
+ * Parses the manifest and runs all of its jobs on a pool of threads
+ * worker threads. Every job runs even if an earlier one failed; the
+ * return value is 1 if any of them did.
+ */
+int run_batch(const char *manifest, unsigned int threads)
+{
+    struct batch batch;
+    char         *data = load_manifest(manifest);
+    char         *line = NULL;
+    char         *next = NULL;
+    size_t       capacity = 0;
+    unsigned int lineno = 0;
+    int          failed = 0;
+
+    if(data == NULL) {
+        fprintf(error_stream(), "batch: could not read manifest %s\n", manifest);
+        return 1;
+    }
+
+    memset(&batch, 0, sizeof(struct batch));
+
+    for(line = data; line != NULL; line = next) {
+        struct batch_job job;
+        int              ret = 0;
+
+        next = strchr(line, '\n');
+        if(next != NULL) {
+            *next++ = '\0';
+        }
+        lineno++;
+
+        if((ret = parse_batch_line(line, lineno, &job)) < 0) {
+            free(batch.jobs);
+            free(data);
+            return 1;
+        }
+
+        if(ret == 0) {
+            continue;
+        }
+
+        if(batch.count == capacity) {
+            struct batch_job *jobs = NULL;
+
+            capacity = capacity ? capacity * 2 : 64;
+            jobs = realloc(batch.jobs, capacity * sizeof(struct batch_job));
+
+            if(jobs == NULL) {
+                fprintf(error_stream(), "batch: out of memory\n");
+                free(batch.jobs);
+                free(data);
+                return 1;
+            }
+            batch.jobs = jobs;
+        }
+        batch.jobs[batch.count++] = job;
+    }
+
+    pthread_mutex_init(&batch.output_lock, NULL);
+    thread_pool_run(threads, batch.count, run_job, &batch);
+    pthread_mutex_destroy(&batch.output_lock);
+
+    for(size_t i = 0; i < batch.count; i++) {
+        if(batch.jobs[i].status != 0) {
+            fprintf(error_stream(), "batch: line %u: job failed\n", batch.jobs[i].line);
+            failed++;
+        }
+    }
+
+    if(failed > 0) {
+        fprintf(error_stream(), "batch: %d of %zu jobs failed\n", failed, batch.count);
+    }
+
+    free(batch.jobs);
+    free(data);
+    return failed > 0 ? 1 : 0;
+}
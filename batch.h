@@ -0,0 +1,34 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+
+#include "arena.h"
+
+/*
+ * One manifest line or serve request:
+ *
+ *   info        <image>
+ *   disassemble <image> <output directory>
+ *   create      <recipe directory> <output image>
+ *   verify      <image>
+ */
+enum batch_op {
+    BATCH_INFO,
+    BATCH_DISASSEMBLE,
+    BATCH_CREATE,
+    BATCH_VERIFY
+};
+
+struct batch_job {
+    enum batch_op op;
+    char          *args[2];
+    unsigned int  line;
+    int           status;
+};
+
+int parse_batch_line(char *line, unsigned int lineno, struct batch_job *job);
+int run_batch_job(const struct batch_job *job, struct arena *arena, FILE *out);
+int run_batch(const char *manifest, unsigned int threads);
+
+#endif
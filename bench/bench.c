@@ -0,0 +1,463 @@
+/*
+ * Benchmark driver for bootimgtool.
+ *
+ * Synthesizes boot images of a given payload size and header version and
+ * measures read_header, show_info, disassemble and create_image on them,
+ * the last two with both the POSIX and the io_uring backend, as well as
+ * the raw throughput of each id hash over the image.
+ * Every operation runs in its own child process so its peak RSS can be
+ * reported separately from the others.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bootimgtool.h"
+#include "create_image.h"
+#include "disassemble.h"
+#include "file_io.h"
+#include "image_id.h"
+#include "image_map.h"
+
+#define MIB (1024 * 1024)
+
+struct bench_config {
+    uint32_t     payload_mib;
+    unsigned int iterations;
+    unsigned int threads;
+    int          versions[3];
+    const char   *workdir;
+};
+
+/* State shared by the operations of one image under test */
+struct bench_image {
+    char                   path[4096];
+    char                   out_dir[4096];
+    int                    out_fd;
+    uint64_t               size;
+    struct bootimg_header hdr;
+    struct bootimg_params  params;
+    unsigned int           threads;
+    FILE                   *devnull;
+};
+
+typedef int (*bench_op)(struct bench_image *image);
+
+struct bench_case {
+    const char *name;
+    bench_op   run;
+    int        payload;     /* throughput is over the image, not the header */
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int op_read_header(struct bench_image *image)
+{
+    struct bootimg_header hdr;
+    int                    fd = open(image->path, O_RDONLY);
+    int                    ret = -1;
+
+    if(fd == -1) {
+        return -1;
+    }
+
+    if(is_valid_image(fd) > 0 && read_header(fd, &hdr) > 0) {
+        ret = 0;
+    }
+    close(fd);
+    return ret;
+}
+
+static int op_show_info(struct bench_image *image)
+{
+    show_info(image->devnull, &image->hdr);
+    return 0;
+}
+
+static int op_disassemble(struct bench_image *image)
+{
+    struct disassemble_options options = { .threads = image->threads };
+
+    return disassemble_image(image->path, image->out_fd, &options);
+}
+
+/* The same operations with section I/O batched through io_uring */
+static int op_disassemble_uring(struct bench_image *image)
+{
+    io_set_backend(IO_BACKEND_URING);
+    return op_disassemble(image);
+}
+
+static int op_create(struct bench_image *image)
+{
+    struct create_options options = { .threads = image->threads };
+    char                  path[4096 + 16];
+
+    snprintf(path, sizeof(path), "%s/repack.img", image->out_dir);
+    return create_image_at(image->out_fd, &image->params, &options, path);
+}
+
+static int op_create_uring(struct bench_image *image)
+{
+    io_set_backend(IO_BACKEND_URING);
+    return op_create(image);
+}
+
+/* Raw id hashing throughput over the whole image, without any I/O */
+static int op_hash(struct bench_image *image, enum id_hash type)
+{
+    struct image_id id;
+    struct image_map map;
+    uint32_t        digest[8];
+    int             fd = open(image->path, O_RDONLY);
+
+    if(fd == -1 || map_image(fd, &map) < 0) {
+        return -1;
+    }
+    close(fd);
+
+    if(image_id_init(&id, type) < 0) {
+        unmap_image(&map);
+        return -1;
+    }
+    image_id_update(&id, map.data, map.size);
+    image_id_final(&id, digest);
+    image_id_free(&id);
+    unmap_image(&map);
+    return 0;
+}
+
+static int op_hash_sha1(struct bench_image *image)
+{
+    return op_hash(image, ID_HASH_SHA1);
+}
+
+static int op_hash_sha256(struct bench_image *image)
+{
+    return op_hash(image, ID_HASH_SHA256);
+}
+
+static const struct bench_case cases[] = {
+    { "read_header",  op_read_header,       0 },
+    { "show_info",    op_show_info,         0 },
+    { "disassemble",  op_disassemble,       1 },
+    { "create",       op_create,            1 },
+    { "disasm_uring", op_disassemble_uring, 1 },
+    { "create_uring", op_create_uring,      1 },
+    { "id_sha1",      op_hash_sha1,         1 },
+    { "id_sha256",    op_hash_sha256,       1 },
+};
+
+static int write_payload(int dir_fd, const char *name, uint32_t size, uint32_t seed)
+{
+    uint32_t buffer[16384];
+    uint32_t state = seed | 1;
+    int      fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if(fd == -1) {
+        return -1;
+    }
+
+    while(size > 0) {
+        uint32_t chunk = size > sizeof(buffer) ? sizeof(buffer) : size;
+
+        for(size_t i = 0; i < sizeof(buffer) / sizeof(buffer[0]); i++) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            buffer[i] = state;
+        }
+
+        if(write(fd, buffer, chunk) != chunk) {
+            close(fd);
+            return -1;
+        }
+        size -= chunk;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * Builds a v0/v1/v2 image whose payload adds up to roughly payload_mib
+ * MiB: half ramdisk, a quarter kernel and the rest second stage (and dtb
+ * for v2), so every section type is exercised.
+ */
+static int synthesize_image(const struct bench_config *config, int version, struct bench_image *image)
+{
+    char                  src[4096];
+    uint64_t              payload = (uint64_t) config->payload_mib * MIB;
+    int                   src_fd = -1;
+    int                   fd = -1;
+    struct stat           st;
+    struct bootimg_params *params = &image->params;
+
+    snprintf(src, sizeof(src), "%s/v%d-src", config->workdir, version);
+    snprintf(image->path, sizeof(image->path), "%s/v%d.img", config->workdir, version);
+    snprintf(image->out_dir, sizeof(image->out_dir), "%s/v%d-out", config->workdir, version);
+
+    if(mkdir(src, 0755) < 0 || mkdir(image->out_dir, 0755) < 0) {
+        return -1;
+    }
+
+    src_fd = open(src, O_RDONLY | O_DIRECTORY);
+    image->out_fd = open(image->out_dir, O_RDONLY | O_DIRECTORY);
+
+    if(src_fd == -1 || image->out_fd == -1) {
+        return -1;
+    }
+
+    memset(params, 0, sizeof(struct bootimg_params));
+    params->kernel_addr = 0x10008000;
+    params->ramdisk_addr = 0x11000000;
+    params->second_addr = 0x10f00000;
+    params->tags_addr = 0x10000100;
+    params->page_size = 4096;
+    params->header_version = version;
+    params->os_version = (11 << 25) | (21 << 4) | 5;
+    params->dtb_addr = 0x11f00000;
+    strcpy((char *) params->kernel_filename, "kernel");
+    strcpy((char *) params->ramdisk_filename, "ramdisk");
+    strcpy((char *) params->second_filename, "second");
+    strcpy((char *) params->dtb_filename, "dtb");
+    strcpy((char *) params->cmdline, "console=ttyMSM0 androidboot.hardware=bench");
+    strcpy((char *) params->product_name, "bench");
+
+    if(write_payload(src_fd, "kernel", payload / 4, 1) < 0 ||
+       write_payload(src_fd, "ramdisk", payload / 2, 2) < 0 ||
+       write_payload(src_fd, "second", payload / 8, 3) < 0 ||
+       write_payload(src_fd, "dtb", payload / 8, 4) < 0) {
+        close(src_fd);
+        return -1;
+    }
+
+    if(create_image_at(src_fd, params, NULL, image->path) != 0) {
+        close(src_fd);
+        return -1;
+    }
+    close(src_fd);
+
+    fd = open(image->path, O_RDONLY);
+    if(fd == -1 || fstat(fd, &st) < 0 || read_header(fd, &image->hdr) < 0) {
+        return -1;
+    }
+    image->size = st.st_size;
+    close(fd);
+
+    /* create reads the sections disassemble wrote */
+    return disassemble_image(image->path, image->out_fd, NULL) == 0 ? 0 : -1;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, unsigned int count, double p)
+{
+    unsigned int index = (unsigned int) (p * (count - 1) + 0.5);
+
+    return sorted[index] / 1000.0;
+}
+
+/*
+ * Runs one warm-up iteration and then config->iterations timed ones in a
+ * child process, which sends the per-iteration latencies back over a
+ * pipe. The child's peak RSS comes from wait4().
+ */
+static int run_case(const struct bench_config *config, const struct bench_case *bc,
+                    struct bench_image *image, int version)
+{
+    unsigned int  n = config->iterations;
+    uint64_t      *latencies = calloc(n, sizeof(uint64_t));
+    uint64_t      total = 0;
+    int           pipe_fd[2];
+    int           status = 0;
+    struct rusage usage;
+    pid_t         pid;
+
+    if(latencies == NULL || pipe(pipe_fd) < 0) {
+        free(latencies);
+        return -1;
+    }
+
+    fflush(stdout);
+    pid = fork();
+
+    if(pid == 0) {
+        close(pipe_fd[0]);
+
+        if(bc->run(image) != 0) {
+            _exit(1);
+        }
+
+        for(unsigned int i = 0; i < n; i++) {
+            uint64_t start = now_ns();
+
+            if(bc->run(image) != 0) {
+                _exit(1);
+            }
+            latencies[i] = now_ns() - start;
+        }
+
+        if(write(pipe_fd[1], latencies, n * sizeof(uint64_t)) != (ssize_t) (n * sizeof(uint64_t))) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    close(pipe_fd[1]);
+
+    if(pid < 0 || read(pipe_fd[0], latencies, n * sizeof(uint64_t)) != (ssize_t) (n * sizeof(uint64_t))) {
+        fprintf(stderr, "bench: %s failed on v%d\n", bc->name, version);
+        close(pipe_fd[0]);
+        if(pid > 0)
+            wait4(pid, &status, 0, &usage);
+        free(latencies);
+        return -1;
+    }
+    close(pipe_fd[0]);
+    wait4(pid, &status, 0, &usage);
+
+    qsort(latencies, n, sizeof(uint64_t), compare_u64);
+
+    for(unsigned int i = 0; i < n; i++) {
+        total += latencies[i];
+    }
+
+    double seconds = total / 1e9;
+    uint64_t bytes = bc->payload ? image->size : sizeof(struct bootimg_header);
+
+    fprintf(stdout, "v%-6d %-12s %6u %12.0f %10.1f %10.1f %10.1f %10.1f %12ld\n",
+            version, bc->name, n, n / seconds, (double) bytes * n / MIB / seconds,
+            percentile_us(latencies, n, 0.50), percentile_us(latencies, n, 0.90),
+            percentile_us(latencies, n, 0.99), usage.ru_maxrss);
+
+    free(latencies);
+    return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void) st;
+    (void) flag;
+    (void) ftw;
+
+    return remove(path);
+}
+
+static int usage(void)
+{
+    fprintf(stdout, "bench [-s MiB] [-n iterations] [-v version]... [-j threads] [-d dir]\n\n");
+    fprintf(stdout, "-s\tPayload size of the synthesized images (default 64)\n");
+    fprintf(stdout, "-n\tTimed iterations per operation (default 10)\n");
+    fprintf(stdout, "-v\tHeader version to test, may be repeated (default 0, 1 and 2)\n");
+    fprintf(stdout, "-j\tThreads used by disassemble and create (default 1)\n");
+    fprintf(stdout, "-d\tWork directory (default: a new directory in /tmp)\n");
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_config config = { 64, 10, 1, { 0, 0, 0 }, NULL };
+    char                template[] = "/tmp/bootimgtool-bench.XXXXXX";
+    int                 any_version = 0;
+    int                 failed = 0;
+    int                 opt = 0;
+
+    while((opt = getopt(argc, argv, "s:n:v:j:d:h")) != -1) {
+        switch(opt) {
+            case 's':
+                config.payload_mib = atoi(optarg);
+                break;
+            case 'n':
+                config.iterations = atoi(optarg);
+                break;
+            case 'v':
+                if(atoi(optarg) < 0 || atoi(optarg) > 2) {
+                    return usage();
+                }
+                config.versions[atoi(optarg)] = 1;
+                any_version = 1;
+                break;
+            case 'j':
+                config.threads = atoi(optarg);
+                break;
+            case 'd':
+                config.workdir = optarg;
+                break;
+            default:
+                return usage();
+        }
+    }
+
+    if(config.payload_mib == 0 || config.iterations == 0 || config.threads == 0) {
+        return usage();
+    }
+
+    if(!any_version) {
+        config.versions[0] = config.versions[1] = config.versions[2] = 1;
+    }
+
+    if(config.workdir == NULL) {
+        config.workdir = mkdtemp(template);
+    } else if(mkdir(config.workdir, 0755) < 0) {
+        config.workdir = NULL;
+    }
+
+    if(config.workdir == NULL) {
+        fprintf(stderr, "bench: could not create work directory\n");
+        return 1;
+    }
+
+    fprintf(stdout, "payload %u MiB, %u iterations, %u thread(s)\n\n",
+            config.payload_mib, config.iterations, config.threads);
+    fprintf(stdout, "%-7s %-12s %6s %12s %10s %10s %10s %10s %12s\n",
+            "header", "operation", "iters", "ops/s", "MiB/s", "p50 us", "p90 us", "p99 us", "maxrss KiB");
+
+    for(int version = 0; version < 3; version++) {
+        struct bench_image image;
+
+        if(!config.versions[version]) {
+            continue;
+        }
+
+        memset(&image, 0, sizeof(struct bench_image));
+        image.threads = config.threads;
+        image.devnull = fopen("/dev/null", "w");
+
+        if(image.devnull == NULL || synthesize_image(&config, version, &image) < 0) {
+            fprintf(stderr, "bench: could not synthesize a v%d image in %s\n", version, config.workdir);
+            failed = 1;
+            break;
+        }
+
+        for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+            if(run_case(&config, &cases[i], &image, version) < 0) {
+                failed = 1;
+            }
+        }
+        close(image.out_fd);
+        fclose(image.devnull);
+    }
+
+    nftw(config.workdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return failed;
+}
@@ -9,6 +9,21 @@
 #define BOOT_ARGS_SIZE       512
 #define BOOT_EXTRA_ARGS_SIZE 1024
 
+#define VENDOR_BOOT_MAGIC "VNDRBOOT"
+#define VENDOR_BOOT_ARGS_SIZE 2048
+#define VENDOR_RAMDISK_NAME_SIZE 32
+#define VENDOR_RAMDISK_BOARD_ID_SIZE 16
+
+/* What a vendor ramdisk fragment is for */
+#define VENDOR_RAMDISK_TYPE_NONE     0
+#define VENDOR_RAMDISK_TYPE_PLATFORM 1
+#define VENDOR_RAMDISK_TYPE_RECOVERY 2
+#define VENDOR_RAMDISK_TYPE_DLKM     3
+
+/* Versions 3 and later put the header in a page of this size */
+#define BOOT_HEADER_V3_PAGE_SIZE 4096
+
+/* Header of versions 0 to 2 as it is on disk */
 struct bootimg_hdr_0_2 {
     /* v0 */
     uint8_t  magic[BOOT_MAGIC_SIZE];
@@ -41,7 +56,133 @@ struct bootimg_hdr_0_2 {
     uint64_t dtb_addr;
 } __attribute__((packed));
 
-#define EXTRA_BYTES_v1 12
-#define EXTRA_BYTES_v2 (EXTRA_BYTES_v1 + 16)
+/*
+ * Header of version 3 as it is on disk. Its command line is a single
+ * 1536 byte field, split here at the same place versions 0 to 2 split
+ * theirs.
+ */
+struct bootimg_hdr_v3 {
+    uint8_t  magic[BOOT_MAGIC_SIZE];
+    uint32_t kernel_size;
+    uint32_t ramdisk_size;
+    uint32_t os_version;
+    uint32_t header_size;
+    uint32_t reserved[4];
+    uint32_t header_version;
+    uint8_t  cmdline[BOOT_ARGS_SIZE];
+    uint8_t  extra_cmdline[BOOT_EXTRA_ARGS_SIZE];
+} __attribute__((packed));
+
+/* Header of version 4, which adds the boot signature to version 3 */
+struct bootimg_hdr_v4 {
+    uint8_t  magic[BOOT_MAGIC_SIZE];
+    uint32_t kernel_size;
+    uint32_t ramdisk_size;
+    uint32_t os_version;
+    uint32_t header_size;
+    uint32_t reserved[4];
+    uint32_t header_version;
+    uint8_t  cmdline[BOOT_ARGS_SIZE];
+    uint8_t  extra_cmdline[BOOT_EXTRA_ARGS_SIZE];
+    uint32_t signature_size;
+} __attribute__((packed));
+
+/*
+ * Header of a version 3 vendor_boot image as it is on disk. Its command
+ * line is split like that of version 3, with the rest of it after.
+ */
+struct vendor_boot_hdr_v3 {
+    uint8_t  magic[BOOT_MAGIC_SIZE];
+    uint32_t header_version;
+    uint32_t page_size;
+    uint32_t kernel_addr;
+    uint32_t ramdisk_addr;
+    uint32_t vendor_ramdisk_size;
+    uint8_t  cmdline[BOOT_ARGS_SIZE];
+    uint8_t  extra_cmdline[BOOT_EXTRA_ARGS_SIZE];
+    uint8_t  vendor_cmdline[VENDOR_BOOT_ARGS_SIZE - BOOT_ARGS_SIZE - BOOT_EXTRA_ARGS_SIZE];
+    uint32_t tags_addr;
+    uint8_t  name[BOOT_NAME_SIZE];
+    uint32_t header_size;
+    uint32_t dtb_size;
+    uint64_t dtb_addr;
+} __attribute__((packed));
+
+/* Header of a version 4 vendor_boot image, which adds the ramdisk table and bootconfig */
+struct vendor_boot_hdr_v4 {
+    uint8_t  magic[BOOT_MAGIC_SIZE];
+    uint32_t header_version;
+    uint32_t page_size;
+    uint32_t kernel_addr;
+    uint32_t ramdisk_addr;
+    uint32_t vendor_ramdisk_size;
+    uint8_t  cmdline[BOOT_ARGS_SIZE];
+    uint8_t  extra_cmdline[BOOT_EXTRA_ARGS_SIZE];
+    uint8_t  vendor_cmdline[VENDOR_BOOT_ARGS_SIZE - BOOT_ARGS_SIZE - BOOT_EXTRA_ARGS_SIZE];
+    uint32_t tags_addr;
+    uint8_t  name[BOOT_NAME_SIZE];
+    uint32_t header_size;
+    uint32_t dtb_size;
+    uint64_t dtb_addr;
+    uint32_t vendor_ramdisk_table_size;
+    uint32_t vendor_ramdisk_table_entry_num;
+    uint32_t vendor_ramdisk_table_entry_size;
+    uint32_t bootconfig_size;
+} __attribute__((packed));
+
+/* One fragment of the vendor ramdisk, as listed in the ramdisk table */
+struct vendor_ramdisk_table_entry {
+    uint32_t ramdisk_size;
+    uint32_t ramdisk_offset;        /* from the start of the vendor ramdisk */
+    uint32_t ramdisk_type;
+    uint8_t  ramdisk_name[VENDOR_RAMDISK_NAME_SIZE];
+    uint32_t board_id[VENDOR_RAMDISK_BOARD_ID_SIZE];
+} __attribute__((packed));
+
+/* Every boot image version keeps header_version at this offset */
+#define BOOT_HEADER_VERSION_OFFSET 40
+
+/* and every vendor_boot version at this one */
+#define VENDOR_BOOT_HEADER_VERSION_OFFSET 8
+
+/* The smallest header of any version */
+#define BOOT_HEADER_MIN_SIZE sizeof(struct bootimg_hdr_v3)
+
+/*
+ * A header of any version with every field any version has. The tables
+ * in layout.c convert it to and from the on-disk headers above; fields
+ * the version does not have are zero. The command line fields are
+ * adjacent so that the single command line of version 3 and later, and
+ * the longer one of vendor_boot, reads as one string. The ramdisk of a
+ * vendor_boot image is its vendor ramdisk.
+ */
+struct bootimg_header {
+    uint8_t  magic[BOOT_MAGIC_SIZE];
+    uint32_t kernel_size;
+    uint32_t kernel_addr;
+    uint32_t ramdisk_size;
+    uint32_t ramdisk_addr;
+    uint32_t second_size;
+    uint32_t second_addr;
+    uint32_t tags_addr;
+    uint32_t page_size;
+    uint32_t header_version;
+    uint32_t os_version;
+    uint8_t  name[BOOT_NAME_SIZE];
+    uint8_t  cmdline[BOOT_ARGS_SIZE];
+    uint8_t  extra_cmdline[BOOT_EXTRA_ARGS_SIZE];
+    uint8_t  vendor_cmdline[VENDOR_BOOT_ARGS_SIZE - BOOT_ARGS_SIZE - BOOT_EXTRA_ARGS_SIZE];
+    uint32_t id[8];
+    uint32_t recovery_dtbo_size;
+    uint64_t recovery_dtbo_offset;
+    uint32_t header_size;
+    uint32_t dtb_size;
+    uint64_t dtb_addr;
+    uint32_t signature_size;
+    uint32_t vendor_ramdisk_table_size;
+    uint32_t vendor_ramdisk_table_entry_num;
+    uint32_t vendor_ramdisk_table_entry_size;
+    uint32_t bootconfig_size;
+};
 
 #endif
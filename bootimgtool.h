@@ -1,29 +1,18 @@
+#include <stdio.h>
+
 #include "bootimg.h"
 
-enum rtypes {
-    RTYPE_KNN,        /* "knn" - kernel name */
-    RTYPE_KNA,        /* "kna" - kernel address */
-    RTYPE_RDN,        /* "rdn" - ramdisk name */
-    RTYPE_RDA,        /* "rda" - ramdisk address */
-    RTYPE_SEN,        /* "sen" - second filename */
-    RTYPE_SEA,        /* "sea" - second address */
-    RTYPE_TAA,        /* "taa" - tags address */
-    RTYPE_PAS,        /* "pas" - page size */
-    RTYPE_HEV,        /* "hev" - header version */
-    RTYPE_OSV,        /* "osv" - os version */
-    RTYPE_PNA,        /* "pna" - product name */
-    RTYPE_CMD,        /* "cmd" - cmdline */
-    RTYPE_IDV,        /* "idv" - id */
-    RTYPE_ECM,        /* "ecm" - extra cmdline */
-    RTYPE_REO,        /* "reo" - recovery dtbo image offset */
-    RTYPE_DTA,        /* "dto" - DTB addr */
-    RTYPE_DTN,        /* "dtn" - DTB filename */
-    RTYPE_RESERVED
-};
+/* Room for "2127-15" and "127.127.127" */
+#define OS_PATCH_LEVEL_SIZE 8
+#define OS_VERSION_SIZE     12
 
 int   is_valid_image(int fd);
-char* get_os_patch_level(uint32_t os_patch_level);
-char* get_os_version(uint32_t os_version);
-int   read_header(int fd, struct bootimg_hdr_0_2 *header);
-void  show_info(struct bootimg_hdr_0_2 *header);
-void  write_to_recipe(enum rtypes type, void *value, int fd);
+char* get_os_patch_level(uint32_t os_patch_level, char *patch_level);
+char* get_os_version(uint32_t os_version, char *version);
+int   read_header(int fd, struct bootimg_header *header);
+int   parse_header(const void *data, size_t size, struct bootimg_header *header);
+int   probe_image(int fd, struct bootimg_header *header);
+void  show_info(FILE *out, struct bootimg_header *header);
+int   info_image(const char *filename, FILE *out);
+FILE *error_stream(void);
+void  set_error_stream(FILE *stream);
@@ -0,0 +1,457 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <lzma.h>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+#include "compress.h"
+#include "stats.h"
+#include "thread_pool.h"
+
+/*
+ * gzip input is cut into blocks of this size that are deflated
+ * independently, each primed with the last 32 KiB of the one before as
+ * its dictionary, as pigz does. The result is a single ordinary gzip
+ * member whatever the number of threads.
+ */
+#define GZIP_BLOCK_SIZE (128 * 1024)
+#define GZIP_DICT_SIZE  (32 * 1024)
+
+/* Blocks compressed per thread before the batch is written out */
+#define BATCH_PER_THREAD 4
+
+/* The legacy lz4 format the kernel's initramfs loader expects */
+#define LZ4_LEGACY_MAGIC      0x184c2102
+#define LZ4_LEGACY_BLOCK_SIZE (8 * 1024 * 1024)
+
+#define STREAM_OUTPUT_SIZE (1024 * 1024)
+
+struct block {
+    const uint8_t *input;
+    size_t        input_size;
+    uint8_t       *output;
+    size_t        output_size;
+    uint32_t      crc;
+};
+
+struct compressor {
+    enum compression type;
+    int              level;
+    unsigned int     threads;
+    payload_sink     sink;
+    void             *arg;
+    int              failed;
+
+    /* Block compressors (gzip, lz4): input is gathered into a batch */
+    uint8_t          *batch;
+    size_t           block_size;
+    size_t           block_bound;   /* room for one compressed block */
+    size_t           batch_blocks;
+    size_t           batch_used;
+    struct block     *blocks;
+    uint8_t          dict[GZIP_DICT_SIZE];
+    size_t           dict_size;
+    int              started;
+    int              final;
+    uint32_t         crc;
+    uint64_t         total;
+
+    /* Stream compressors (xz, zstd) */
+    lzma_stream      xz;
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx        *zstd;
+#endif
+    uint8_t          *out;
+};
+
+/* Accepts "gzip", "xz", "lz4" or "zstd", optionally followed by ":level" */
+int compression_from_name(const char *name, enum compression *type, int *level)
+{
+    const char *colon = strchr(name, ':');
+    size_t     length = colon != NULL ? (size_t) (colon - name) : strlen(name);
+
+    *level = colon != NULL ? atoi(colon + 1) : -1;
+
+    if(length == 4 && !strncmp(name, "gzip", 4)) {
+        *type = COMPRESSION_GZIP;
+    } else if(length == 2 && !strncmp(name, "xz", 2)) {
+        *type = COMPRESSION_XZ;
+    } else if(length == 3 && !strncmp(name, "lz4", 3)) {
+        *type = COMPRESSION_LZ4;
+    } else if(length == 4 && !strncmp(name, "zstd", 4)) {
+        *type = COMPRESSION_ZSTD;
+    } else {
+        return -1;
+    }
+    return compression_supported(*type) ? 1 : -1;
+}
+
+static int emit(struct compressor *c, const void *data, size_t size)
+{
+    if(size > 0 && c->sink(data, size, c->arg) < 0) {
+        c->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static void put_le32(uint8_t *out, uint32_t value)
+{
+    out[0] = value;
+    out[1] = value >> 8;
+    out[2] = value >> 16;
+    out[3] = value >> 24;
+}
+
+/*
+ * Deflates one block as raw deflate data ending on a byte boundary, or
+ * ending the stream if it is the last block.
+ */
+static void deflate_block(size_t index, void *arg)
+{
+    struct compressor *c = arg;
+    struct block      *block = &c->blocks[index];
+    int               last = c->final && (index + 1) * c->block_size >= c->batch_used;
+    int               ret = Z_OK;
+    z_stream          stream;
+
+    memset(&stream, 0, sizeof(stream));
+    block->crc = crc32(0, block->input, block->input_size);
+    block->output_size = 0;
+
+    if(deflateInit2(&stream, c->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        __atomic_store_n(&c->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    /* The dictionary is the tail of the previous block, whichever batch it was in */
+    if(index > 0) {
+        size_t dict = block->input - c->batch > GZIP_DICT_SIZE ? GZIP_DICT_SIZE : block->input - c->batch;
+
+        deflateSetDictionary(&stream, block->input - dict, dict);
+    } else if(c->dict_size > 0) {
+        deflateSetDictionary(&stream, c->dict, c->dict_size);
+    }
+
+    stream.next_in = (Bytef *) block->input;
+    stream.avail_in = block->input_size;
+    stream.next_out = block->output;
+    stream.avail_out = c->block_bound;
+
+    /* Running out of room shows as an unfinished stream or a full buffer */
+    ret = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if((last && ret != Z_STREAM_END) || (!last && (ret != Z_OK || stream.avail_out == 0))) {
+        __atomic_store_n(&c->failed, 1, __ATOMIC_RELAXED);
+    }
+    block->output_size = stream.total_out;
+    deflateEnd(&stream);
+}
+
+#ifdef HAVE_LZ4
+/* One legacy lz4 block: its compressed size followed by the data */
+static void lz4_block(size_t index, void *arg)
+{
+    struct compressor *c = arg;
+    struct block      *block = &c->blocks[index];
+    int               size = LZ4_compress_HC((const char *) block->input, (char *) block->output + 4,
+                                             block->input_size, c->block_bound - 4,
+                                             c->level);
+
+    if(size <= 0) {
+        __atomic_store_n(&c->failed, 1, __ATOMIC_RELAXED);
+        block->output_size = 0;
+        return;
+    }
+    put_le32(block->output, size);
+    block->output_size = size + 4;
+}
+#endif
+
+/* Compresses the gathered batch on the thread pool and writes it out in order */
+static int flush_batch(struct compressor *c)
+{
+    size_t count = (c->batch_used + c->block_size - 1) / c->block_size;
+
+    /* An empty gzip stream still needs its final deflate block */
+    if(count == 0 && c->type == COMPRESSION_GZIP && c->final) {
+        count = 1;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        c->blocks[i].input = c->batch + i * c->block_size;
+        c->blocks[i].input_size = c->batch_used - i * c->block_size > c->block_size ? c->block_size
+                                                                                    : c->batch_used - i * c->block_size;
+    }
+
+#ifdef HAVE_LZ4
+    if(c->type == COMPRESSION_LZ4) {
+        thread_pool_run(c->threads, count, lz4_block, c);
+    } else
+#endif
+    {
+        thread_pool_run(c->threads, count, deflate_block, c);
+    }
+
+    if(c->failed) {
+        return -1;
+    }
+
+    if(!c->started) {
+        static const uint8_t gzip_header[] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+        uint8_t              lz4_header[4];
+
+        put_le32(lz4_header, LZ4_LEGACY_MAGIC);
+        if(emit(c, c->type == COMPRESSION_GZIP ? gzip_header : lz4_header,
+                c->type == COMPRESSION_GZIP ? sizeof(gzip_header) : sizeof(lz4_header)) < 0) {
+            return -1;
+        }
+        c->started = 1;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        if(emit(c, c->blocks[i].output, c->blocks[i].output_size) < 0) {
+            return -1;
+        }
+        c->crc = crc32_combine(c->crc, c->blocks[i].crc, c->blocks[i].input_size);
+        c->total += c->blocks[i].input_size;
+    }
+
+    if(c->type == COMPRESSION_GZIP && c->batch_used > 0) {
+        c->dict_size = c->batch_used > GZIP_DICT_SIZE ? GZIP_DICT_SIZE : c->batch_used;
+        memcpy(c->dict, c->batch + c->batch_used - c->dict_size, c->dict_size);
+    }
+    c->batch_used = 0;
+    return 0;
+}
+
+static int run_xz(struct compressor *c, const uint8_t *data, size_t size, lzma_action action)
+{
+    lzma_ret ret = LZMA_OK;
+
+    c->xz.next_in = data;
+    c->xz.avail_in = size;
+
+    do {
+        c->xz.next_out = c->out;
+        c->xz.avail_out = STREAM_OUTPUT_SIZE;
+        ret = lzma_code(&c->xz, action);
+
+        if(ret != LZMA_OK && ret != LZMA_STREAM_END) {
+            c->failed = 1;
+            return -1;
+        }
+
+        if(emit(c, c->out, STREAM_OUTPUT_SIZE - c->xz.avail_out) < 0) {
+            return -1;
+        }
+    } while(c->xz.avail_in > 0 || (action == LZMA_FINISH && ret != LZMA_STREAM_END));
+    return 0;
+}
+
+#ifdef HAVE_ZSTD
+static int run_zstd(struct compressor *c, const uint8_t *data, size_t size, ZSTD_EndDirective mode)
+{
+    ZSTD_inBuffer in = { data, size, 0 };
+    size_t        remaining = 0;
+
+    do {
+        ZSTD_outBuffer out = { c->out, STREAM_OUTPUT_SIZE, 0 };
+
+        remaining = ZSTD_compressStream2(c->zstd, &out, &in, mode);
+
+        if(ZSTD_isError(remaining) || emit(c, c->out, out.pos) < 0) {
+            c->failed = 1;
+            return -1;
+        }
+    } while(in.pos < in.size || (mode == ZSTD_e_end && remaining != 0));
+    return 0;
+}
+#endif
+
+/*
+ * Sets up a compressor that passes its output to sink in order. gzip
+ * and lz4 compress independent blocks on up to threads threads; xz and
+ * zstd use their libraries' own worker threads. A level of -1 picks the
+ * format's default. xz streams use CRC32 checks, the only kind the
+ * kernel's decoder understands.
+ */
+struct compressor *compressor_create(enum compression type, int level, unsigned int threads,
+                                     payload_sink sink, void *arg)
+{
+    struct compressor *c = calloc(1, sizeof(struct compressor));
+    lzma_stream       xz = LZMA_STREAM_INIT;
+
+    if(c == NULL) {
+        return NULL;
+    }
+    c->type = type;
+    c->threads = threads > 0 ? threads : 1;
+    c->sink = sink;
+    c->arg = arg;
+    c->xz = xz;
+
+    switch(type) {
+        case COMPRESSION_GZIP:
+            c->level = level >= 0 ? level : Z_DEFAULT_COMPRESSION;
+            c->block_size = GZIP_BLOCK_SIZE;
+            c->crc = crc32(0, NULL, 0);
+            c->block_bound = compressBound(GZIP_BLOCK_SIZE) + 64;
+            break;
+#ifdef HAVE_LZ4
+        case COMPRESSION_LZ4:
+            c->level = level >= 0 ? level : LZ4HC_CLEVEL_DEFAULT;
+            c->block_size = LZ4_LEGACY_BLOCK_SIZE;
+            c->block_bound = LZ4_compressBound(LZ4_LEGACY_BLOCK_SIZE) + 4;
+            break;
+#endif
+        case COMPRESSION_XZ: {
+            lzma_mt mt;
+
+            memset(&mt, 0, sizeof(mt));
+            mt.threads = c->threads;
+            mt.preset = level >= 0 ? (uint32_t) level : LZMA_PRESET_DEFAULT;
+            mt.check = LZMA_CHECK_CRC32;
+
+            if(lzma_stream_encoder_mt(&c->xz, &mt) != LZMA_OK) {
+                free(c);
+                return NULL;
+            }
+            break;
+        }
+#ifdef HAVE_ZSTD
+        case COMPRESSION_ZSTD:
+            c->zstd = ZSTD_createCCtx();
+
+            if(c->zstd == NULL) {
+                free(c);
+                return NULL;
+            }
+            ZSTD_CCtx_setParameter(c->zstd, ZSTD_c_compressionLevel, level >= 0 ? level : ZSTD_CLEVEL_DEFAULT);
+            ZSTD_CCtx_setParameter(c->zstd, ZSTD_c_nbWorkers, c->threads > 1 ? c->threads : 0);
+            break;
+#endif
+        default:
+            free(c);
+            return NULL;
+    }
+
+    if(c->block_size > 0) {
+        /* lz4 blocks are large enough to keep every thread busy on their own */
+        c->batch_blocks = c->threads * (c->type == COMPRESSION_GZIP ? BATCH_PER_THREAD : 1);
+        c->batch = stats_malloc(c->batch_blocks * c->block_size);
+        c->blocks = calloc(c->batch_blocks, sizeof(struct block));
+        c->out = stats_malloc(c->batch_blocks * c->block_bound);
+
+        if(c->blocks != NULL && c->out != NULL) {
+            for(size_t i = 0; i < c->batch_blocks; i++) {
+                c->blocks[i].output = c->out + i * c->block_bound;
+            }
+        }
+    } else {
+        c->out = stats_malloc(STREAM_OUTPUT_SIZE);
+    }
+
+    if(c->out == NULL || (c->block_size > 0 && (c->batch == NULL || c->blocks == NULL))) {
+        c->failed = 1;
+        compressor_finish(c);
+        return NULL;
+    }
+    return c;
+}
+
+/*
+ * Feeds size bytes to the compressor. Has the signature of a
+ * payload_sink, so producers such as the cpio packer can write into it
+ * directly.
+ */
+int compressor_write(const uint8_t *data, size_t size, void *arg)
+{
+    struct compressor  *c = arg;
+    struct stats_timer timer;
+    int                ret = 0;
+
+    if(c->failed) {
+        return -1;
+    }
+
+    stats_begin(&timer);
+    if(c->block_size == 0) {
+#ifdef HAVE_ZSTD
+        if(c->type == COMPRESSION_ZSTD) {
+            ret = run_zstd(c, data, size, ZSTD_e_continue);
+        } else
+#endif
+        {
+            ret = run_xz(c, data, size, LZMA_RUN);
+        }
+    }
+
+    while(c->block_size > 0 && size > 0 && ret == 0) {
+        size_t room = c->batch_blocks * c->block_size - c->batch_used;
+        size_t take = size < room ? size : room;
+
+        memcpy(c->batch + c->batch_used, data, take);
+        c->batch_used += take;
+        data += take;
+        size -= take;
+
+        /* The last batch is left for compressor_finish() so it can end the stream */
+        if(size > 0 && c->batch_used == c->batch_blocks * c->block_size) {
+            ret = flush_batch(c);
+        }
+    }
+    stats_end(&timer, STATS_COMPRESS);
+    return ret;
+}
+
+/*
+ * Compresses what is left, ends the stream and frees the compressor.
+ * Returns -1 if anything failed along the way.
+ */
+int compressor_finish(struct compressor *c)
+{
+    struct stats_timer timer;
+    int                ret = c->failed ? -1 : 0;
+
+    stats_begin(&timer);
+    if(ret == 0) {
+        if(c->type == COMPRESSION_GZIP || c->type == COMPRESSION_LZ4) {
+            c->final = 1;
+            ret = flush_batch(c);
+
+            if(ret == 0 && c->type == COMPRESSION_GZIP) {
+                uint8_t trailer[8];
+
+                put_le32(trailer, c->crc);
+                put_le32(trailer + 4, c->total);
+                ret = emit(c, trailer, sizeof(trailer));
+            }
+#ifdef HAVE_ZSTD
+        } else if(c->type == COMPRESSION_ZSTD) {
+            ret = run_zstd(c, NULL, 0, ZSTD_e_end);
+#endif
+        } else {
+            ret = run_xz(c, NULL, 0, LZMA_FINISH);
+        }
+    }
+    stats_end(&timer, STATS_COMPRESS);
+
+    lzma_end(&c->xz);
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(c->zstd);
+#endif
+    free(c->batch);
+    free(c->blocks);
+    free(c->out);
+    free(c);
+    return ret;
+}
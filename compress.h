@@ -0,0 +1,17 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "decompress.h"
+
+struct compressor;
+
+int                compression_from_name(const char *name, enum compression *type, int *level);
+struct compressor *compressor_create(enum compression type, int level, unsigned int threads,
+                                     payload_sink sink, void *arg);
+int                compressor_write(const uint8_t *data, size_t size, void *compressor);
+int                compressor_finish(struct compressor *compressor);
+
+#endif
@@ -0,0 +1,564 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "bootimgtool.h"
+#include "cpio.h"
+#include "file_io.h"
+#include "stats.h"
+
+/* The "newc" format mkbootfs and the kernel's initramfs use */
+#define CPIO_HEADER_SIZE 110
+#define CPIO_TRAILER     "TRAILER!!!"
+
+enum cpio_state {
+    CPIO_HEADER,
+    CPIO_NAME,
+    CPIO_DATA,
+    CPIO_PADDING,
+    CPIO_BETWEEN    /* after a trailer, where only zeros or another archive may follow */
+};
+
+struct cpio_link {
+    char             *name;
+    char             *target;
+    struct cpio_link *next;
+};
+
+struct cpio_unpacker {
+    int              dir_fd;
+    enum cpio_state  state;
+    uint8_t          header[CPIO_HEADER_SIZE];
+    char             name[PATH_MAX];
+    char             target[PATH_MAX];
+    size_t           have;          /* bytes of the current field collected so far */
+    uint32_t         mode;
+    uint32_t         name_size;
+    uint32_t         file_size;
+    uint32_t         padding;
+    int              fd;            /* output of the current regular file */
+    int              skip;          /* the current entry is not extracted */
+    struct cpio_link *links;
+    int              failed;
+};
+
+struct cpio_unpacker *cpio_unpacker_create(int dir_fd)
+{
+    struct cpio_unpacker *unpacker = calloc(1, sizeof(struct cpio_unpacker));
+
+    if(unpacker != NULL) {
+        unpacker->dir_fd = dir_fd;
+        unpacker->fd = -1;
+    }
+    return unpacker;
+}
+
+static uint32_t parse_hex(const uint8_t *field)
+{
+    char text[9];
+
+    memcpy(text, field, 8);
+    text[8] = '\0';
+    return strtoul(text, NULL, 16);
+}
+
+static uint32_t pad4(uint32_t size)
+{
+    return (4 - (size & 3)) & 3;
+}
+
+/*
+ * Makes an archive path relative to the output directory. Leading "/"
+ * and "./" are dropped and paths with a ".." component are refused, so
+ * nothing can be written outside the directory.
+ */
+static const char *sanitize_name(char *name)
+{
+    const char *component = NULL;
+
+    while(*name == '/' || (name[0] == '.' && name[1] == '/')) {
+        name += *name == '/' ? 1 : 2;
+    }
+
+    if(*name == '\0' || !strcmp(name, ".")) {
+        return NULL;
+    }
+
+    for(component = name; component != NULL; component = strchr(component, '/')) {
+        if(*component == '/') {
+            component++;
+        }
+
+        if(!strncmp(component, "..", 2) && (component[2] == '/' || component[2] == '\0')) {
+            return NULL;
+        }
+    }
+    return name;
+}
+
+/* Creates the missing parent directories of name */
+static void make_parents(int dir_fd, const char *name)
+{
+    char path[PATH_MAX];
+    char *slash = NULL;
+
+    strcpy(path, name);
+    for(slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdirat(dir_fd, path, 0755);
+        *slash = '/';
+    }
+}
+
+static int open_entry(struct cpio_unpacker *unpacker, const char *name)
+{
+    int fd = io_openat(unpacker->dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW,
+                       unpacker->mode & 0777);
+
+    if(fd == -1 && errno == ENOENT) {
+        make_parents(unpacker->dir_fd, name);
+        fd = io_openat(unpacker->dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, unpacker->mode & 0777);
+    }
+    return fd;
+}
+
+/*
+ * Symlinks are created once the whole archive has been unpacked, so an
+ * entry can never be written through a link the archive itself made.
+ */
+static int defer_link(struct cpio_unpacker *unpacker, const char *name)
+{
+    struct cpio_link *link = malloc(sizeof(struct cpio_link));
+
+    if(link == NULL) {
+        return -1;
+    }
+    link->name = strdup(name);
+    link->target = strdup(unpacker->target);
+    link->next = unpacker->links;
+    unpacker->links = link;
+    return link->name != NULL && link->target != NULL ? 0 : -1;
+}
+
+/* Acts on an entry once its name is known */
+static int begin_entry(struct cpio_unpacker *unpacker)
+{
+    const char *name = sanitize_name(unpacker->name);
+
+    unpacker->skip = 1;
+
+    if(name == NULL) {
+        return 0;
+    }
+
+    switch(unpacker->mode & S_IFMT) {
+        case S_IFDIR:
+            if(mkdirat(unpacker->dir_fd, name, (unpacker->mode & 07777) | 0700) < 0 && errno == ENOENT) {
+                make_parents(unpacker->dir_fd, name);
+                mkdirat(unpacker->dir_fd, name, (unpacker->mode & 07777) | 0700);
+            }
+            return 0;
+        case S_IFREG:
+            unpacker->fd = open_entry(unpacker, name);
+
+            if(unpacker->fd == -1) {
+                fprintf(error_stream(), "unpack: could not create %s\n", name);
+                return -1;
+            }
+            unpacker->skip = 0;
+            return 0;
+        case S_IFLNK:
+            if(unpacker->file_size >= PATH_MAX) {
+                return -1;
+            }
+            unpacker->skip = 0;
+            return 0;
+        default:
+            /* Device nodes, fifos and sockets need privileges and are left out */
+            return 0;
+    }
+}
+
+static int end_entry(struct cpio_unpacker *unpacker)
+{
+    const char *name = sanitize_name(unpacker->name);
+    int        ret = 0;
+
+    if(unpacker->fd != -1) {
+        io_close(unpacker->fd);
+        unpacker->fd = -1;
+    } else if(!unpacker->skip && (unpacker->mode & S_IFMT) == S_IFLNK) {
+        unpacker->target[unpacker->file_size] = '\0';
+        ret = defer_link(unpacker, name);
+    }
+    return ret;
+}
+
+static int write_entry_data(struct cpio_unpacker *unpacker, const uint8_t *data, size_t size)
+{
+    if(unpacker->skip) {
+        return 0;
+    }
+
+    if(unpacker->fd == -1) {
+        memcpy(unpacker->target + unpacker->have, data, size);
+        return 0;
+    }
+
+    while(size > 0) {
+        ssize_t written = io_write(unpacker->fd, data, size);
+
+        if(written < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if(written <= 0) {
+            return -1;
+        }
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+static int parse_entry_header(struct cpio_unpacker *unpacker)
+{
+    const uint8_t *h = unpacker->header;
+
+    if(memcmp(h, "070701", 6) && memcmp(h, "070702", 6)) {
+        return -1;
+    }
+    unpacker->mode = parse_hex(h + 14);
+    unpacker->file_size = parse_hex(h + 54);
+    unpacker->name_size = parse_hex(h + 94);
+
+    if(unpacker->name_size == 0 || unpacker->name_size > PATH_MAX) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Feeds the next size bytes of a newc cpio archive to the unpacker,
+ * which has the signature of a payload_sink so a ramdisk can be
+ * unpacked straight out of the decompressor. Entries are written under
+ * the directory given to cpio_unpacker_create() as they arrive.
+ * Concatenated archives, as vendor ramdisks use, are unpacked in turn.
+ */
+int cpio_unpack(const uint8_t *data, size_t size, void *arg)
+{
+    struct cpio_unpacker *unpacker = arg;
+    struct stats_timer   timer;
+
+    if(unpacker->failed) {
+        return -1;
+    }
+
+    stats_begin(&timer);
+    while(size > 0) {
+        size_t take = 0;
+
+        switch(unpacker->state) {
+            case CPIO_BETWEEN:
+                if(*data == 0) {
+                    data++;
+                    size--;
+                    continue;
+                }
+                unpacker->state = CPIO_HEADER;
+                unpacker->have = 0;
+                /* fall through */
+            case CPIO_HEADER:
+                take = CPIO_HEADER_SIZE - unpacker->have;
+                take = take < size ? take : size;
+                memcpy(unpacker->header + unpacker->have, data, take);
+                unpacker->have += take;
+
+                if(unpacker->have == CPIO_HEADER_SIZE) {
+                    if(parse_entry_header(unpacker) < 0) {
+                        goto fail;
+                    }
+                    unpacker->state = CPIO_NAME;
+                    unpacker->have = 0;
+                }
+                break;
+            case CPIO_NAME:
+                take = unpacker->name_size + pad4(CPIO_HEADER_SIZE + unpacker->name_size) - unpacker->have;
+                take = take < size ? take : size;
+
+                for(size_t i = 0; i < take; i++, unpacker->have++) {
+                    if(unpacker->have < unpacker->name_size) {
+                        unpacker->name[unpacker->have] = data[i];
+                    }
+                }
+
+                if(unpacker->have == unpacker->name_size + pad4(CPIO_HEADER_SIZE + unpacker->name_size)) {
+                    unpacker->name[unpacker->name_size - 1] = '\0';
+                    unpacker->have = 0;
+
+                    if(!strcmp(unpacker->name, CPIO_TRAILER)) {
+                        unpacker->state = CPIO_BETWEEN;
+                    } else if(begin_entry(unpacker) < 0) {
+                        goto fail;
+                    } else {
+                        unpacker->state = CPIO_DATA;
+                    }
+                }
+                break;
+            case CPIO_DATA:
+                take = unpacker->file_size - unpacker->have;
+                take = take < size ? take : size;
+
+                if(write_entry_data(unpacker, data, take) < 0) {
+                    goto fail;
+                }
+                unpacker->have += take;
+
+                if(unpacker->have == unpacker->file_size) {
+                    if(end_entry(unpacker) < 0) {
+                        goto fail;
+                    }
+                    unpacker->padding = pad4(unpacker->file_size);
+                    unpacker->state = CPIO_PADDING;
+                    unpacker->have = 0;
+                }
+                break;
+            case CPIO_PADDING:
+                take = unpacker->padding - unpacker->have;
+                take = take < size ? take : size;
+                unpacker->have += take;
+
+                if(unpacker->have == unpacker->padding) {
+                    unpacker->state = CPIO_HEADER;
+                    unpacker->have = 0;
+                }
+                break;
+        }
+        data += take;
+        size -= take;
+    }
+    stats_end(&timer, STATS_UNPACK);
+    return 0;
+
+fail:
+    stats_end(&timer, STATS_UNPACK);
+    unpacker->failed = 1;
+    return -1;
+}
+
+/*
+ * Creates the deferred symlinks and frees the unpacker. Returns -1 if
+ * unpacking failed or the archive ended in the middle of an entry.
+ */
+int cpio_unpacker_finish(struct cpio_unpacker *unpacker)
+{
+    int ret = unpacker->failed || unpacker->state != CPIO_BETWEEN ? -1 : 0;
+
+    if(unpacker->fd != -1) {
+        io_close(unpacker->fd);
+    }
+
+    while(unpacker->links != NULL) {
+        struct cpio_link *link = unpacker->links;
+
+        if(ret == 0 && symlinkat(link->target, unpacker->dir_fd, link->name) < 0 && errno == ENOENT) {
+            make_parents(unpacker->dir_fd, link->name);
+            symlinkat(link->target, unpacker->dir_fd, link->name);
+        }
+        unpacker->links = link->next;
+        free(link->name);
+        free(link->target);
+        free(link);
+    }
+    free(unpacker);
+    return ret;
+}
+
+struct cpio_packer {
+    payload_sink sink;
+    void         *arg;
+    uint32_t     ino;
+    uint8_t      *buffer;
+};
+
+/* Size of the buffer regular files are read through while packing */
+#define CPIO_PACK_CHUNK (1024 * 1024)
+
+static int pack_bytes(struct cpio_packer *packer, const void *data, size_t size)
+{
+    if(size > 0 && packer->sink(data, size, packer->arg) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int pack_padding(struct cpio_packer *packer, uint32_t size)
+{
+    static const uint8_t zeros[4];
+
+    return pack_bytes(packer, zeros, pad4(size));
+}
+
+/*
+ * Writes the header and name of an entry. Owners and times are zeroed,
+ * as mkbootfs does, so the archive only depends on the tree's contents.
+ */
+static int pack_header(struct cpio_packer *packer, const char *name, const struct stat *st, uint32_t size)
+{
+    char     header[CPIO_HEADER_SIZE + 1];
+    uint32_t name_size = strlen(name) + 1;
+    uint32_t mode = st != NULL ? st->st_mode : 0;
+    uint32_t rdev_major = st != NULL ? major(st->st_rdev) : 0;
+    uint32_t rdev_minor = st != NULL ? minor(st->st_rdev) : 0;
+
+    snprintf(header, sizeof(header), "070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+             packer->ino++, mode, 0, 0, 1, 0, size, 0, 0, rdev_major, rdev_minor, name_size, 0);
+
+    if(pack_bytes(packer, header, CPIO_HEADER_SIZE) < 0 || pack_bytes(packer, name, name_size) < 0) {
+        return -1;
+    }
+    return pack_padding(packer, CPIO_HEADER_SIZE + name_size);
+}
+
+static int pack_file(struct cpio_packer *packer, int dir_fd, const char *name, const char *path,
+                     const struct stat *st)
+{
+    int      fd = -1;
+    uint64_t left = st->st_size;
+
+    if(st->st_size > UINT32_MAX || (fd = io_openat(dir_fd, name, O_RDONLY | O_NOFOLLOW, 0)) == -1) {
+        fprintf(error_stream(), "pack: could not read %s\n", path);
+        return -1;
+    }
+
+    if(pack_header(packer, path, st, st->st_size) < 0) {
+        io_close(fd);
+        return -1;
+    }
+
+    while(left > 0) {
+        ssize_t bytes_read = io_read(fd, packer->buffer, left > CPIO_PACK_CHUNK ? CPIO_PACK_CHUNK : left);
+
+        if(bytes_read <= 0 || pack_bytes(packer, packer->buffer, bytes_read) < 0) {
+            io_close(fd);
+            return -1;
+        }
+        left -= bytes_read;
+    }
+    io_close(fd);
+    return pack_padding(packer, st->st_size);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* Packs the entries of dir_fd in name order, so the archive is reproducible */
+static int pack_dir(struct cpio_packer *packer, int dir_fd, const char *prefix)
+{
+    DIR           *dir = NULL;
+    struct dirent *entry = NULL;
+    char          **names = NULL;
+    size_t        count = 0;
+    size_t        capacity = 0;
+    int           dup_fd = dup(dir_fd);
+    int           ret = 0;
+
+    if(dup_fd == -1 || (dir = fdopendir(dup_fd)) == NULL) {
+        if(dup_fd != -1)
+            close(dup_fd);
+        return -1;
+    }
+
+    while((entry = readdir(dir)) != NULL) {
+        if(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+
+        if(count == capacity) {
+            char **grown = realloc(names, (capacity = capacity ? capacity * 2 : 64) * sizeof(char *));
+
+            if(grown == NULL) {
+                ret = -1;
+                break;
+            }
+            names = grown;
+        }
+
+        if((names[count] = strdup(entry->d_name)) == NULL) {
+            ret = -1;
+            break;
+        }
+        count++;
+    }
+    closedir(dir);
+    qsort(names, count, sizeof(char *), compare_names);
+
+    for(size_t i = 0; i < count && ret == 0; i++) {
+        char        path[PATH_MAX];
+        char        target[PATH_MAX];
+        struct stat st;
+        ssize_t     length = 0;
+        int         sub_fd = -1;
+
+        if(snprintf(path, sizeof(path), "%s%s%s", prefix, *prefix ? "/" : "", names[i]) >= (int) sizeof(path) ||
+           fstatat(dir_fd, names[i], &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            ret = -1;
+            break;
+        }
+
+        switch(st.st_mode & S_IFMT) {
+            case S_IFDIR:
+                sub_fd = io_openat(dir_fd, names[i], O_RDONLY | O_DIRECTORY | O_NOFOLLOW, 0);
+                ret = sub_fd == -1 || pack_header(packer, path, &st, 0) < 0 ? -1 : pack_dir(packer, sub_fd, path);
+                if(sub_fd != -1)
+                    io_close(sub_fd);
+                break;
+            case S_IFREG:
+                ret = pack_file(packer, dir_fd, names[i], path, &st);
+                break;
+            case S_IFLNK:
+                length = readlinkat(dir_fd, names[i], target, sizeof(target));
+                ret = length < 0 || length == sizeof(target) || pack_header(packer, path, &st, length) < 0 ||
+                      pack_bytes(packer, target, length) < 0 ? -1 : pack_padding(packer, length);
+                break;
+            default:
+                ret = pack_header(packer, path, &st, 0);
+                break;
+        }
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+    return ret;
+}
+
+/*
+ * Packs the tree under dir_fd into a newc cpio archive, passing it to
+ * sink as it is produced, so it can go straight into a compressor.
+ */
+int cpio_pack(int dir_fd, payload_sink sink, void *arg)
+{
+    struct cpio_packer packer = { sink, arg, 300000, stats_malloc(CPIO_PACK_CHUNK) };
+    int                ret = -1;
+
+    if(packer.buffer == NULL) {
+        return -1;
+    }
+
+    if(pack_dir(&packer, dir_fd, "") == 0 && pack_header(&packer, CPIO_TRAILER, NULL, 0) == 0) {
+        ret = 0;
+    }
+    free(packer.buffer);
+    return ret;
+}
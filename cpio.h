@@ -0,0 +1,16 @@
+#ifndef CPIO_H
+#define CPIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "decompress.h"
+
+struct cpio_unpacker;
+
+struct cpio_unpacker *cpio_unpacker_create(int dir_fd);
+int                   cpio_unpack(const uint8_t *data, size_t size, void *unpacker);
+int                   cpio_unpacker_finish(struct cpio_unpacker *unpacker);
+int                   cpio_pack(int dir_fd, payload_sink sink, void *arg);
+
+#endif
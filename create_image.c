@@ -1,158 +1,916 @@
+#include <errno.h>
 #include <fcntl.h>
-#include <openssl/sha.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "bootimgtool.h"
+#include "compress.h"
 #include "create_image.h"
+#include "file_io.h"
+#include "image_id.h"
+#include "layout.h"
+#include "repack_cache.h"
+#include "sparse_image.h"
+#include "stats.h"
+#include "store.h"
+#include "thread_pool.h"
+#include "uring.h"
 
 #ifdef WIN32
 #include "win32.h"
+#else
+#include "cpio.h"
 #endif
 
+/* Payloads are hashed and copied through a buffer of this size. */
+#define CHUNK_SIZE (1024 * 1024)
+
+/* Every section, with the ramdisk split into its vendor ramdisk fragments */
+#define MAX_SOURCES (SECTION_COUNT + VENDOR_RAMDISK_MAX)
+
 static uint32_t align(uint32_t value)
 {
     unsigned int alignment_mask = 4 - 1;
     return (value + alignment_mask) & ~alignment_mask;
 }
 
-static uint8_t *load_file(const char *filename, uint32_t *file_size)
+static int open_file(int dir_fd, const char *filename, uint32_t *file_size)
 {
     int fd = 0;
-    uint8_t *data = NULL;
+    struct stat st;
+    struct stats_timer timer;
 
-    fd = open(filename, O_RDONLY);
+    stats_begin(&timer);
+    fd = io_openat(dir_fd, filename, O_RDONLY, 0);
 
-    if(fd > 0)
+    if(fd >= 0)
     {
-        *file_size = lseek(fd, 0, SEEK_END);
-        lseek(fd, 0, SEEK_SET);
-        data = malloc(*file_size);
-        if(read(fd, data, *file_size) < 0) {
-            free(data);
-            data = NULL;
+        if(io_fstat(fd, &st) < 0 || st.st_size > UINT32_MAX) {
+            io_close(fd);
+            fd = -1;
+        } else {
+            *file_size = st.st_size;
         }
-        close(fd);
     }
-    return data;
+    stats_end(&timer, STATS_OPEN);
+    return fd;
 }
 
-static void write_padding(int fd, uint32_t count)
+/*
+ * Opens a payload the recipe names from dir_fd or, if it is not there
+ * and the recipe recorded its digest, from the section store. Returns
+ * STORE_CORRUPT if the store object no longer matches that digest.
+ */
+static int open_payload(int dir_fd, const char *filename, const uint8_t digest[STORE_DIGEST_SIZE],
+                        const struct section_store *store, uint32_t *file_size)
 {
-    uint8_t *padding = malloc(count);
-    memset(padding, 0, count);
-    write(fd, padding, count);
-    free(padding);
+    int fd = open_file(dir_fd, filename, file_size);
+
+#ifndef WIN32
+    struct stat st;
+
+    if(fd < 0 && store != NULL && store_has_digest(digest)) {
+        if((fd = store_get(store, digest)) == STORE_CORRUPT) {
+            fprintf(error_stream(), "create: the stored %s does not match its digest\n", filename);
+            return STORE_CORRUPT;
+        }
+
+        if(fd >= 0 && (io_fstat(fd, &st) < 0 || st.st_size > UINT32_MAX)) {
+            io_close(fd);
+            fd = -1;
+        } else if(fd >= 0) {
+            *file_size = st.st_size;
+        }
+    }
+#endif
+    return fd;
 }
 
-int create_image(struct bootimg_params *params, const char *filename)
+static ssize_t read_chunk(int fd, uint8_t *buffer, uint32_t size, uint64_t offset)
+{
+    struct stats_timer timer;
+    ssize_t            bytes_read = 0;
+
+    stats_begin(&timer);
+    bytes_read = io_pread(fd, buffer, size, offset);
+    stats_end(&timer, STATS_READ);
+    return bytes_read;
+}
+
+static int write_chunk(int fd, const uint8_t *buffer, uint32_t size, uint64_t offset)
+{
+    struct stats_timer timer;
+    int                ret = 0;
+
+    stats_begin(&timer);
+    ret = io_pwrite_all(fd, buffer, size, offset);
+    stats_end(&timer, STATS_WRITE);
+    return ret;
+}
+
+static int write_padding(int fd, uint32_t count, uint64_t offset)
+{
+    static const uint8_t zeros[4096];
+    struct stats_timer   timer;
+
+    stats_begin(&timer);
+    while(count > 0) {
+        uint32_t chunk = count > sizeof(zeros) ? sizeof(zeros) : count;
+
+        if(io_pwrite_all(fd, zeros, chunk, offset) < 0) {
+            stats_end(&timer, STATS_PADDING);
+            return -1;
+        }
+        count -= chunk;
+        offset += chunk;
+    }
+    stats_end(&timer, STATS_PADDING);
+    return 0;
+}
+
+/* A payload file and the place it takes in the image */
+struct source {
+    int      fd;
+    uint32_t size;          /* bytes in the file */
+    uint32_t padded_size;   /* bytes in the image, as recorded in the header */
+    uint64_t offset;        /* where the section starts in the image */
+    int      hashed;        /* whether the section is part of the id */
+    struct image_id_state *checkpoint;  /* where to save the id once the section is hashed */
+    int      packed;        /* a vendor ramdisk fragment followed directly by the next one */
+};
+
+/* Zeros between the end of a section's file data and the next page, or the next fragment */
+static uint64_t source_padding(const struct source *src, uint32_t page_size)
+{
+    if(src->packed) {
+        return 0;
+    }
+    /* Covers both the ramdisk alignment and the page padding */
+    return page_align(src->offset + src->padded_size, page_size) - (src->offset + src->size);
+}
+
+/* Hashes what follows the file data of a section: alignment and size */
+static void hash_section_end(const struct source *src, struct image_id *id, uint8_t *buffer)
+{
+    if(src->padded_size > src->size) {
+        memset(buffer, 0, src->padded_size - src->size);
+        image_id_update(id, buffer, src->padded_size - src->size);
+    }
+    image_id_update(id, &src->padded_size, sizeof(src->padded_size));
+
+    if(src->checkpoint != NULL) {
+        image_id_save(id, src->checkpoint);
+    }
+}
+
+/*
+ * Feeds a section into the id hash exactly as it appears in the image,
+ * followed by its size.
+ */
+static int hash_section(const struct source *src, struct image_id *id, uint8_t *buffer)
+{
+    uint64_t offset = 0;
+
+    while(offset < src->size) {
+        uint32_t chunk = src->size - offset > CHUNK_SIZE ? CHUNK_SIZE : src->size - offset;
+        ssize_t  bytes_read = read_chunk(src->fd, buffer, chunk, offset);
+
+        if(bytes_read <= 0) {
+            return -1;
+        }
+        image_id_update(id, buffer, bytes_read);
+        offset += bytes_read;
+    }
+    hash_section_end(src, id, buffer);
+    return 0;
+}
+
+/*
+ * Copies the file data of a section with copy_file_range(), so that
+ * filesystems which can share extents (btrfs, XFS) reflink them instead
+ * of copying. Returns -1 if the kernel or filesystem cannot do it, in
+ * which case whatever was copied is simply overwritten by the buffered
+ * copy.
+ */
+static int clone_section(const struct source *src, int out_fd)
+{
+    off_t              in = 0;
+    off_t              out = src->offset;
+    uint64_t           left = src->size;
+    struct stats_timer timer;
+
+    stats_begin(&timer);
+    while(left > 0) {
+        ssize_t copied = io_copy_file_range(src->fd, &in, out_fd, &out, left);
+
+        if(copied < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if(copied <= 0) {
+            stats_end(&timer, STATS_WRITE);
+            return -1;
+        }
+        left -= copied;
+    }
+    stats_end(&timer, STATS_WRITE);
+    return 0;
+}
+
+/* Copies the file data of a section through buffer, hashing it if id is not NULL */
+static int copy_data(const struct source *src, int out_fd, struct image_id *id, uint8_t *buffer)
+{
+    uint64_t offset = 0;
+
+    while(offset < src->size) {
+        uint32_t chunk = src->size - offset > CHUNK_SIZE ? CHUNK_SIZE : src->size - offset;
+        ssize_t  bytes_read = read_chunk(src->fd, buffer, chunk, offset);
+
+        if(bytes_read <= 0) {
+            return -1;
+        }
+        if(id != NULL) {
+            image_id_update(id, buffer, bytes_read);
+        }
+
+        if(write_chunk(out_fd, buffer, bytes_read, src->offset + offset) < 0) {
+            return -1;
+        }
+        offset += bytes_read;
+    }
+
+    if(id != NULL) {
+        hash_section_end(src, id, buffer);
+    }
+    return 0;
+}
+
+/*
+ * Copies a section to its offset in the image, followed by its page
+ * padding. The data is cloned with copy_file_range() where possible and
+ * only read back if it has to be hashed; otherwise it is copied in
+ * CHUNK_SIZE pieces and, if id is not NULL, fed into the id hash on the
+ * way through. With holes set the padding is skipped and left for the
+ * final truncate to turn into a hole.
+ */
+static int copy_section(const struct source *src, uint32_t page_size, int out_fd, struct image_id *id,
+                        uint8_t *buffer, int holes)
+{
+    if(clone_section(src, out_fd) == 0) {
+        if(id != NULL && hash_section(src, id, buffer) < 0) {
+            return -1;
+        }
+    } else if(copy_data(src, out_fd, id, buffer) < 0) {
+        return -1;
+    }
+
+    if(holes) {
+        return 0;
+    }
+    return write_padding(out_fd, source_padding(src, page_size), src->offset + src->size);
+}
+
+struct parallel_build {
+    struct source *sources;
+    size_t        count;
+    uint32_t      page_size;
+    int           out_fd;
+    struct image_id *id;
+    int           holes;
+    int           status;
+    uint8_t       *buffers;     /* one CHUNK_SIZE buffer per thread */
+    int           in_use[MAX_SOURCES + 1];
+    size_t        buffer_count;
+};
+
+/* Takes a buffer no other job is using; there is one per thread, so one is always free */
+static size_t claim_buffer(struct parallel_build *build)
+{
+    for(size_t i = 0;; i = (i + 1) % build->buffer_count) {
+        if(!__atomic_exchange_n(&build->in_use[i], 1, __ATOMIC_ACQUIRE)) {
+            return i;
+        }
+    }
+}
+
+/*
+ * Job 0 hashes all sections in order while jobs 1..count copy one
+ * section each, so the id is computed alongside the writes instead of
+ * after them.
+ */
+static void run_build_job(size_t index, void *arg)
+{
+    struct parallel_build *build = arg;
+    size_t                slot = claim_buffer(build);
+    uint8_t               *buffer = build->buffers + slot * CHUNK_SIZE;
+    int                   ret = 0;
+
+    if(index == 0) {
+        for(size_t i = 0; i < build->count && ret == 0; i++) {
+            if(build->sources[i].hashed) {
+                ret = hash_section(&build->sources[i], build->id, buffer);
+            }
+        }
+    } else {
+        ret = copy_section(&build->sources[index - 1], build->page_size, build->out_fd, NULL, buffer,
+                           build->holes);
+    }
+
+    if(ret < 0) {
+        __atomic_store_n(&build->status, -1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&build->in_use[slot], 0, __ATOMIC_RELEASE);
+}
+
+/* Hash state carried across the chunks io_uring hands back in order */
+struct batched_hash {
+    const struct source *sources;
+    struct image_id     *id;
+    size_t              current;
+    uint8_t             padding[4];
+};
+
+static void finish_batched_hash(struct batched_hash *hash, size_t until)
+{
+    for(; hash->current < until; hash->current++) {
+        if(hash->sources[hash->current].hashed) {
+            hash_section_end(&hash->sources[hash->current], hash->id, hash->padding);
+        }
+    }
+}
+
+/* Transfers come in pairs, the section data and then its padding */
+static void hash_batched_chunk(size_t index, const uint8_t *data, size_t size, void *arg)
+{
+    struct batched_hash *hash = arg;
+
+    finish_batched_hash(hash, index / 2);
+    if(hash->sources[index / 2].hashed) {
+        image_id_update(hash->id, data, size);
+    }
+}
+
+/*
+ * Submits every section and its padding to io_uring as one batch and
+ * hashes the data as it comes back, so reads and writes of all sections
+ * overlap without any extra threads.
+ */
+static int write_sections_batched(struct uring *ring, struct source *sources, size_t count,
+                                  uint32_t page_size, int out_fd, struct image_id *id, int holes)
+{
+    struct uring_transfer transfers[MAX_SOURCES * 2];
+    struct batched_hash   hash = { sources, id, 0 };
+
+    for(size_t i = 0; i < count; i++) {
+        uint64_t padding = holes ? 0 : source_padding(&sources[i], page_size);
+
+        transfers[i * 2] = (struct uring_transfer) { sources[i].fd, 0, NULL, out_fd, sources[i].offset,
+                                                     sources[i].size };
+        transfers[i * 2 + 1] = (struct uring_transfer) { -1, 0, NULL, out_fd,
+                                                         sources[i].offset + sources[i].size, padding };
+    }
+
+    if(uring_run(ring, transfers, count * 2, hash_batched_chunk, &hash) < 0) {
+        return -1;
+    }
+    finish_batched_hash(&hash, count);
+    return 0;
+}
+
+/*
+ * Streams each section to its offset in CHUNK_SIZE pieces, followed by
+ * its padding as zeros or, with holes, as a hole. With more than one
+ * thread the sections are copied concurrently while another thread
+ * computes the id; with the io_uring backend they go in one batch.
+ */
+static int write_sections(struct source *sources, size_t count, uint32_t page_size, int out_fd,
+                          struct image_id *id, unsigned int threads, int holes, struct arena *arena)
+{
+    if(io_get_backend() == IO_BACKEND_URING) {
+        struct uring *ring = uring_create();
+
+        if(ring != NULL) {
+            int ret = write_sections_batched(ring, sources, count, page_size, out_fd, id, holes);
+
+            uring_destroy(ring);
+            return ret;
+        }
+    }
+
+    if(threads > 1) {
+        struct parallel_build build = { sources, count, page_size, out_fd, id, holes, 0 };
+
+        /* No more jobs than threads run at once, so they share that many buffers */
+        build.buffer_count = threads < count + 1 ? threads : count + 1;
+        build.buffers = arena_scratch(arena, build.buffer_count * CHUNK_SIZE);
+        if(build.buffers == NULL) {
+            return -1;
+        }
+
+        thread_pool_run(threads, count + 1, run_build_job, &build);
+        return build.status;
+    }
+
+    uint8_t *buffer = arena_scratch(arena, CHUNK_SIZE);
+    int     ret = 0;
+
+    if(buffer == NULL) {
+        return -1;
+    }
+
+    for(size_t i = 0; i < count && ret == 0; i++) {
+        ret = copy_section(&sources[i], page_size, out_fd, sources[i].hashed ? id : NULL, buffer, holes);
+    }
+    return ret;
+}
+
+/* Where a ramdisk built on the fly goes: the image and the id hash */
+struct ramdisk_output {
+    int             fd;
+    uint64_t        offset;
+    uint64_t        size;
+    struct image_id *id;
+};
+
+static int write_ramdisk(const uint8_t *data, size_t size, void *arg)
+{
+    struct ramdisk_output *output = arg;
+
+    if(output->id != NULL) {
+        image_id_update(output->id, data, size);
+    }
+    if(write_chunk(output->fd, data, size, output->offset + output->size) < 0) {
+        return -1;
+    }
+    output->size += size;
+    return 0;
+}
+
+/*
+ * Builds the ramdisk straight into the image at offset: a directory is
+ * packed as a cpio archive, and the archive or file is compressed on
+ * the fly if options ask for it. Everything written is hashed into id,
+ * if there is one, as it goes, so the kernel, which precedes the ramdisk
+ * in the id, must have been hashed already. Returns the size of the
+ * ramdisk, or -1.
+ */
+static int64_t build_ramdisk(int ramdisk_fd, int is_dir, uint64_t offset, int out_fd, struct image_id *id,
+                             const struct create_options *options, uint8_t *buffer)
+{
+    struct ramdisk_output output = { out_fd, offset, 0, id };
+    struct compressor     *compressor = NULL;
+    payload_sink          sink = write_ramdisk;
+    void                  *arg = &output;
+    int                   ret = 0;
+
+    if(options->ramdisk_compression != COMPRESSION_NONE) {
+        compressor = compressor_create(options->ramdisk_compression, options->ramdisk_level, options->threads,
+                                       write_ramdisk, &output);
+        if(compressor == NULL) {
+            return -1;
+        }
+        sink = compressor_write;
+        arg = compressor;
+    }
+
+    if(is_dir) {
+#ifndef WIN32
+        ret = cpio_pack(ramdisk_fd, sink, arg);
+#else
+        ret = -1;
+#endif
+    } else {
+        uint64_t read_offset = 0;
+        ssize_t  bytes_read = 0;
+
+        while((bytes_read = read_chunk(ramdisk_fd, buffer, CHUNK_SIZE, read_offset)) > 0) {
+            if(sink(buffer, bytes_read, arg) < 0) {
+                ret = -1;
+                break;
+            }
+            read_offset += bytes_read;
+        }
+
+        if(bytes_read < 0) {
+            ret = -1;
+        }
+    }
+
+    if(compressor != NULL && compressor_finish(compressor) < 0) {
+        ret = -1;
+    }
+    return ret < 0 || output.size > UINT32_MAX - 3 ? -1 : (int64_t) output.size;
+}
+
+/*
+ * Replaces the raw image at path, open as fd, with its Android sparse
+ * form. The sparse image is written next to it and renamed over it.
+ */
+static int convert_to_sparse(int fd, uint64_t size, const char *path, struct arena *arena)
+{
+    char *sparse_path = arena_strdup(arena, path, 7);
+    int  sparse_fd = -1;
+    int  ret = -1;
+
+    if(sparse_path == NULL) {
+        return -1;
+    }
+    strcat(sparse_path, ".sparse");
+
+    sparse_fd = io_open(sparse_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if(sparse_fd >= 0) {
+        ret = write_sparse_image(fd, size, sparse_fd);
+        io_close(sparse_fd);
+
+        if(ret == 0 && rename(sparse_path, path) < 0) {
+            ret = -1;
+        }
+        if(ret < 0) {
+            unlink(sparse_path);
+        }
+    }
+    return ret;
+}
+
+/*
+ * Resumes the id from the repack cache past the leading sections that
+ * have not changed since the last build, which then only need copying,
+ * and has the others save their hash state for the next one. sources
+ * are the hashed sections in id order.
+ */
+static void resume_id(struct repack_cache *cache, struct source *sources[], size_t count, struct image_id *id)
+{
+    int    fds[SECTION_COUNT];
+    size_t hit = 0;
+
+    for(size_t i = 0; i < count; i++) {
+        fds[i] = sources[i]->fd;
+    }
+
+    hit = repack_cache_lookup(cache, fds, count);
+    if(hit > 0 && image_id_restore(id, &cache->states[hit - 1]) < 0) {
+        hit = 0;
+    }
+
+    for(size_t i = 0; i < cache->count; i++) {
+        if(i < hit) {
+            sources[i]->hashed = 0;
+        } else {
+            sources[i]->checkpoint = &cache->states[i];
+        }
+    }
+}
+
+/*
+ * Opens the vendor ramdisk fragments the recipe lists, or the ramdisk
+ * as a single platform fragment if it lists none, and fills in their
+ * ramdisk table entries. The fragments follow each other without any
+ * padding, so each one's offset is the total size of those before it.
+ * Each fragment is then streamed to its own offset like any section,
+ * and the table is written from memory. Returns the number of
+ * fragments, or -1 if one cannot be opened or they add up to more than
+ * a header can describe.
+ */
+static int open_fragments(int dir_fd, const struct bootimg_params *params, const struct section_store *store,
+                          int fds[], struct vendor_ramdisk_table_entry table[], uint32_t *total_size)
+{
+    struct vendor_ramdisk_fragment single = { { 0 }, VENDOR_RAMDISK_TYPE_PLATFORM };
+    const struct vendor_ramdisk_fragment *fragments = params->fragments;
+    uint32_t count = params->fragment_count;
+    uint64_t total = 0;
+
+    if(count == 0) {
+        memcpy(single.filename, params->ramdisk_filename, sizeof(single.filename));
+        memcpy(single.digest, params->digests[SECTION_RAMDISK], sizeof(single.digest));
+        fragments = &single;
+        count = 1;
+    }
+
+    memset(table, 0, sizeof(struct vendor_ramdisk_table_entry) * count);
+    for(uint32_t i = 0; i < count; i++) {
+        uint32_t size = 0;
+
+        fds[i] = open_payload(dir_fd, (const char*) fragments[i].filename, fragments[i].digest, store,
+                              &size);
+        if(fds[i] < 0) {
+            fprintf(error_stream(), "FATAL: could not find vendor ramdisk %s\n", fragments[i].filename);
+            while(i-- > 0) {
+                io_close(fds[i]);
+            }
+            return -1;
+        }
+
+        table[i].ramdisk_size = size;
+        table[i].ramdisk_offset = total;
+        table[i].ramdisk_type = fragments[i].type;
+        memcpy(table[i].ramdisk_name, fragments[i].name, VENDOR_RAMDISK_NAME_SIZE);
+        memcpy(table[i].board_id, fragments[i].board_id, sizeof(table[i].board_id));
+        total += size;
+    }
+
+    if(total > UINT32_MAX) {
+        fprintf(error_stream(), "FATAL: vendor ramdisk fragments are too large\n");
+        for(uint32_t i = 0; i < count; i++) {
+            io_close(fds[i]);
+        }
+        return -1;
+    }
+    *total_size = total;
+    return count;
+}
+
+/* The header format params ask for: a boot image unless the recipe names another magic */
+const struct header_format *params_format(const struct bootimg_params *params)
+{
+    return find_header_format(params->magic[0] ? params->magic : (const uint8_t *) BOOT_MAGIC,
+                              params->header_version);
+}
+
+/* The header fields that come straight from the recipe, less any the version fixes */
+void init_header(const struct bootimg_params *params, struct bootimg_header *hdr)
+{
+    const struct header_format *format = params_format(params);
+
+    memset(hdr, 0, sizeof(struct bootimg_header));
+
+    memcpy(hdr->magic, params->magic[0] ? params->magic : (const uint8_t *) BOOT_MAGIC, BOOT_MAGIC_SIZE);
+
+    hdr->kernel_addr = params->kernel_addr;
+    hdr->ramdisk_addr = params->ramdisk_addr;
+    hdr->page_size = format != NULL && format->page_size != 0 ? format->page_size : params->page_size;
+    hdr->header_version = params->header_version;
+    hdr->os_version = params->os_version;
+    hdr->tags_addr = params->tags_addr;
+    memcpy(hdr->cmdline, params->cmdline, BOOT_ARGS_SIZE);
+    memcpy(hdr->extra_cmdline, params->extra_cmdline, BOOT_EXTRA_ARGS_SIZE);
+    memcpy(hdr->vendor_cmdline, params->vendor_cmdline, sizeof(hdr->vendor_cmdline));
+    memcpy(hdr->name, params->product_name, BOOT_NAME_SIZE);
+}
+
+/*
+ * Builds the image from the payloads the recipe names, relative to
+ * dir_fd, without holding any of them in memory. Section offsets are
+ * computed up front from the file sizes, the sections are streamed to
+ * them and the header is written last at offset 0 once the id (SHA-1
+ * unless options ask for SHA-256) is known. Which sections there are
+ * and whether the header has an id depends on the header version. A
+ * ramdisk that is a directory or is to be compressed is built straight
+ * into the image first, since only its start is known before it is
+ * written.
+ */
+int create_image_at(int dir_fd, struct bootimg_params *params, const struct create_options *options,
+                    const char *filename)
 {
     int fd = 0;
-    struct bootimg_hdr_0_2 hdr;
+    int status = 1;
+    struct bootimg_header hdr;
+    const struct header_format *hdr_format = params_format(params);
+    uint8_t header_data[BOOT_HEADER_V3_PAGE_SIZE];
+    struct image_layout layout;
+    struct source sources[MAX_SOURCES];
+    size_t source_count = 0;
+    unsigned int threads = options != NULL ? options->threads : 1;
+    enum id_hash hash = options != NULL ? options->hash : ID_HASH_SHA1;
+    enum create_format format = options != NULL ? options->format : CREATE_RAW;
+    struct image_id id = { NULL, hash };
+    struct repack_cache cache = { -1 };
+    int cached = 0;
+    char *output = NULL;
+    uint32_t digest[8];
     uint32_t header_size = 0;
     uint32_t kernel_size = 0;
     uint32_t ramdisk_size = 0;
     uint32_t second_size = 0;
     uint32_t dtb_size = 0;
-    uint8_t *kernel_data = NULL;
-    uint8_t *ramdisk_data = NULL;
-    uint8_t *second_data = NULL;
-    uint8_t *dtb_data = NULL;
+    uint32_t signature_size = 0;
+    uint32_t bootconfig_size = 0;
+    struct vendor_ramdisk_table_entry table[VENDOR_RAMDISK_MAX];
+    int fragment_fds[VENDOR_RAMDISK_MAX];
+    int fragment_count = 0;
+    int has_id = 0;
+    int kernel_fd = -1;
+    int ramdisk_fd = -1;
+    int second_fd = -1;
+    int dtb_fd = -1;
+    int signature_fd = -1;
+    int bootconfig_fd = -1;
+    int build = 0;
+    int ramdisk_is_dir = 0;
+    struct section_store store = { -1 };
+    struct section_store *stored = NULL;
+    struct arena own_arena;
+    struct arena *arena = options != NULL && options->arena != NULL ? options->arena : &own_arena;
+    struct stat st;
+    struct stats_timer timer;
 
-    if(!strcmp((filename + (strlen(filename) - 4)), ".img")) {
-        fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    } else {
-        char *new_filename = malloc(strlen(filename) + 5);
+    if(hdr_format == NULL)
+    {
+        fprintf(error_stream(), "FATAL: unsupported header version %u\n", params->header_version);
+        return 1;
+    }
+    has_id = hdr_format->has_id;
 
-        memset(new_filename, 0, strlen(filename) + 5);
-        memcpy(new_filename, filename, strlen(filename));
-        strcpy(new_filename + strlen(filename), ".img");
-        fd = open(new_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        free(new_filename);
+    if(params->page_size == 0 && hdr_format->page_size == 0)
+    {
+        fprintf(error_stream(), "FATAL: invalid page size\n");
+        return 1;
     }
 
-    memset(&hdr, 0, sizeof(struct bootimg_hdr_0_2));
+    arena_init(&own_arena);
+    output = arena_strdup(arena, filename, 4);
+    if(output == NULL)
+    {
+        return 1;
+    }
 
-    memcpy(hdr.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
-    
-    hdr.kernel_addr = params->kernel_addr;
-    hdr.ramdisk_addr = params->ramdisk_addr;
-    hdr.page_size = params->page_size;
-    hdr.header_version = params->header_version;
-    hdr.os_version = params->os_version;
-    hdr.tags_addr = params->tags_addr;
-    memcpy(hdr.cmdline, params->cmdline, BOOT_ARGS_SIZE);
-    memcpy(hdr.extra_cmdline, params->extra_cmdline, BOOT_EXTRA_ARGS_SIZE);
-    memcpy(hdr.name, params->product_name, BOOT_NAME_SIZE);
+    if(strcmp((filename + (strlen(filename) - 4)), ".img")) {
+        strcat(output, ".img");
+    }
 
-    kernel_data = load_file(params->kernel_filename, &kernel_size);
+    stats_begin(&timer);
+    /* A sparse image is converted from the raw one, which is read back */
+    fd = io_open(output, (format == CREATE_ANDROID_SPARSE ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0644);
+    stats_end(&timer, STATS_OPEN);
 
-    if(kernel_data == NULL)
+    if(fd == -1)
     {
-        fprintf(stderr, "FATAL: could not find kernel file\n");
-        close(fd);
+        fprintf(error_stream(), "FATAL: could not create %s\n", filename);
+        arena_destroy(&own_arena);
         return 1;
     }
 
-    hdr.kernel_size = kernel_size;
+    init_header(params, &hdr);
 
-    ramdisk_data = load_file(params->ramdisk_filename, &ramdisk_size);
+#ifndef WIN32
+    if(options != NULL && options->store_dir != NULL)
+    {
+        if(store_open(&store, options->store_dir) < 0)
+        {
+            fprintf(error_stream(), "FATAL: could not open store %s\n", options->store_dir);
+            goto out;
+        }
+        stored = &store;
+    }
+#endif
 
-    if(ramdisk_data == NULL)
+    if(header_has_section(hdr_format, SECTION_KERNEL))
     {
-        fprintf(stderr, "FATAL: could not find ramdisk file\n");
-        free(kernel_data);
-        close(fd);
-        return 1;
+        kernel_fd = open_payload(dir_fd, (const char*) params->kernel_filename, params->digests[SECTION_KERNEL],
+                                 stored, &kernel_size);
+
+        if(kernel_fd < 0)
+        {
+            fprintf(error_stream(), "FATAL: could not find kernel file\n");
+            goto out;
+        }
+
+        hdr.kernel_size = kernel_size;
     }
 
-    hdr.ramdisk_size = ramdisk_size;
+    if(header_has_section(hdr_format, SECTION_VENDOR_RAMDISK_TABLE))
+    {
+        fragment_count = open_fragments(dir_fd, params, stored, fragment_fds, table, &ramdisk_size);
 
-    uint32_t aligned_ramdisk_size = align(hdr.ramdisk_size);
+        if(fragment_count < 0)
+        {
+            goto out;
+        }
 
-    if(aligned_ramdisk_size != hdr.ramdisk_size)
+        if(options != NULL && options->ramdisk_compression != COMPRESSION_NONE)
+        {
+            fprintf(error_stream(), "create: vendor ramdisk fragments are written as they are, without compression\n");
+        }
+
+        hdr.vendor_ramdisk_table_size = fragment_count * sizeof(struct vendor_ramdisk_table_entry);
+        hdr.vendor_ramdisk_table_entry_num = fragment_count;
+        hdr.vendor_ramdisk_table_entry_size = sizeof(struct vendor_ramdisk_table_entry);
+    }
+    else
     {
-        uint32_t remainder = aligned_ramdisk_size - hdr.ramdisk_size;
-        uint8_t *temp_ramdisk_data = realloc(ramdisk_data, hdr.ramdisk_size + remainder);
+        ramdisk_fd = open_payload(dir_fd, (const char*) params->ramdisk_filename, params->digests[SECTION_RAMDISK],
+                                  stored, &ramdisk_size);
 
-        if(temp_ramdisk_data != NULL)
+        if(ramdisk_fd < 0)
         {
-            ramdisk_data = temp_ramdisk_data;
-            memset(ramdisk_data + hdr.ramdisk_size, 0, remainder);
-            hdr.ramdisk_size += remainder;
+            fprintf(error_stream(), "FATAL: could not find ramdisk file\n");
+            goto out;
         }
+
+        ramdisk_is_dir = io_fstat(ramdisk_fd, &st) == 0 && S_ISDIR(st.st_mode);
+        build = ramdisk_is_dir || (options != NULL && options->ramdisk_compression != COMPRESSION_NONE);
     }
 
-    if(params->header_version > 1) {
-        header_size = sizeof(struct bootimg_hdr_0_2);
-    } else if(params->header_version > 0) {
-        header_size = sizeof(struct bootimg_hdr_0_2) - EXTRA_BYTES_v1;
-    } else if(params->header_version == 0) {
-        header_size = sizeof(struct bootimg_hdr_0_2) - EXTRA_BYTES_v2;
+    if(has_id && image_id_init(&id, hash) < 0)
+    {
+        fprintf(error_stream(), "FATAL: could not initialise %s\n", id_hash_name(hash));
+        goto out;
     }
 
-    if(params->second_addr != 0)
+    /* An unusable cache only costs the speedup */
+    if(has_id && options != NULL && options->cache_dir != NULL)
     {
-        second_data = load_file("second", &second_size);
+        cached = repack_cache_open(&cache, options->cache_dir, hash) == 0;
+        if(!cached)
+        {
+            fprintf(error_stream(), "create: could not open cache %s, building without it\n", options->cache_dir);
+        }
+    }
 
-        if(second_data != NULL)
+    if(build)
+    {
+        struct create_options defaults = { threads, hash, format, COMPRESSION_NONE, -1 };
+        struct source kernel = { kernel_fd, kernel_size, kernel_size, 0, has_id };
+        struct source *hashed = &kernel;
+        uint64_t ramdisk_offset = page_align(hdr_format->size, hdr.page_size) + page_align(kernel_size, hdr.page_size);
+        uint8_t *buffer = arena_scratch(arena, CHUNK_SIZE);
+        int64_t built = -1;
+
+        /* Only the kernel comes before the built ramdisk in the id */
+        if(cached)
+        {
+            resume_id(&cache, &hashed, 1, &id);
+        }
+
+        if(buffer != NULL && (!kernel.hashed || hash_section(&kernel, &id, buffer) == 0))
+        {
+            built = build_ramdisk(ramdisk_fd, ramdisk_is_dir, ramdisk_offset, fd, has_id ? &id : NULL,
+                                  options != NULL ? options : &defaults, buffer);
+        }
+
+        if(built >= 0)
+        {
+            struct source ramdisk = { -1, built, align(built), ramdisk_offset, has_id };
+
+            if(ramdisk.hashed)
+            {
+                hash_section_end(&ramdisk, &id, buffer);
+            }
+            if(format == CREATE_RAW &&
+               write_padding(fd, page_align(ramdisk.padded_size, hdr.page_size) - built, ramdisk_offset + built) < 0)
+            {
+                built = -1;
+            }
+        }
+
+        if(built < 0)
+        {
+            fprintf(error_stream(), "FATAL: could not build the ramdisk\n");
+            goto out;
+        }
+        ramdisk_size = built;
+    }
+
+    /* With an id the ramdisk is zero-padded to 4 bytes and the padding is part of its size */
+    hdr.ramdisk_size = has_id ? align(ramdisk_size) : ramdisk_size;
+
+    if(header_has_section(hdr_format, SECTION_SECOND) && params->second_addr != 0)
+    {
+        second_fd = open_payload(dir_fd, params->second_filename[0] ? (const char*) params->second_filename : "second",
+                                 params->digests[SECTION_SECOND], stored, &second_size);
+
+        if(second_fd >= 0)
         {
             hdr.second_size = second_size;
             hdr.second_addr = params->second_addr;
         }
     }
 
-    if(params->header_version > 1)
+    if(header_has_section(hdr_format, SECTION_DTB))
     {
-        dtb_data = load_file(params->dtb_filename, &dtb_size);
-        hdr.dtb_size = dtb_size;
+        dtb_fd = open_payload(dir_fd, (const char*) params->dtb_filename, params->digests[SECTION_DTB], stored,
+                              &dtb_size);
+        hdr.dtb_size = dtb_fd >= 0 ? dtb_size : 0;
         hdr.dtb_addr = params->dtb_addr;
     }
 
-    if(params->header_version > 0)
+    if(header_has_section(hdr_format, SECTION_SIGNATURE) && params->signature_filename[0])
+    {
+        signature_fd = open_payload(dir_fd, (const char*) params->signature_filename,
+                                    params->digests[SECTION_SIGNATURE], stored, &signature_size);
+        hdr.signature_size = signature_fd >= 0 ? signature_size : 0;
+    }
+
+    if(header_has_section(hdr_format, SECTION_BOOTCONFIG) && params->bootconfig_filename[0])
+    {
+        bootconfig_fd = open_payload(dir_fd, (const char*) params->bootconfig_filename,
+                                     params->digests[SECTION_BOOTCONFIG], stored, &bootconfig_size);
+        hdr.bootconfig_size = bootconfig_fd >= 0 ? bootconfig_size : 0;
+    }
+
+    /* Optional sections may be missing, but not taken from a store object that was changed */
+    if(second_fd == STORE_CORRUPT || dtb_fd == STORE_CORRUPT || signature_fd == STORE_CORRUPT ||
+       bootconfig_fd == STORE_CORRUPT)
     {
-        hdr.header_size = header_size;
+        goto out;
+    }
+
+    if(HEADER_HAS(hdr_format, header_size))
+    {
+        hdr.header_size = hdr_format->size;
 
         if(params->recovery_dtbo_size != 0)
         {
@@ -160,139 +918,159 @@ int create_image(struct bootimg_params *params, const char *filename)
         }
     }
 
-    SHA_CTX c;
-    uint8_t sha[SHA_DIGEST_LENGTH];
+    compute_layout(&hdr, &layout);
 
-    SHA1_Init(&c);
+    /* A ramdisk that was built is already written, and the kernel before it hashed */
+    if(kernel_fd >= 0)
+    {
+        sources[source_count++] = (struct source) { kernel_fd, kernel_size, hdr.kernel_size,
+                                                    layout.sections[SECTION_KERNEL].offset, has_id && !build };
+    }
 
-    SHA1_Update(&c, kernel_data, hdr.kernel_size);
-    SHA1_Update(&c, &hdr.kernel_size, sizeof(hdr.kernel_size));
-    SHA1_Update(&c, ramdisk_data, hdr.ramdisk_size);
-    SHA1_Update(&c, &hdr.ramdisk_size, sizeof(hdr.ramdisk_size));
+    /* vendor_boot has no id, so the fragments are only copied, concurrently if there are threads */
+    for(int i = 0; i < fragment_count; i++)
+    {
+        sources[source_count++] = (struct source) { fragment_fds[i], table[i].ramdisk_size, table[i].ramdisk_size,
+                                                    layout.sections[SECTION_RAMDISK].offset + table[i].ramdisk_offset,
+                                                    0, NULL, i + 1 < fragment_count };
+    }
+
+    if(!build && ramdisk_fd >= 0)
+    {
+        sources[source_count++] = (struct source) { ramdisk_fd, ramdisk_size, hdr.ramdisk_size,
+                                                    layout.sections[SECTION_RAMDISK].offset, has_id };
+    }
 
     if(second_size != 0)
     {
-        SHA1_Update(&c, second_data, hdr.second_size);
-        SHA1_Update(&c, &hdr.second_size, sizeof(hdr.second_size));
+        sources[source_count++] = (struct source) { second_fd, second_size, hdr.second_size,
+                                                    layout.sections[SECTION_SECOND].offset, has_id };
     }
 
-    SHA1_Update(&c, &hdr.tags_addr, sizeof(hdr.tags_addr));
-    SHA1_Update(&c, &hdr.page_size, sizeof(hdr.page_size));
-    SHA1_Update(&c, &hdr.header_version, sizeof(hdr.header_version));
-    SHA1_Update(&c, &hdr.os_version, sizeof(hdr.os_version));
-    SHA1_Update(&c, hdr.name, sizeof(hdr.name));
-    SHA1_Update(&c, hdr.cmdline, sizeof(hdr.cmdline));
-        
-    SHA1_Final(sha, &c);
-    memcpy(hdr.id, sha, SHA_DIGEST_LENGTH > sizeof(hdr.id) ? sizeof(hdr.id) : SHA_DIGEST_LENGTH);
+    /* TODO: load recovery */
 
-    write(fd, &hdr, header_size);
-    write_padding(fd, params->page_size - header_size);
-    write(fd, kernel_data, hdr.kernel_size);
-    free(kernel_data);
-    write_padding(fd, (params->page_size - (hdr.kernel_size % params->page_size)));
-    write(fd, ramdisk_data, hdr.ramdisk_size);
-    write_padding(fd, params->page_size - (hdr.ramdisk_size % params->page_size));
-    free(ramdisk_data);
+    if(dtb_fd >= 0)
+    {
+        /* The dtb is not part of the id */
+        sources[source_count++] = (struct source) { dtb_fd, dtb_size, hdr.dtb_size,
+                                                    layout.sections[SECTION_DTB].offset, 0 };
+    }
 
-    if(second_size > 0)
+    if(signature_fd >= 0)
     {
-        write(fd, second_data, second_size);
-        write_padding(fd, params->page_size - (second_size % params->page_size));
-        free(second_data);
+        sources[source_count++] = (struct source) { signature_fd, signature_size, hdr.signature_size,
+                                                    layout.sections[SECTION_SIGNATURE].offset, 0 };
     }
 
-    /* TODO: load recovery */
+    if(bootconfig_fd >= 0)
+    {
+        sources[source_count++] = (struct source) { bootconfig_fd, bootconfig_size, hdr.bootconfig_size,
+                                                    layout.sections[SECTION_BOOTCONFIG].offset, 0 };
+    }
 
-    if(dtb_data != NULL)
+    if(hdr.vendor_ramdisk_table_size != 0)
     {
-        write(fd, dtb_data, dtb_size);
-        write_padding(fd, params->page_size - (dtb_size % params->page_size));
-        free(dtb_data);
+        const struct section *section = &layout.sections[SECTION_VENDOR_RAMDISK_TABLE];
+
+        if(write_chunk(fd, (const uint8_t *) table, section->size, section->offset) < 0 ||
+           (format == CREATE_RAW &&
+            write_padding(fd, page_align(section->size, hdr.page_size) - section->size,
+                          section->offset + section->size) < 0))
+        {
+            fprintf(error_stream(), "FATAL: could not write the vendor ramdisk table to %s\n", filename);
+            goto out;
+        }
     }
 
-    close(fd);
-    return 0;
+    if(cached && !build)
+    {
+        struct source *hashed[SECTION_COUNT];
+        size_t hashed_count = 0;
+
+        for(size_t i = 0; i < source_count; i++)
+        {
+            if(sources[i].hashed)
+            {
+                hashed[hashed_count++] = &sources[i];
+            }
+        }
+        resume_id(&cache, hashed, hashed_count, &id);
+    }
+
+    if(write_sections(sources, source_count, hdr.page_size, fd, &id, threads, format != CREATE_RAW, arena) < 0)
+    {
+        fprintf(error_stream(), "FATAL: could not write %s\n", filename);
+        goto out;
+    }
+
+    if(has_id)
+    {
+        image_id_update_header(&id, &hdr);
+
+        if(image_id_final(&id, digest) < 0)
+        {
+            fprintf(error_stream(), "FATAL: could not compute the image id\n");
+            goto out;
+        }
+        memcpy(hdr.id, digest, sizeof(hdr.id));
+    }
+
+    header_size = encode_header(&hdr, header_data, sizeof(header_data));
+
+    stats_begin(&timer);
+    if(io_pwrite_all(fd, header_data, header_size, 0) < 0)
+    {
+        stats_end(&timer, STATS_HEADER);
+        fprintf(error_stream(), "FATAL: could not write header to %s\n", filename);
+        goto out;
+    }
+    stats_end(&timer, STATS_HEADER);
+
+    /* Padding that was skipped becomes holes, the trailing one included */
+    if(format != CREATE_RAW && io_ftruncate(fd, layout.total_size) < 0)
+    {
+        fprintf(error_stream(), "FATAL: could not extend %s\n", filename);
+        goto out;
+    }
+
+    if(format == CREATE_ANDROID_SPARSE && convert_to_sparse(fd, layout.total_size, output, arena) < 0)
+    {
+        fprintf(error_stream(), "FATAL: could not write a sparse image to %s\n", filename);
+        goto out;
+    }
+
+    if(cached)
+    {
+        repack_cache_store(&cache);
+    }
+    status = 0;
+
+out:
+    image_id_free(&id);
+    repack_cache_close(&cache);
+    if(kernel_fd >= 0)
+        io_close(kernel_fd);
+    if(ramdisk_fd >= 0)
+        io_close(ramdisk_fd);
+    if(second_fd >= 0)
+        io_close(second_fd);
+    if(dtb_fd >= 0)
+        io_close(dtb_fd);
+    if(signature_fd >= 0)
+        io_close(signature_fd);
+    if(bootconfig_fd >= 0)
+        io_close(bootconfig_fd);
+    for(int i = 0; i < fragment_count; i++)
+        io_close(fragment_fds[i]);
+#ifndef WIN32
+    store_close(&store);
+#endif
+    io_close(fd);
+    arena_destroy(&own_arena);
+    return status;
 }
 
-int parse_recipe(int fd, struct bootimg_params *params)
+int create_image(struct bootimg_params *params, const char *filename)
 {
-    int     bytes_read = 0;
-    uint8_t *key = malloc(4);
-
-    memset(key, 0, 4);
-
-    while((bytes_read = read(fd, key, 3)) > 0) {
-        if(!strcmp(key, "kna")) {
-            uint32_t kernel_addr = 0;
-            read(fd, &kernel_addr, sizeof(uint32_t));
-            params->kernel_addr = kernel_addr;
-        } else if(!strcmp(key, "knn")) {
-            uint32_t len = 0;
-            read(fd, &len, sizeof(uint32_t));
-            read(fd, params->kernel_filename, len);
-        } else if(!strcmp(key, "pas")) {
-            uint32_t page_size = 0;
-            read(fd, &page_size, sizeof(uint32_t));
-            params->page_size = page_size;
-        } else if(!strcmp(key, "hev")) {
-            uint32_t header_version = 0;
-            read(fd, &header_version, sizeof(uint32_t));
-            params->header_version = header_version;
-        } else if(!strcmp(key, "rda")) {
-            uint32_t ramdisk_addr = 0;
-            read(fd, &ramdisk_addr, sizeof(uint32_t));
-            params->ramdisk_addr = ramdisk_addr;
-        } else if(!strcmp(key, "osv")) {
-            uint32_t os_version = 0;
-            read(fd, &os_version, sizeof(uint32_t));
-            params->os_version = os_version;
-        } else if(!strcmp(key, "taa")) {
-            uint32_t tags_addr = 0;
-            read(fd, &tags_addr, sizeof(uint32_t));
-            params->tags_addr = tags_addr;
-        } else if(!strcmp(key, "rdn")) {
-            uint32_t len = 0;
-            read(fd, &len, sizeof(uint32_t));
-            read(fd, params->ramdisk_filename, len);
-        } else if(!strcmp(key, "sea")) {
-            uint32_t second_addr = 0;
-            read(fd, &second_addr, sizeof(uint32_t));
-            params->second_addr = second_addr;
-        } else if(!strcmp(key, "cmd")) {
-            uint32_t len = 0;
-            read(fd, &len, sizeof(uint32_t));
-            read(fd, params->cmdline, len);
-        } else if(!strcmp(key, "ecm")) {
-            uint32_t len = 0;
-            read(fd, &len, sizeof(uint32_t));
-            read(fd, params->extra_cmdline, len);
-        } else if(!strcmp(key, "pna")) {
-            uint32_t len = 0;
-            read(fd, &len, sizeof(uint32_t));
-            read(fd, params->product_name, len);
-        } else if(!strcmp(key, "sen")) {
-            uint32_t len = 0;
-            read(fd, &len, sizeof(uint32_t));
-            read(fd, params->second_filename, len);
-        } else if(!strcmp(key, "idv")) {
-            read(fd, params->id, sizeof(uint32_t) * 8);
-        } else if(!strcmp(key, "dtn")) {
-            uint32_t len = 0;
-            read(fd, &len, sizeof(uint32_t));
-            read(fd, params->dtb_filename, len);
-        } else if(!strcmp(key, "reo")) {
-            uint64_t offset = 0;
-            read(fd, &offset, sizeof(uint64_t));
-            params->recovery_dtbo_offset = offset;
-        } else if(!strcmp(key, "dta")) {
-            uint64_t addr = 0;
-            read(fd, &addr, sizeof(uint64_t));
-            params->dtb_addr = addr;
-        }
-    }
-
-    free(key);
-    close(fd);
-    return 0;
+    return create_image_at(AT_FDCWD, params, NULL, filename);
 }
@@ -1,4 +1,23 @@
+#ifndef CREATE_IMAGE_H
+#define CREATE_IMAGE_H
+
+#include "arena.h"
 #include "bootimg.h"
+#include "decompress.h"
+#include "image_id.h"
+#include "layout.h"
+
+/* Most vendor ramdisk fragments a recipe can list */
+#define VENDOR_RAMDISK_MAX 16
+
+/* One vendor ramdisk fragment as the recipe describes it */
+struct vendor_ramdisk_fragment {
+    uint8_t  filename[50];
+    uint32_t type;
+    uint8_t  name[VENDOR_RAMDISK_NAME_SIZE + 1];
+    uint32_t board_id[VENDOR_RAMDISK_BOARD_ID_SIZE];
+    uint8_t  digest[SHA256_DIGEST_LENGTH];     /* of the file, zero if the recipe has none */
+};
 
 struct bootimg_params {
     uint32_t kernel_addr;
@@ -15,6 +34,7 @@ struct bootimg_params {
     uint32_t os_version;
     uint8_t  cmdline[BOOT_ARGS_SIZE];
     uint8_t  extra_cmdline[BOOT_EXTRA_ARGS_SIZE];
+    uint8_t  vendor_cmdline[VENDOR_BOOT_ARGS_SIZE - BOOT_ARGS_SIZE - BOOT_EXTRA_ARGS_SIZE];
     uint8_t  product_name[BOOT_NAME_SIZE];
     uint32_t id[8];
     uint32_t recovery_dtbo_size;
@@ -22,7 +42,37 @@ struct bootimg_params {
     uint32_t header_size;
     uint8_t  dtb_filename[50];
     uint64_t dtb_addr;
+    uint8_t  signature_filename[50];
+    uint8_t  magic[BOOT_MAGIC_SIZE + 1];        /* empty for a boot image */
+    uint8_t  bootconfig_filename[50];
+    uint32_t fragment_count;
+    struct vendor_ramdisk_fragment fragments[VENDOR_RAMDISK_MAX];
+    uint8_t  digests[SECTION_COUNT][SHA256_DIGEST_LENGTH];  /* of each payload file, for the store */
+};
+
+/* What create does with the padding between sections */
+enum create_format {
+    CREATE_RAW,             /* written out as zeros */
+    CREATE_HOLES,           /* left as holes in the file */
+    CREATE_ANDROID_SPARSE   /* an Android sparse image with fill chunks */
+};
+
+/* How an image is built, as opposed to what goes into it */
+struct create_options {
+    unsigned int       threads;
+    enum id_hash       hash;
+    enum create_format format;
+    enum compression   ramdisk_compression;  /* compress the ramdisk while writing it */
+    int                ramdisk_level;        /* -1 for the format's default */
+    const char         *cache_dir;           /* repack cache to resume the id from, or NULL */
+    const char         *store_dir;           /* section store for payloads the directory lacks, or NULL */
+    struct arena       *arena;               /* for transient buffers, reset between images, or NULL */
 };
 
 int create_image(struct bootimg_params *params, const char *filename);
-int parse_recipe(int fd, struct bootimg_params *params);
+int create_image_at(int dir_fd, struct bootimg_params *params, const struct create_options *options,
+                    const char *filename);
+const struct header_format *params_format(const struct bootimg_params *params);
+void init_header(const struct bootimg_params *params, struct bootimg_header *hdr);
+
+#endif
@@ -0,0 +1,350 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <lzma.h>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4frame.h>
+#endif
+
+#include "decompress.h"
+#include "stats.h"
+
+/* Decompressed data is handed to the sink in pieces of this size */
+#define OUTPUT_SIZE (1024 * 1024)
+
+/* The legacy lz4 format the kernel build uses: fixed 8 MiB blocks */
+#define LZ4_LEGACY_MAGIC      0x184c2102
+#define LZ4_LEGACY_BLOCK_SIZE (8 * 1024 * 1024)
+
+static const uint8_t gzip_magic[] = { 0x1f, 0x8b };
+static const uint8_t xz_magic[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+static const uint8_t lz4_frame_magic[] = { 0x04, 0x22, 0x4d, 0x18 };
+static const uint8_t lz4_legacy_magic[] = { 0x02, 0x21, 0x4c, 0x18 };
+static const uint8_t zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+static int has_magic(const uint8_t *data, size_t size, const uint8_t *magic, size_t magic_size)
+{
+    return size >= magic_size && !memcmp(data, magic, magic_size);
+}
+
+enum compression detect_compression(const uint8_t *data, size_t size)
+{
+    if(has_magic(data, size, gzip_magic, sizeof(gzip_magic))) {
+        return COMPRESSION_GZIP;
+    } else if(has_magic(data, size, xz_magic, sizeof(xz_magic))) {
+        return COMPRESSION_XZ;
+    } else if(has_magic(data, size, lz4_frame_magic, sizeof(lz4_frame_magic)) ||
+              has_magic(data, size, lz4_legacy_magic, sizeof(lz4_legacy_magic))) {
+        return COMPRESSION_LZ4;
+    } else if(has_magic(data, size, zstd_magic, sizeof(zstd_magic))) {
+        return COMPRESSION_ZSTD;
+    }
+    return COMPRESSION_NONE;
+}
+
+const char *compression_name(enum compression type)
+{
+    switch(type) {
+        case COMPRESSION_GZIP:
+            return "gzip";
+        case COMPRESSION_XZ:
+            return "xz";
+        case COMPRESSION_LZ4:
+            return "lz4";
+        case COMPRESSION_ZSTD:
+            return "zstd";
+        default:
+            return "none";
+    }
+}
+
+/* Suffix of the file a section compressed this way is extracted to */
+const char *compression_suffix(enum compression type)
+{
+    switch(type) {
+        case COMPRESSION_GZIP:
+            return ".gz";
+        case COMPRESSION_XZ:
+            return ".xz";
+        case COMPRESSION_LZ4:
+            return ".lz4";
+        case COMPRESSION_ZSTD:
+            return ".zst";
+        default:
+            return "";
+    }
+}
+
+/* gzip and xz are always built in; lz4 and zstd only if their libraries were found */
+int compression_supported(enum compression type)
+{
+    switch(type) {
+        case COMPRESSION_GZIP:
+        case COMPRESSION_XZ:
+            return 1;
+#ifdef HAVE_LZ4
+        case COMPRESSION_LZ4:
+            return 1;
+#endif
+#ifdef HAVE_ZSTD
+        case COMPRESSION_ZSTD:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Inflates one or more concatenated gzip members. Anything after the
+ * last member that does not start a new one (ramdisk alignment, or the
+ * dtb appended to an Image.gz-dtb kernel) is ignored.
+ */
+static int decompress_gzip(const uint8_t *data, size_t size, uint8_t *out, payload_sink sink, void *arg)
+{
+    z_stream stream;
+    int      ret = Z_OK;
+
+    memset(&stream, 0, sizeof(stream));
+    if(inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) {
+        return -1;
+    }
+    /* Sections are at most 4 GiB, so the input fits in one go */
+    stream.next_in = (Bytef *) data;
+    stream.avail_in = size;
+
+    for(;;) {
+        stream.next_out = out;
+        stream.avail_out = OUTPUT_SIZE;
+        ret = inflate(&stream, Z_NO_FLUSH);
+
+        /* Z_BUF_ERROR here means the input ended inside a member */
+        if(ret != Z_OK && ret != Z_STREAM_END) {
+            inflateEnd(&stream);
+            return -1;
+        }
+
+        if(stream.avail_out < OUTPUT_SIZE && sink(out, OUTPUT_SIZE - stream.avail_out, arg) < 0) {
+            inflateEnd(&stream);
+            return -1;
+        }
+
+        if(ret == Z_STREAM_END) {
+            if(!has_magic(stream.next_in, stream.avail_in, gzip_magic, sizeof(gzip_magic))) {
+                break;
+            }
+            inflateReset(&stream);
+        }
+    }
+    inflateEnd(&stream);
+    return 0;
+}
+
+/*
+ * Decodes an xz stream, with threads threads when the stream was
+ * written in independent blocks (xz -T). Data after the stream is
+ * ignored.
+ */
+static int decompress_xz(const uint8_t *data, size_t size, unsigned int threads, uint8_t *out,
+                         payload_sink sink, void *arg)
+{
+    lzma_stream stream = LZMA_STREAM_INIT;
+    lzma_ret    ret = LZMA_OK;
+    lzma_mt     mt;
+
+    memset(&mt, 0, sizeof(mt));
+    mt.threads = threads > 0 ? threads : 1;
+    mt.memlimit_threading = UINT64_MAX / 2;
+    mt.memlimit_stop = UINT64_MAX;
+
+    if(lzma_stream_decoder_mt(&stream, &mt) != LZMA_OK) {
+        return -1;
+    }
+    stream.next_in = data;
+    stream.avail_in = size;
+
+    do {
+        stream.next_out = out;
+        stream.avail_out = OUTPUT_SIZE;
+        ret = lzma_code(&stream, LZMA_FINISH);
+
+        if(ret != LZMA_OK && ret != LZMA_STREAM_END) {
+            lzma_end(&stream);
+            return -1;
+        }
+
+        if(stream.avail_out < OUTPUT_SIZE && sink(out, OUTPUT_SIZE - stream.avail_out, arg) < 0) {
+            lzma_end(&stream);
+            return -1;
+        }
+    } while(ret == LZMA_OK);
+
+    lzma_end(&stream);
+    return 0;
+}
+
+#ifdef HAVE_ZSTD
+/* Decodes one or more zstd frames, stopping at the first byte that does not start one */
+static int decompress_zstd(const uint8_t *data, size_t size, uint8_t *out, payload_sink sink, void *arg)
+{
+    ZSTD_DStream   *stream = ZSTD_createDStream();
+    ZSTD_inBuffer  in = { data, size, 0 };
+    size_t         ret = 0;
+
+    if(stream == NULL) {
+        return -1;
+    }
+
+    for(;;) {
+        ZSTD_outBuffer output = { out, OUTPUT_SIZE, 0 };
+        size_t         consumed = in.pos;
+
+        ret = ZSTD_decompressStream(stream, &output, &in);
+
+        if(ZSTD_isError(ret)) {
+            ZSTD_freeDStream(stream);
+            return -1;
+        }
+
+        if(output.pos > 0 && sink(out, output.pos, arg) < 0) {
+            ZSTD_freeDStream(stream);
+            return -1;
+        }
+
+        if(ret == 0 && !has_magic(data + in.pos, in.size - in.pos, zstd_magic, sizeof(zstd_magic))) {
+            break;
+        }
+
+        /*
+         * With the input used up, a full output buffer means there is more
+         * to flush; anything else is a frame cut short, as is a call that
+         * made no progress at all.
+         */
+        if((in.pos == in.size && output.pos < output.size) || (in.pos == consumed && output.pos == 0)) {
+            break;
+        }
+    }
+    ZSTD_freeDStream(stream);
+    return ret == 0 ? 0 : -1;
+}
+#endif
+
+#ifdef HAVE_LZ4
+/* Each block is a little-endian compressed size followed by that many bytes */
+static int decompress_lz4_legacy(const uint8_t *data, size_t size, payload_sink sink, void *arg)
+{
+    uint8_t *out = malloc(LZ4_LEGACY_BLOCK_SIZE);
+    size_t  pos = sizeof(lz4_legacy_magic);
+    int     ret = 0;
+
+    if(out == NULL) {
+        return -1;
+    }
+
+    while(pos + 4 <= size) {
+        uint32_t block = data[pos] | data[pos + 1] << 8 | data[pos + 2] << 16 | (uint32_t) data[pos + 3] << 24;
+        int      decoded = 0;
+
+        /* Blocks can be followed by another magic when archives were concatenated */
+        if(block == LZ4_LEGACY_MAGIC) {
+            pos += 4;
+            continue;
+        }
+
+        if(block == 0 || block > size - pos - 4) {
+            break;
+        }
+
+        decoded = LZ4_decompress_safe((const char *) data + pos + 4, (char *) out, block, LZ4_LEGACY_BLOCK_SIZE);
+
+        if(decoded < 0 || sink(out, decoded, arg) < 0) {
+            ret = -1;
+            break;
+        }
+        pos += 4 + block;
+    }
+    free(out);
+    return ret;
+}
+
+static int decompress_lz4(const uint8_t *data, size_t size, uint8_t *out, payload_sink sink, void *arg)
+{
+    LZ4F_dctx *ctx = NULL;
+    size_t    pos = 0;
+    size_t    ret = 1;
+
+    if(has_magic(data, size, lz4_legacy_magic, sizeof(lz4_legacy_magic))) {
+        return decompress_lz4_legacy(data, size, sink, arg);
+    }
+
+    if(LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION))) {
+        return -1;
+    }
+
+    while(pos < size && ret != 0) {
+        size_t out_size = OUTPUT_SIZE;
+        size_t in_size = size - pos;
+
+        ret = LZ4F_decompress(ctx, out, &out_size, data + pos, &in_size, NULL);
+
+        if(LZ4F_isError(ret) || (out_size > 0 && sink(out, out_size, arg) < 0)) {
+            LZ4F_freeDecompressionContext(ctx);
+            return -1;
+        }
+        pos += in_size;
+    }
+    LZ4F_freeDecompressionContext(ctx);
+    return ret == 0 ? 0 : -1;
+}
+#endif
+
+/*
+ * Decompresses size bytes at data, passing the output to sink as it is
+ * produced so nothing has to be held in memory or on disk in between.
+ * threads is used by formats that can decode in parallel. Returns -1 on
+ * corrupt input, a format this build does not support, or when sink
+ * fails.
+ */
+int decompress(enum compression type, const uint8_t *data, size_t size, unsigned int threads,
+               payload_sink sink, void *arg)
+{
+    uint8_t            *out = stats_malloc(OUTPUT_SIZE);
+    int                ret = -1;
+    struct stats_timer timer;
+
+    if(out == NULL) {
+        return -1;
+    }
+
+    stats_begin(&timer);
+    switch(type) {
+        case COMPRESSION_GZIP:
+            ret = decompress_gzip(data, size, out, sink, arg);
+            break;
+        case COMPRESSION_XZ:
+            ret = decompress_xz(data, size, threads, out, sink, arg);
+            break;
+#ifdef HAVE_LZ4
+        case COMPRESSION_LZ4:
+            ret = decompress_lz4(data, size, out, sink, arg);
+            break;
+#endif
+#ifdef HAVE_ZSTD
+        case COMPRESSION_ZSTD:
+            ret = decompress_zstd(data, size, out, sink, arg);
+            break;
+#endif
+        default:
+            break;
+    }
+    stats_end(&timer, STATS_DECOMPRESS);
+    free(out);
+    return ret;
+}
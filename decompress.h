@@ -0,0 +1,25 @@
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum compression {
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_XZ,
+    COMPRESSION_LZ4,
+    COMPRESSION_ZSTD
+};
+
+/* Receives payload data in order. Returning -1 stops the producer. */
+typedef int (*payload_sink)(const uint8_t *data, size_t size, void *arg);
+
+enum compression detect_compression(const uint8_t *data, size_t size);
+const char      *compression_name(enum compression type);
+const char      *compression_suffix(enum compression type);
+int              compression_supported(enum compression type);
+int              decompress(enum compression type, const uint8_t *data, size_t size, unsigned int threads,
+                            payload_sink sink, void *arg);
+
+#endif
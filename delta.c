@@ -0,0 +1,548 @@
+#include <fcntl.h>
+#include <lzma.h>
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bootimgtool.h"
+#include "delta.h"
+#include "file_io.h"
+#include "image_map.h"
+#include "layout.h"
+#include "stats.h"
+#include "thread_pool.h"
+
+#ifdef WIN32
+#include "win32.h"
+#endif
+
+/* Decoded regions are written out in pieces of this size */
+#define PATCH_CHUNK_SIZE (1024 * 1024)
+
+/*
+ * The largest dictionary a region is encoded with, the one xz -9 uses.
+ * An encoder needs about ten times as much memory, so anything larger
+ * in a delta is taken as corrupt rather than allocated.
+ */
+#define MAX_DICT_SIZE (64U << 20)
+
+struct extent {
+    uint64_t offset;
+    uint64_t size;
+};
+
+/* Where each kind of region is in an image */
+struct image_regions {
+    struct extent extents[DELTA_MAX_REGIONS];   /* by region type, empty if the image has none */
+    uint32_t      order[DELTA_MAX_REGIONS];     /* the types it has, in file order */
+    size_t        count;
+};
+
+struct diff_job {
+    const struct image_map     *source;
+    const struct image_map     *target;
+    struct delta_region        regions[DELTA_MAX_REGIONS];
+    uint8_t                    *data[DELTA_MAX_REGIONS];
+    int                        status[DELTA_MAX_REGIONS];
+};
+
+struct patch_job {
+    const struct image_map    *source;
+    const uint8_t             *data;        /* the region data, after the table */
+    const struct delta_region *regions;
+    int                       out_fd;
+    int                       status[DELTA_MAX_REGIONS];
+};
+
+static const char *region_name(uint32_t type)
+{
+    if(type == DELTA_REGION_HEADER) {
+        return "header";
+    }
+    return type == DELTA_REGION_TAIL ? "tail" : section_name(type);
+}
+
+static void add_region(struct image_regions *regions, uint32_t type, uint64_t offset, uint64_t size)
+{
+    regions->extents[type].offset = offset;
+    regions->extents[type].size = size;
+    regions->order[regions->count++] = type;
+}
+
+/*
+ * Cuts an image into the header page, each section with its padding and
+ * anything after the last section; sections follow each other, so the
+ * regions cover the whole file. Returns -1 if it is not an image or is
+ * shorter than its header says.
+ */
+static int find_regions(const struct image_map *map, struct image_regions *regions)
+{
+    struct bootimg_header      hdr;
+    const struct header_format *format = NULL;
+    struct image_layout        layout;
+    uint64_t                   end = 0;
+
+    memset(regions, 0, sizeof(struct image_regions));
+
+    if(parse_header(map->data, map->size, &hdr) < 0 || compute_layout(&hdr, &layout) < 0 ||
+       layout.total_size > map->size) {
+        return -1;
+    }
+    format = header_format(&hdr);
+
+    end = page_align(format->size, hdr.page_size);
+    add_region(regions, DELTA_REGION_HEADER, 0, end);
+
+    for(size_t i = 0; i < format->section_count; i++) {
+        const struct section *section = &layout.sections[format->sections[i]];
+        uint64_t             size = page_align(section->size, hdr.page_size);
+
+        if(size == 0) {
+            continue;
+        }
+        add_region(regions, format->sections[i], section->offset, size);
+        end += size;
+    }
+
+    if(map->size > end) {
+        add_region(regions, DELTA_REGION_TAIL, end, map->size - end);
+    }
+    return 0;
+}
+
+static void digest_image(const struct image_map *map, uint8_t digest[DELTA_DIGEST_SIZE])
+{
+    struct stats_timer timer;
+
+    stats_begin(&timer);
+    SHA256(map->data, map->size, digest);
+    stats_count_read(map->size);
+    stats_end(&timer, STATS_HASH);
+}
+
+/* An LZMA2 dictionary that holds the source region and the target region after it */
+static uint32_t dictionary_size(uint64_t size)
+{
+    if(size < LZMA_DICT_SIZE_MIN) {
+        return LZMA_DICT_SIZE_MIN;
+    }
+    return size > MAX_DICT_SIZE ? MAX_DICT_SIZE : size;
+}
+
+/*
+ * How many regions to encode at once: no more than threads, and no more
+ * than fit in a quarter of the memory, as xz limits itself to.
+ */
+static unsigned int encoder_threads(const struct delta_region *regions, size_t count, unsigned int threads)
+{
+    lzma_options_lzma options;
+    lzma_filter       filters[2];
+    uint64_t          usage = 0;
+    uint64_t          limit = lzma_physmem() / 4;
+
+    if(lzma_lzma_preset(&options, LZMA_PRESET_DEFAULT)) {
+        return 1;
+    }
+    filters[0] = (lzma_filter) { LZMA_FILTER_LZMA2, &options };
+    filters[1] = (lzma_filter) { LZMA_VLI_UNKNOWN, NULL };
+
+    for(size_t i = 0; i < count; i++) {
+        uint64_t region_usage = 0;
+
+        options.dict_size = dictionary_size(regions[i].source_size + regions[i].target_size);
+        region_usage = lzma_raw_encoder_memusage(filters);
+        if(region_usage != UINT64_MAX && region_usage > usage) {
+            usage = region_usage;
+        }
+    }
+
+    if(usage > 0 && limit > 0 && limit / usage < threads) {
+        threads = limit / usage > 0 ? limit / usage : 1;
+    }
+    return threads;
+}
+
+/*
+ * Encodes one target region against the source region of the same kind:
+ * not at all if they are identical, and as raw LZMA2 primed with the
+ * source region otherwise.
+ */
+static int encode_region(const struct diff_job *job, struct delta_region *region, uint8_t **out)
+{
+    const uint8_t      *dict = job->source->data + region->source_offset;
+    const uint8_t      *data = job->target->data + region->target_offset;
+    lzma_options_lzma  options;
+    lzma_filter        filters[2];
+    size_t             bound = 0;
+    size_t             pos = 0;
+    lzma_ret           ret = LZMA_OK;
+    struct stats_timer timer;
+
+    if(region->source_size == region->target_size && memcmp(dict, data, region->target_size) == 0) {
+        region->method = DELTA_COPY;
+        return 0;
+    }
+
+    if(lzma_lzma_preset(&options, LZMA_PRESET_DEFAULT)) {
+        return -1;
+    }
+    options.preset_dict = region->source_size > 0 ? dict : NULL;
+    options.preset_dict_size = region->source_size;
+    options.dict_size = dictionary_size(region->source_size + region->target_size);
+
+    filters[0] = (lzma_filter) { LZMA_FILTER_LZMA2, &options };
+    filters[1] = (lzma_filter) { LZMA_VLI_UNKNOWN, NULL };
+
+    bound = lzma_block_buffer_bound(region->target_size);
+    if(bound == 0 || (*out = stats_malloc(bound)) == NULL) {
+        return -1;
+    }
+
+    stats_begin(&timer);
+    ret = lzma_raw_buffer_encode(filters, NULL, data, region->target_size, *out, &pos, bound);
+    stats_end(&timer, STATS_COMPRESS);
+
+    if(ret != LZMA_OK) {
+        free(*out);
+        *out = NULL;
+        return -1;
+    }
+    region->method = DELTA_LZMA2;
+    region->data_size = pos;
+    region->dict_size = options.dict_size;
+    return 0;
+}
+
+static void run_diff(size_t index, void *arg)
+{
+    struct diff_job *job = arg;
+
+    job->status[index] = encode_region(job, &job->regions[index], &job->data[index]);
+}
+
+static int open_map(const char *command, const char *filename, struct image_map *map)
+{
+    int fd = io_open(filename, O_RDONLY, 0);
+    int ret = 0;
+
+    if(fd == -1) {
+        fprintf(error_stream(), "%s: could not open %s\n", command, filename);
+        return -1;
+    }
+
+    if((ret = map_image(fd, map)) < 0) {
+        fprintf(error_stream(), "%s: could not map %s\n", command, filename);
+    }
+    io_close(fd);
+    return ret < 0 ? -1 : 0;
+}
+
+/*
+ * The diff command: writes a delta that patch_image() turns source into
+ * target with. The regions are encoded in parallel on up to threads
+ * threads and the delta is written with one writev(). Returns 0 on
+ * success and 1 on failure, matching the exit status.
+ */
+int diff_images(const char *source, const char *target, const char *delta, unsigned int threads)
+{
+    struct image_map     source_map;
+    struct image_map     target_map;
+    struct image_regions source_regions;
+    struct image_regions target_regions;
+    struct delta_header  header;
+    struct diff_job      job;
+    struct iovec         iov[2 + DELTA_MAX_REGIONS];
+    int                  iov_count = 2;
+    uint64_t             data_size = 0;
+    uint64_t             total = 0;
+    int                  fd = -1;
+    int                  status = 1;
+
+    memset(&source_map, 0, sizeof(struct image_map));
+    memset(&target_map, 0, sizeof(struct image_map));
+    memset(&job, 0, sizeof(struct diff_job));
+
+    if(open_map("diff", source, &source_map) < 0 || open_map("diff", target, &target_map) < 0) {
+        goto out;
+    }
+
+    if(find_regions(&source_map, &source_regions) < 0) {
+        fprintf(error_stream(), "diff: %s is not a valid image\n", source);
+        goto out;
+    }
+
+    if(find_regions(&target_map, &target_regions) < 0) {
+        fprintf(error_stream(), "diff: %s is not a valid image\n", target);
+        goto out;
+    }
+
+    memset(&header, 0, sizeof(struct delta_header));
+    memcpy(header.magic, DELTA_MAGIC, DELTA_MAGIC_SIZE);
+    header.version = DELTA_VERSION;
+    header.region_count = target_regions.count;
+    header.target_size = target_map.size;
+    digest_image(&source_map, header.source_digest);
+    digest_image(&target_map, header.target_digest);
+
+    job.source = &source_map;
+    job.target = &target_map;
+
+    for(size_t i = 0; i < target_regions.count; i++) {
+        uint32_t type = target_regions.order[i];
+
+        job.regions[i].type = type;
+        job.regions[i].source_offset = source_regions.extents[type].offset;
+        job.regions[i].source_size = source_regions.extents[type].size;
+        job.regions[i].target_offset = target_regions.extents[type].offset;
+        job.regions[i].target_size = target_regions.extents[type].size;
+    }
+
+    threads = encoder_threads(job.regions, target_regions.count, threads);
+    thread_pool_run(threads, target_regions.count, run_diff, &job);
+
+    iov[0] = (struct iovec) { &header, sizeof(struct delta_header) };
+    iov[1] = (struct iovec) { job.regions, target_regions.count * sizeof(struct delta_region) };
+
+    for(size_t i = 0; i < target_regions.count; i++) {
+        struct delta_region *region = &job.regions[i];
+
+        if(job.status[i] < 0) {
+            fprintf(error_stream(), "diff: could not encode the %s\n", region_name(region->type));
+            goto out;
+        }
+
+        region->data_offset = data_size;
+        data_size += region->data_size;
+        if(region->data_size > 0) {
+            iov[iov_count++] = (struct iovec) { job.data[i], region->data_size };
+        }
+
+        if(region->method == DELTA_COPY) {
+            fprintf(stdout, "%s: unchanged\n", region_name(region->type));
+        } else {
+            fprintf(stdout, "%s: %llu bytes as %llu\n", region_name(region->type),
+                    (unsigned long long) region->target_size, (unsigned long long) region->data_size);
+        }
+    }
+
+    fd = io_open(delta, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) {
+        fprintf(error_stream(), "diff: could not create %s\n", delta);
+        goto out;
+    }
+
+    total = sizeof(struct delta_header) + target_regions.count * sizeof(struct delta_region) + data_size;
+    if(io_writev(fd, iov, iov_count) != (ssize_t) total) {
+        fprintf(error_stream(), "diff: could not write %s\n", delta);
+        goto out;
+    }
+
+    fprintf(stdout, "delta: %llu bytes for a %llu byte image\n", (unsigned long long) total,
+            (unsigned long long) target_map.size);
+    status = 0;
+
+out:
+    for(size_t i = 0; i < DELTA_MAX_REGIONS; i++) {
+        free(job.data[i]);
+    }
+    if(fd != -1)
+        io_close(fd);
+    unmap_image(&source_map);
+    unmap_image(&target_map);
+    return status;
+}
+
+/* Decodes one region of the target straight to its offset in the output, a chunk at a time */
+static int decode_region(const struct patch_job *job, const struct delta_region *region)
+{
+    lzma_stream        stream = LZMA_STREAM_INIT;
+    lzma_options_lzma  options;
+    lzma_filter        filters[2];
+    lzma_ret           ret = LZMA_OK;
+    uint8_t            *chunk = NULL;
+    uint64_t           offset = region->target_offset;
+    struct stats_timer timer;
+
+    if(region->method == DELTA_COPY) {
+        stats_begin(&timer);
+        ret = io_pwrite_all(job->out_fd, job->source->data + region->source_offset, region->target_size,
+                            region->target_offset) < 0;
+        stats_end(&timer, STATS_WRITE);
+        return ret ? -1 : 0;
+    }
+
+    if(lzma_lzma_preset(&options, LZMA_PRESET_DEFAULT)) {
+        return -1;
+    }
+    options.preset_dict = region->source_size > 0 ? job->source->data + region->source_offset : NULL;
+    options.preset_dict_size = region->source_size;
+    options.dict_size = region->dict_size;
+
+    filters[0] = (lzma_filter) { LZMA_FILTER_LZMA2, &options };
+    filters[1] = (lzma_filter) { LZMA_VLI_UNKNOWN, NULL };
+
+    if((chunk = stats_malloc(PATCH_CHUNK_SIZE)) == NULL || lzma_raw_decoder(&stream, filters) != LZMA_OK) {
+        free(chunk);
+        return -1;
+    }
+
+    stream.next_in = job->data + region->data_offset;
+    stream.avail_in = region->data_size;
+
+    while(ret == LZMA_OK) {
+        size_t size = 0;
+
+        stream.next_out = chunk;
+        stream.avail_out = PATCH_CHUNK_SIZE;
+
+        stats_begin(&timer);
+        ret = lzma_code(&stream, LZMA_FINISH);
+        stats_end(&timer, STATS_DECOMPRESS);
+
+        size = PATCH_CHUNK_SIZE - stream.avail_out;
+        if((ret != LZMA_OK && ret != LZMA_STREAM_END) ||
+           size > region->target_offset + region->target_size - offset) {
+            ret = LZMA_DATA_ERROR;
+            break;
+        }
+
+        stats_begin(&timer);
+        if(io_pwrite_all(job->out_fd, chunk, size, offset) < 0) {
+            ret = LZMA_PROG_ERROR;
+        }
+        stats_end(&timer, STATS_WRITE);
+        offset += size;
+    }
+
+    lzma_end(&stream);
+    free(chunk);
+    return ret == LZMA_STREAM_END && offset == region->target_offset + region->target_size ? 0 : -1;
+}
+
+static void run_patch(size_t index, void *arg)
+{
+    struct patch_job *job = arg;
+
+    job->status[index] = decode_region(job, &job->regions[index]);
+}
+
+/*
+ * Whether a delta's regions all lie within it, the source and the
+ * target, and ask for no larger a dictionary than diff makes.
+ */
+static int check_delta(const struct image_map *delta, const struct image_map *source,
+                       const struct delta_header *header, const struct delta_region *regions)
+{
+    uint64_t table_end = sizeof(struct delta_header) + (uint64_t) header->region_count * sizeof(struct delta_region);
+
+    for(uint32_t i = 0; i < header->region_count; i++) {
+        const struct delta_region *region = &regions[i];
+
+        if(region->source_offset > source->size || region->source_size > source->size - region->source_offset ||
+           region->target_offset > header->target_size ||
+           region->target_size > header->target_size - region->target_offset ||
+           region->data_offset > delta->size - table_end ||
+           region->data_size > delta->size - table_end - region->data_offset ||
+           (region->method == DELTA_COPY && region->source_size != region->target_size) ||
+           (region->method != DELTA_COPY && region->method != DELTA_LZMA2) ||
+           (region->method == DELTA_LZMA2 &&
+            (region->dict_size < LZMA_DICT_SIZE_MIN || region->dict_size > MAX_DICT_SIZE))) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The patch command: rebuilds the target a delta was made for from its
+ * source. Each region is decoded on up to threads threads and written
+ * to its offset as it is produced, so no region is held in memory; the
+ * result is checked against the digest of the original target. Returns
+ * 0 on success and 1 on failure, matching the exit status.
+ */
+int patch_image(const char *source, const char *delta, const char *target, unsigned int threads)
+{
+    struct image_map    source_map;
+    struct image_map    delta_map;
+    struct image_map    out_map;
+    struct delta_header header;
+    struct delta_region regions[DELTA_MAX_REGIONS];
+    struct patch_job    job;
+    uint8_t             digest[DELTA_DIGEST_SIZE];
+    int                 fd = -1;
+    int                 status = 1;
+
+    memset(&source_map, 0, sizeof(struct image_map));
+    memset(&delta_map, 0, sizeof(struct image_map));
+    memset(&out_map, 0, sizeof(struct image_map));
+
+    if(open_map("patch", source, &source_map) < 0 || open_map("patch", delta, &delta_map) < 0) {
+        goto out;
+    }
+
+    if(delta_map.size < sizeof(struct delta_header)) {
+        fprintf(error_stream(), "patch: %s is not a delta\n", delta);
+        goto out;
+    }
+    memcpy(&header, delta_map.data, sizeof(struct delta_header));
+
+    if(memcmp(header.magic, DELTA_MAGIC, DELTA_MAGIC_SIZE) != 0 || header.version != DELTA_VERSION ||
+       header.region_count > DELTA_MAX_REGIONS ||
+       delta_map.size - sizeof(struct delta_header) < header.region_count * sizeof(struct delta_region)) {
+        fprintf(error_stream(), "patch: %s is not a delta\n", delta);
+        goto out;
+    }
+    memcpy(regions, delta_map.data + sizeof(struct delta_header), header.region_count * sizeof(struct delta_region));
+
+    if(check_delta(&delta_map, &source_map, &header, regions) < 0) {
+        fprintf(error_stream(), "patch: %s is corrupt\n", delta);
+        goto out;
+    }
+
+    digest_image(&source_map, digest);
+    if(memcmp(digest, header.source_digest, DELTA_DIGEST_SIZE) != 0) {
+        fprintf(error_stream(), "patch: %s is not the image the delta was made from\n", source);
+        goto out;
+    }
+
+    fd = io_open(target, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1 || io_ftruncate(fd, header.target_size) < 0) {
+        fprintf(error_stream(), "patch: could not create %s\n", target);
+        goto out;
+    }
+
+    job.source = &source_map;
+    job.data = delta_map.data + sizeof(struct delta_header) + header.region_count * sizeof(struct delta_region);
+    job.regions = regions;
+    job.out_fd = fd;
+    thread_pool_run(threads, header.region_count, run_patch, &job);
+
+    for(uint32_t i = 0; i < header.region_count; i++) {
+        if(job.status[i] < 0) {
+            fprintf(error_stream(), "patch: could not rebuild the %s\n", region_name(regions[i].type));
+            goto out;
+        }
+    }
+
+    if(map_image(fd, &out_map) < 0) {
+        fprintf(error_stream(), "patch: could not read back %s\n", target);
+        goto out;
+    }
+
+    digest_image(&out_map, digest);
+    if(memcmp(digest, header.target_digest, DELTA_DIGEST_SIZE) != 0) {
+        fprintf(error_stream(), "patch: %s does not match the image the delta was made for\n", target);
+        goto out;
+    }
+    status = 0;
+
+out:
+    unmap_image(&out_map);
+    if(fd != -1)
+        io_close(fd);
+    unmap_image(&source_map);
+    unmap_image(&delta_map);
+    return status;
+}
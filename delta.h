@@ -0,0 +1,60 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "layout.h"
+
+/*
+ * A delta turns one image into another. The target is cut into regions
+ * along its layout: the header page, each section with its padding and
+ * whatever follows the last one, such as an AVB footer. Each region is
+ * paired with the same region of the source and stored either as
+ * unchanged, or as LZMA2 compressed with the source region as a preset
+ * dictionary, so that data already in the source costs next to nothing.
+ * All of it is in host byte order, like recipe.cfg.
+ */
+#define DELTA_MAGIC       "BIMGDLTA"
+#define DELTA_MAGIC_SIZE  8
+#define DELTA_VERSION     1
+#define DELTA_DIGEST_SIZE 32
+
+/* Header, sections and tail */
+#define DELTA_MAX_REGIONS (SECTION_COUNT + 2)
+
+enum delta_method {
+    DELTA_COPY,     /* the source region as it is */
+    DELTA_LZMA2     /* raw LZMA2 with the source region as its preset dictionary */
+};
+
+/* What a region holds; sections use their enum section_type */
+#define DELTA_REGION_HEADER SECTION_COUNT
+#define DELTA_REGION_TAIL   (SECTION_COUNT + 1)
+
+struct delta_header {
+    uint8_t  magic[DELTA_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t region_count;
+    uint64_t target_size;
+    uint8_t  source_digest[DELTA_DIGEST_SIZE];  /* SHA-256 of the whole source image */
+    uint8_t  target_digest[DELTA_DIGEST_SIZE];
+};
+
+struct delta_region {
+    uint32_t type;
+    uint32_t method;
+    uint64_t source_offset;
+    uint64_t source_size;
+    uint64_t target_offset;
+    uint64_t target_size;
+    uint64_t data_offset;       /* from the end of the region table */
+    uint64_t data_size;
+    uint32_t dict_size;         /* LZMA2 dictionary the data was made with */
+    uint32_t reserved;
+};
+
+int diff_images(const char *source, const char *target, const char *delta, unsigned int threads);
+int patch_image(const char *source, const char *delta, const char *target, unsigned int threads);
+
+#endif
@@ -0,0 +1,598 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bootimgtool.h"
+#include "create_image.h"
+#include "decompress.h"
+#include "disassemble.h"
+#include "file_io.h"
+#include "image_map.h"
+#include "layout.h"
+#include "recipe.h"
+#include "stats.h"
+#include "store.h"
+#include "thread_pool.h"
+#include "uring.h"
+
+#ifdef WIN32
+#include "win32.h"
+#else
+#include "cpio.h"
+#endif
+
+/*
+ * Creates filename inside dir_fd and copies the section at offset into
+ * it. Returns -1 if the file could not be created or written.
+ */
+static int extract_section(const struct image_map *map, const struct section *section,
+                           int dir_fd, const char *filename)
+{
+    int                fd = -1;
+    int                ret = 0;
+    struct stats_timer timer;
+
+    stats_begin(&timer);
+    fd = io_openat(dir_fd, filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    stats_end(&timer, STATS_OPEN);
+
+    if(fd == -1) {
+        fprintf(error_stream(), "disassemble: could not create %s\n", filename);
+        return -1;
+    }
+
+    if(write_section(map, section->offset, section->size, fd) < 0) {
+        fprintf(error_stream(), "disassemble: could not extract %s\n", filename);
+        ret = -1;
+    }
+    io_close(fd);
+    return ret;
+}
+
+/* Every section, with the ramdisk split into its vendor ramdisk fragments */
+#define MAX_EXTRACTIONS (SECTION_COUNT + VENDOR_RAMDISK_MAX)
+
+/* A compressed kernel or ramdisk decoded into a file, an unpacked archive or both */
+struct decoding {
+    const struct section *section;
+    enum compression     type;
+    const char           *filename;     /* NULL if the decoded data is not kept */
+    int                  unpack;        /* the data is a cpio archive to unpack */
+    int                  status;
+};
+
+struct extraction {
+    const struct image_map *map;
+    const struct section   *sections[MAX_EXTRACTIONS];
+    const char             *filenames[MAX_EXTRACTIONS];
+    int                    status[MAX_EXTRACTIONS];
+    size_t                 count;
+    struct section         fragments[VENDOR_RAMDISK_MAX];
+    char                   fragment_filenames[VENDOR_RAMDISK_MAX][32];
+    int                    dir_fd;
+    struct decoding        decodings[2];
+    size_t                 decode_count;
+    int                    unpack_fd;
+    unsigned int           threads;
+    struct section_store   *store;                      /* NULL unless sections go to a store */
+    struct recipe          *recipe;
+    uint8_t                *digests[MAX_EXTRACTIONS];   /* where the recipe wants each digest */
+};
+
+/* Where decoded data goes: a file, the cpio unpacker or both */
+struct decode_output {
+    int                  fd;
+    uint64_t             offset;
+    struct cpio_unpacker *cpio;
+};
+
+/*
+ * Hashes a section into the store and links it into the output as its
+ * filename, noting its digest in the recipe. The section is written
+ * only if the store does not have it yet.
+ */
+static int store_section(const struct extraction *ex, size_t index)
+{
+#ifndef WIN32
+    const struct section *section = ex->sections[index];
+    const uint8_t        *data = ex->map->data + section->offset;
+    uint8_t              digest[STORE_DIGEST_SIZE];
+
+    if(section->offset > ex->map->size || section->size > ex->map->size - section->offset) {
+        fprintf(error_stream(), "disassemble: could not extract %s\n", ex->filenames[index]);
+        return -1;
+    }
+
+    stats_count_read(section->size);
+    store_digest(data, section->size, digest);
+    if(ex->digests[index] != NULL) {
+        memcpy(ex->digests[index], digest, STORE_DIGEST_SIZE);
+    }
+
+    if(store_put(ex->store, data, section->size, digest, ex->dir_fd, ex->filenames[index]) < 0) {
+        fprintf(error_stream(), "disassemble: could not store %s\n", ex->filenames[index]);
+        return -1;
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* What a section is compressed with, or none if it does not lie inside the image */
+static enum compression section_compression(const struct image_map *map, const struct section *section)
+{
+    if(section->offset > map->size || section->size > map->size - section->offset) {
+        return COMPRESSION_NONE;
+    }
+    return detect_compression(map->data + section->offset, section->size);
+}
+
+/* Plans a section's extraction; with a store, digest_key is the recipe record for its digest */
+static void add_extraction(struct extraction *ex, const struct section *section, const char *filename,
+                           enum rtypes digest_key)
+{
+    ex->sections[ex->count] = section;
+    ex->filenames[ex->count] = filename;
+    ex->status[ex->count] = 0;
+    ex->digests[ex->count] = ex->store != NULL ? recipe_reserve(ex->recipe, digest_key) : NULL;
+    ex->count++;
+}
+
+static void run_extraction(size_t index, void *arg)
+{
+    struct extraction *ex = arg;
+
+    if(ex->store != NULL) {
+        ex->status[index] = store_section(ex, index);
+    } else {
+        ex->status[index] = extract_section(ex->map, ex->sections[index], ex->dir_fd, ex->filenames[index]);
+    }
+}
+
+static int write_decoded(const uint8_t *data, size_t size, void *arg)
+{
+    struct decode_output *output = arg;
+    struct stats_timer   timer;
+
+    if(output->fd != -1) {
+        stats_begin(&timer);
+        if(io_pwrite_all(output->fd, data, size, output->offset) < 0) {
+            stats_end(&timer, STATS_WRITE);
+            return -1;
+        }
+        stats_end(&timer, STATS_WRITE);
+        output->offset += size;
+    }
+#ifndef WIN32
+    if(output->cpio != NULL && cpio_unpack(data, size, output->cpio) < 0) {
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/*
+ * Decodes a section straight from the mapping into its outputs. Nothing
+ * is staged on disk: the decompressor hands its output to the file and
+ * the cpio unpacker as it goes.
+ */
+static int decode_section(const struct extraction *ex, const struct decoding *decoding)
+{
+    const struct section *section = decoding->section;
+    struct decode_output output = { -1, 0, NULL };
+    int                  ret = 0;
+
+    if(section->offset > ex->map->size || section->size > ex->map->size - section->offset) {
+        return -1;
+    }
+
+    if(decoding->type != COMPRESSION_NONE && !compression_supported(decoding->type)) {
+        fprintf(error_stream(), "disassemble: this build cannot decompress %s\n", compression_name(decoding->type));
+        return -1;
+    }
+
+    if(decoding->filename != NULL) {
+        output.fd = io_openat(ex->dir_fd, decoding->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if(output.fd == -1) {
+            fprintf(error_stream(), "disassemble: could not create %s\n", decoding->filename);
+            return -1;
+        }
+    }
+
+#ifndef WIN32
+    if(decoding->unpack && (output.cpio = cpio_unpacker_create(ex->unpack_fd)) == NULL) {
+        ret = -1;
+    }
+#endif
+
+    if(ret == 0) {
+        const uint8_t *data = ex->map->data + section->offset;
+
+        stats_count_read(section->size);
+        if(decoding->type == COMPRESSION_NONE) {
+            ret = write_decoded(data, section->size, &output);
+        } else {
+            ret = decompress(decoding->type, data, section->size, ex->threads, write_decoded, &output);
+        }
+    }
+
+#ifndef WIN32
+    if(output.cpio != NULL && cpio_unpacker_finish(output.cpio) < 0) {
+        ret = -1;
+    }
+#endif
+
+    if(ret < 0) {
+        fprintf(error_stream(), "disassemble: could not %s the %s\n", decoding->unpack ? "unpack" : "decompress",
+                decoding->filename != NULL ? decoding->filename : "ramdisk");
+    }
+
+    if(output.fd != -1) {
+        io_close(output.fd);
+    }
+    return ret;
+}
+
+static void run_decoding(size_t index, void *arg)
+{
+    struct extraction *ex = arg;
+
+    ex->decodings[index].status = decode_section(ex, &ex->decodings[index]);
+}
+
+/*
+ * Plans what has to be decoded for a kernel or ramdisk compressed as
+ * type: the decompressed copy is named after the section, and the
+ * ramdisk archive is unpacked if asked to.
+ */
+static void add_decoding(struct extraction *ex, const struct section *section, enum compression type,
+                         const char *name, int decompress, int unpack)
+{
+    struct decoding *decoding = &ex->decodings[ex->decode_count];
+
+    if(!unpack && (!decompress || type == COMPRESSION_NONE)) {
+        return;
+    }
+    decoding->section = section;
+    decoding->type = type;
+    decoding->filename = decompress && type != COMPRESSION_NONE ? name : NULL;
+    decoding->unpack = unpack;
+    decoding->status = 0;
+    ex->decode_count++;
+}
+
+/*
+ * Creates every output file and then writes all sections from the
+ * mapping as one io_uring batch.
+ */
+static void extract_batched(struct extraction *ex, struct uring *ring)
+{
+    struct uring_transfer transfers[MAX_EXTRACTIONS];
+    int                   fds[MAX_EXTRACTIONS];
+    int                   ret = 0;
+    struct stats_timer    timer;
+
+    for(size_t i = 0; i < ex->count; i++) {
+        const struct section *section = ex->sections[i];
+
+        stats_begin(&timer);
+        fds[i] = io_openat(ex->dir_fd, ex->filenames[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        stats_end(&timer, STATS_OPEN);
+
+        if(fds[i] == -1) {
+            fprintf(error_stream(), "disassemble: could not create %s\n", ex->filenames[i]);
+            ex->status[i] = ret = -1;
+        } else if(section->offset > ex->map->size || section->size > ex->map->size - section->offset) {
+            fprintf(error_stream(), "disassemble: could not extract %s\n", ex->filenames[i]);
+            ex->status[i] = ret = -1;
+        }
+        transfers[i] = (struct uring_transfer) { -1, 0, ex->map->data + section->offset, fds[i], 0,
+                                                 section->size };
+        stats_count_read(section->size);
+    }
+
+    if(ret == 0 && uring_run(ring, transfers, ex->count, NULL, NULL) < 0) {
+        fprintf(error_stream(), "disassemble: could not extract sections\n");
+        ex->status[0] = -1;
+    }
+
+    for(size_t i = 0; i < ex->count; i++) {
+        if(fds[i] != -1)
+            io_close(fds[i]);
+    }
+}
+
+/*
+ * Plans the extraction of every fragment the vendor ramdisk table lists
+ * as a file of its own, named after its index and compression, and
+ * describes them in the recipe in table order. The fragments are
+ * written from the mapping like any other section. Returns -1 if the
+ * table does not fit the image.
+ */
+static int add_fragments(struct extraction *ex, const struct bootimg_header *hdr,
+                         const struct image_layout *layout, struct recipe *recipe)
+{
+    const struct section *ramdisk = &layout->sections[SECTION_RAMDISK];
+    const struct section *table = &layout->sections[SECTION_VENDOR_RAMDISK_TABLE];
+    uint32_t             entry_size = hdr->vendor_ramdisk_table_entry_size;
+
+    if(hdr->vendor_ramdisk_table_entry_num > VENDOR_RAMDISK_MAX) {
+        fprintf(error_stream(), "disassemble: too many vendor ramdisk fragments (%u)\n",
+                hdr->vendor_ramdisk_table_entry_num);
+        return -1;
+    }
+
+    if(entry_size < sizeof(struct vendor_ramdisk_table_entry) ||
+       (uint64_t) entry_size * hdr->vendor_ramdisk_table_entry_num > table->size ||
+       table->offset > ex->map->size || table->size > ex->map->size - table->offset) {
+        fprintf(error_stream(), "disassemble: invalid vendor ramdisk table\n");
+        return -1;
+    }
+
+    for(uint32_t i = 0; i < hdr->vendor_ramdisk_table_entry_num; i++) {
+        struct vendor_ramdisk_table_entry entry;
+        struct section                    *fragment = &ex->fragments[i];
+        char                              name[VENDOR_RAMDISK_NAME_SIZE + 1];
+
+        memcpy(&entry, ex->map->data + table->offset + (uint64_t) i * entry_size, sizeof(entry));
+
+        if(entry.ramdisk_offset > ramdisk->size || entry.ramdisk_size > ramdisk->size - entry.ramdisk_offset ||
+           ramdisk->offset + ramdisk->size > ex->map->size) {
+            fprintf(error_stream(), "disassemble: vendor ramdisk %u is outside the vendor ramdisk\n", i);
+            return -1;
+        }
+
+        fragment->offset = ramdisk->offset + entry.ramdisk_offset;
+        fragment->size = entry.ramdisk_size;
+        snprintf(ex->fragment_filenames[i], sizeof(ex->fragment_filenames[i]), "vendor_ramdisk%02u%s", i,
+                 compression_suffix(detect_compression(ex->map->data + fragment->offset, fragment->size)));
+
+        /* The fragment's file starts its records, so its digest has to come after it */
+        recipe_add(recipe, RTYPE_VRN, ex->fragment_filenames[i]);
+        add_extraction(ex, fragment, ex->fragment_filenames[i], RTYPE_VRH);
+        recipe_add(recipe, RTYPE_VRT, &entry.ramdisk_type);
+
+        memcpy(name, entry.ramdisk_name, VENDOR_RAMDISK_NAME_SIZE);
+        name[VENDOR_RAMDISK_NAME_SIZE] = 0;
+        recipe_add(recipe, RTYPE_VRM, name);
+        recipe_add(recipe, RTYPE_VRB, entry.board_id);
+    }
+    return 0;
+}
+
+/*
+ * Extracts every section of the image into dir_fd (AT_FDCWD for the
+ * current directory) together with a recipe.cfg that create can use to
+ * rebuild it. The sections are written from the mapping by up to
+ * threads threads at once, or in one io_uring batch when that backend
+ * is selected; the recipe is put together in memory meanwhile and
+ * written in one call once they are. With a section store each section
+ * is hashed, written to the store only if it is new and linked into
+ * dir_fd, and the recipe records its digest. Compressed kernels and
+ * ramdisks keep their compressed form, named after the format, for the
+ * recipe; options can ask for decompressed copies and for the ramdisk
+ * to be unpacked, which run in parallel with each other afterwards. A
+ * vendor ramdisk with a ramdisk table is extracted one file per
+ * fragment instead, and its fragments are left as they are.
+ */
+int disassemble_image(const char *filename, int dir_fd, const struct disassemble_options *options)
+{
+    unsigned int           threads = options != NULL ? options->threads : 1;
+    int                    decompress = options != NULL && options->decompress;
+    const char             *unpack_dir = options != NULL ? options->unpack_dir : NULL;
+    const char             *store_dir = options != NULL ? options->store_dir : NULL;
+    int                    fd = -1;
+    int                    recipe_fd = -1;
+    int                    status = 1;
+    struct bootimg_header hdr;
+    const struct header_format *format = NULL;
+    struct image_map       map;
+    struct image_layout    layout;
+    struct extraction      ex;
+    struct recipe          recipe;
+    struct section_store   store = { -1 };
+    struct stats_timer     timer;
+
+    memset(&hdr, 0, sizeof(struct bootimg_header));
+    memset(&map, 0, sizeof(struct image_map));
+    memset(&ex, 0, sizeof(struct extraction));
+    ex.unpack_fd = -1;
+    recipe_init(&recipe);
+
+    stats_begin(&timer);
+    fd = io_open(filename, O_RDONLY, 0);
+    stats_end(&timer, STATS_OPEN);
+
+    if(fd == -1) {
+        fprintf(error_stream(), "disassemble: could not open image %s\n", filename);
+        return 1;
+    }
+
+    if(read_header(fd, &hdr) < 0) {
+        fprintf(error_stream(), "disassemble: could not read header\n");
+        goto out;
+    }
+
+    if((format = header_format(&hdr)) == NULL) {
+        fprintf(error_stream(), "disassemble: unsupported header version %u\n", hdr.header_version);
+        goto out;
+    }
+
+    if(compute_layout(&hdr, &layout) < 0) {
+        fprintf(error_stream(), "disassemble: invalid page size in %s\n", filename);
+        goto out;
+    }
+
+    if(map_image(fd, &map) < 0) {
+        fprintf(error_stream(), "disassemble: could not map image %s\n", filename);
+        goto out;
+    }
+
+    recipe_fd = io_openat(dir_fd, "recipe.cfg", O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if(recipe_fd == -1) {
+        fprintf(error_stream(), "disassemble: could not create recipe.cfg\n");
+        goto out;
+    }
+
+    const struct section *kernel = &layout.sections[SECTION_KERNEL];
+    const struct section *ramdisk = &layout.sections[SECTION_RAMDISK];
+    enum compression     kernel_type = section_compression(&map, kernel);
+    enum compression     ramdisk_type = section_compression(&map, ramdisk);
+    char                 kernel_filename[16];
+    char                 ramdisk_filename[16];
+    int                  has_kernel = header_has_section(format, SECTION_KERNEL);
+    int                  has_fragments = header_has_section(format, SECTION_VENDOR_RAMDISK_TABLE);
+
+    ex.map = &map;
+    ex.dir_fd = dir_fd;
+    ex.threads = threads;
+    ex.recipe = &recipe;
+
+    if(store_dir != NULL) {
+#ifndef WIN32
+        if(store_open(&store, store_dir) < 0) {
+            fprintf(error_stream(), "disassemble: could not open store %s\n", store_dir);
+            goto out;
+        }
+        ex.store = &store;
+#else
+        fprintf(error_stream(), "disassemble: this build has no section store\n");
+        goto out;
+#endif
+    }
+
+    if(memcmp(hdr.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE) != 0) {
+        char magic[BOOT_MAGIC_SIZE + 1];
+
+        memcpy(magic, hdr.magic, BOOT_MAGIC_SIZE);
+        magic[BOOT_MAGIC_SIZE] = 0;
+        recipe_add(&recipe, RTYPE_MAG, magic);
+    }
+
+    /* Only what the header version has goes into the recipe */
+    if(HEADER_HAS(format, kernel_addr))
+        recipe_add(&recipe, RTYPE_KNA, &hdr.kernel_addr);
+    recipe_add(&recipe, RTYPE_PAS, &hdr.page_size);
+    recipe_add(&recipe, RTYPE_HEV, &hdr.header_version);
+    if(HEADER_HAS(format, tags_addr))
+        recipe_add(&recipe, RTYPE_TAA, &hdr.tags_addr);
+
+    if(has_kernel) {
+        snprintf(kernel_filename, sizeof(kernel_filename), "kernel%s", compression_suffix(kernel_type));
+
+        add_extraction(&ex, kernel, kernel_filename, RTYPE_KNH);
+        recipe_add(&recipe, RTYPE_KNN, kernel_filename);
+    }
+    if(HEADER_HAS(format, ramdisk_addr))
+        recipe_add(&recipe, RTYPE_RDA, &hdr.ramdisk_addr);
+
+    if(has_fragments) {
+        if(add_fragments(&ex, &hdr, &layout, &recipe) < 0) {
+            goto out;
+        }
+    } else {
+        snprintf(ramdisk_filename, sizeof(ramdisk_filename), "ramdisk%s", compression_suffix(ramdisk_type));
+
+        add_extraction(&ex, ramdisk, ramdisk_filename, RTYPE_RDH);
+        recipe_add(&recipe, RTYPE_RDN, ramdisk_filename);
+    }
+
+    if(hdr.second_size > 0) {
+        add_extraction(&ex, &layout.sections[SECTION_SECOND], "second", RTYPE_SEH);
+        recipe_add(&recipe, RTYPE_SEN, "second");
+    }
+
+    if(HEADER_HAS(format, second_addr))
+        recipe_add(&recipe, RTYPE_SEA, &hdr.second_addr);
+    if(HEADER_HAS(format, os_version))
+        recipe_add(&recipe, RTYPE_OSV, &hdr.os_version);
+    recipe_add(&recipe, RTYPE_CMD, hdr.cmdline);
+    if(HEADER_HAS(format, name))
+        recipe_add(&recipe, RTYPE_PNA, hdr.name);
+    if(format->has_id)
+        recipe_add(&recipe, RTYPE_IDV, hdr.id);
+    /* A vendor_boot command line runs on past extra_cmdline, which cmd already covers */
+    if(!HEADER_HAS(format, vendor_cmdline))
+        recipe_add(&recipe, RTYPE_ECM, hdr.extra_cmdline);
+
+    if(HEADER_HAS(format, recovery_dtbo_offset)) {
+        recipe_add(&recipe, RTYPE_REO, &hdr.recovery_dtbo_offset);
+    }
+
+    if(header_has_section(format, SECTION_DTB)) {
+        add_extraction(&ex, &layout.sections[SECTION_DTB], "dtb", RTYPE_DTH);
+        recipe_add(&recipe, RTYPE_DTA, &hdr.dtb_addr);
+        recipe_add(&recipe, RTYPE_DTN, "dtb");
+    }
+
+    if(hdr.signature_size > 0) {
+        add_extraction(&ex, &layout.sections[SECTION_SIGNATURE], "signature", RTYPE_SGH);
+        recipe_add(&recipe, RTYPE_SGN, "signature");
+    }
+
+    if(hdr.bootconfig_size > 0) {
+        add_extraction(&ex, &layout.sections[SECTION_BOOTCONFIG], "bootconfig", RTYPE_BCH);
+        recipe_add(&recipe, RTYPE_BCN, "bootconfig");
+    }
+
+    /* Stored sections are hashed as they are extracted, so the recipe waits for their digests */
+    struct uring *ring = io_get_backend() == IO_BACKEND_URING && ex.store == NULL ? uring_create() : NULL;
+
+    if(ring != NULL) {
+        extract_batched(&ex, ring);
+        uring_destroy(ring);
+    } else {
+        thread_pool_run(threads, ex.count, run_extraction, &ex);
+    }
+
+    if(recipe_write(&recipe, recipe_fd) < 0) {
+        fprintf(error_stream(), "disassemble: could not write recipe.cfg\n");
+        goto out;
+    }
+
+    if(unpack_dir != NULL) {
+#ifndef WIN32
+        mkdirat(dir_fd, unpack_dir, 0755);
+        ex.unpack_fd = io_openat(dir_fd, unpack_dir, O_RDONLY | O_DIRECTORY, 0);
+#endif
+        if(ex.unpack_fd == -1) {
+            fprintf(error_stream(), "disassemble: could not create directory %s\n", unpack_dir);
+            ex.status[0] = -1;
+        }
+    }
+
+    if(has_kernel)
+        add_decoding(&ex, kernel, kernel_type, "kernel", decompress, 0);
+    if(!has_fragments)
+        add_decoding(&ex, ramdisk, ramdisk_type, "ramdisk", decompress, ex.unpack_fd != -1);
+    thread_pool_run(threads, ex.decode_count, run_decoding, &ex);
+
+    status = 0;
+    for(size_t i = 0; i < ex.count; i++) {
+        if(ex.status[i] < 0) {
+            status = 1;
+        }
+    }
+
+    for(size_t i = 0; i < ex.decode_count; i++) {
+        if(ex.decodings[i].status < 0) {
+            status = 1;
+        }
+    }
+
+out:
+    if(ex.unpack_fd != -1)
+        io_close(ex.unpack_fd);
+#ifndef WIN32
+    store_close(&store);
+#endif
+    unmap_image(&map);
+    if(recipe_fd != -1)
+        io_close(recipe_fd);
+    io_close(fd);
+    return status;
+}
@@ -0,0 +1,15 @@
+#ifndef DISASSEMBLE_H
+#define DISASSEMBLE_H
+
+#include "bootimg.h"
+
+struct disassemble_options {
+    unsigned int threads;
+    int          decompress;    /* also write compressed kernels and ramdisks decompressed */
+    const char   *unpack_dir;   /* unpack the ramdisk archive here, relative to dir_fd */
+    const char   *store_dir;    /* keep sections in this section store and link them into dir_fd */
+};
+
+int disassemble_image(const char *filename, int dir_fd, const struct disassemble_options *options);
+
+#endif
@@ -0,0 +1,233 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bootimgtool.h"
+#include "edit_image.h"
+#include "file_io.h"
+#include "image_map.h"
+#include "layout.h"
+#include "stats.h"
+
+#ifdef WIN32
+#include "win32.h"
+#endif
+
+#define EDIT_FLAG(flag, field, name) { flag, field, offsetof(struct bootimg_header, name) }
+
+static const struct {
+    const char      *flag;
+    enum edit_field field;
+    size_t          offset;     /* of the header field it changes */
+} edit_flags[] = {
+    EDIT_FLAG("--cmdline",        EDIT_CMDLINE,        cmdline),
+    EDIT_FLAG("--extra-cmdline",  EDIT_EXTRA_CMDLINE,  extra_cmdline),
+    EDIT_FLAG("--name",           EDIT_NAME,           name),
+    EDIT_FLAG("--os-version",     EDIT_OS_VERSION,     os_version),
+    EDIT_FLAG("--os-patch-level", EDIT_OS_PATCH_LEVEL, os_version),
+    EDIT_FLAG("--kernel-addr",    EDIT_KERNEL_ADDR,    kernel_addr),
+    EDIT_FLAG("--ramdisk-addr",   EDIT_RAMDISK_ADDR,   ramdisk_addr),
+    EDIT_FLAG("--second-addr",    EDIT_SECOND_ADDR,    second_addr),
+    EDIT_FLAG("--tags-addr",      EDIT_TAGS_ADDR,      tags_addr),
+    EDIT_FLAG("--dtb-addr",       EDIT_DTB_ADDR,       dtb_addr),
+};
+
+int edit_field_from_flag(const char *flag, enum edit_field *field)
+{
+    for(size_t i = 0; i < sizeof(edit_flags) / sizeof(edit_flags[0]); i++) {
+        if(!strcmp(flag, edit_flags[i].flag)) {
+            *field = edit_flags[i].field;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+/* Whether the header version has the field an edit changes */
+static int edit_applies(const struct header_format *format, enum edit_field field)
+{
+    for(size_t i = 0; i < sizeof(edit_flags) / sizeof(edit_flags[0]); i++) {
+        if(edit_flags[i].field == field) {
+            return header_has_field(format, edit_flags[i].offset);
+        }
+    }
+    return 0;
+}
+
+static int set_string(uint8_t *field, size_t size, const char *value)
+{
+    if(strlen(value) >= size) {
+        return -1;
+    }
+    memset(field, 0, size);
+    memcpy(field, value, strlen(value));
+    return 1;
+}
+
+static int parse_number(const char *value, uint64_t *number)
+{
+    char *end = NULL;
+
+    *number = strtoull(value, &end, 0);
+    return (*value != '\0' && *end == '\0') ? 1 : -1;
+}
+
+static int parse_address(const char *value, uint32_t *address)
+{
+    uint64_t number = 0;
+
+    if(parse_number(value, &number) < 0 || number > UINT32_MAX) {
+        return -1;
+    }
+    *address = number;
+    return 1;
+}
+
+/* os_version packs a.b.c in its upper 21 bits and the patch level below */
+static int set_os_version(uint32_t *os_version, const char *value)
+{
+    unsigned int a = 0, b = 0, c = 0;
+
+    if(sscanf(value, "%u.%u.%u", &a, &b, &c) < 1 || a > 127 || b > 127 || c > 127) {
+        return -1;
+    }
+    *os_version = (a << 25) | (b << 18) | (c << 11) | (*os_version & 0x7ff);
+    return 1;
+}
+
+static int set_os_patch_level(uint32_t *os_version, const char *value)
+{
+    unsigned int y = 0, m = 0;
+
+    if(sscanf(value, "%u-%u", &y, &m) != 2 || y < 2000 || y > 2127 || m < 1 || m > 12) {
+        return -1;
+    }
+    *os_version = (*os_version & ~0x7ffu) | ((y - 2000) << 4) | m;
+    return 1;
+}
+
+static int apply_edit(struct bootimg_header *hdr, const struct header_format *format,
+                      const struct header_edit *edit)
+{
+    uint64_t number = 0;
+    uint32_t value = 0;
+    int      ret = -1;
+
+    switch(edit->field) {
+        case EDIT_CMDLINE:
+            return set_string(hdr->cmdline, format->cmdline_size, edit->value);
+        case EDIT_EXTRA_CMDLINE:
+            return set_string(hdr->extra_cmdline, sizeof(hdr->extra_cmdline), edit->value);
+        case EDIT_NAME:
+            return set_string(hdr->name, sizeof(hdr->name), edit->value);
+        case EDIT_OS_VERSION:
+            value = hdr->os_version;
+            ret = set_os_version(&value, edit->value);
+            hdr->os_version = value;
+            return ret;
+        case EDIT_OS_PATCH_LEVEL:
+            value = hdr->os_version;
+            ret = set_os_patch_level(&value, edit->value);
+            hdr->os_version = value;
+            return ret;
+        case EDIT_KERNEL_ADDR:
+            ret = parse_address(edit->value, &value);
+            hdr->kernel_addr = value;
+            return ret;
+        case EDIT_RAMDISK_ADDR:
+            ret = parse_address(edit->value, &value);
+            hdr->ramdisk_addr = value;
+            return ret;
+        case EDIT_SECOND_ADDR:
+            ret = parse_address(edit->value, &value);
+            hdr->second_addr = value;
+            return ret;
+        case EDIT_TAGS_ADDR:
+            ret = parse_address(edit->value, &value);
+            hdr->tags_addr = value;
+            return ret;
+        case EDIT_DTB_ADDR:
+            if(parse_number(edit->value, &number) < 0) {
+                return -1;
+            }
+            hdr->dtb_addr = number;
+            return 1;
+    }
+    return -1;
+}
+
+/*
+ * Applies edits to the header of filename and rewrites it in place. An
+ * id, for versions that have one, is recomputed with one read pass over
+ * the payload already in the image; hash selects the digest, or NULL
+ * keeps the one the image used. Only the header page is ever written.
+ */
+int edit_image(const char *filename, const struct header_edit *edits, size_t count, const enum id_hash *hash)
+{
+    int                    fd = io_open(filename, O_RDWR, 0);
+    int                    status = 1;
+    uint32_t               digest[8];
+    struct bootimg_header hdr;
+    const struct header_format *format = NULL;
+    uint8_t                header_data[BOOT_HEADER_V3_PAGE_SIZE];
+    size_t                 header_size = 0;
+    struct image_map       map;
+    struct stats_timer     timer;
+    enum id_hash           type;
+
+    memset(&map, 0, sizeof(struct image_map));
+
+    if(fd == -1) {
+        fprintf(stderr, "edit: could not open image %s\n", filename);
+        return 1;
+    }
+
+    if(is_valid_image(fd) < 0 || read_header(fd, &hdr) < 0) {
+        fprintf(stderr, "%s is not a valid image\n", filename);
+        goto out;
+    }
+
+    if((format = header_format(&hdr)) == NULL) {
+        fprintf(stderr, "edit: unsupported header version %u\n", hdr.header_version);
+        goto out;
+    }
+
+    type = hash != NULL ? *hash : detect_id_hash(&hdr);
+
+    for(size_t i = 0; i < count; i++) {
+        if(!edit_applies(format, edits[i].field)) {
+            fprintf(stderr, "edit: a version %u header has no such field\n", hdr.header_version);
+            goto out;
+        }
+
+        if(apply_edit(&hdr, format, &edits[i]) < 0) {
+            fprintf(stderr, "edit: invalid value %s\n", edits[i].value);
+            goto out;
+        }
+    }
+
+    if(format->has_id) {
+        if(map_image(fd, &map) < 0 || compute_image_id(&map, &hdr, type, digest) < 0) {
+            fprintf(stderr, "edit: could not read the payload of %s\n", filename);
+            goto out;
+        }
+        memcpy(hdr.id, digest, sizeof(hdr.id));
+    }
+    header_size = encode_header(&hdr, header_data, sizeof(header_data));
+
+    stats_begin(&timer);
+    if(io_pwrite_all(fd, header_data, header_size, 0) < 0) {
+        stats_end(&timer, STATS_HEADER);
+        fprintf(stderr, "edit: could not write header to %s\n", filename);
+        goto out;
+    }
+    stats_end(&timer, STATS_HEADER);
+    status = 0;
+
+out:
+    unmap_image(&map);
+    io_close(fd);
+    return status;
+}
@@ -0,0 +1,29 @@
+#ifndef EDIT_IMAGE_H
+#define EDIT_IMAGE_H
+
+#include <stddef.h>
+
+#include "image_id.h"
+
+enum edit_field {
+    EDIT_CMDLINE,
+    EDIT_EXTRA_CMDLINE,
+    EDIT_NAME,
+    EDIT_OS_VERSION,
+    EDIT_OS_PATCH_LEVEL,
+    EDIT_KERNEL_ADDR,
+    EDIT_RAMDISK_ADDR,
+    EDIT_SECOND_ADDR,
+    EDIT_TAGS_ADDR,
+    EDIT_DTB_ADDR
+};
+
+struct header_edit {
+    enum edit_field field;
+    const char      *value;
+};
+
+int edit_field_from_flag(const char *flag, enum edit_field *field);
+int edit_image(const char *filename, const struct header_edit *edits, size_t count, const enum id_hash *hash);
+
+#endif
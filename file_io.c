@@ -0,0 +1,162 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "file_io.h"
+#include "stats.h"
+
+#ifdef WIN32
+#include "win32.h"
+#endif
+
+static enum io_backend selected_backend = IO_BACKEND_POSIX;
+
+int io_backend_from_name(const char *name, enum io_backend *backend)
+{
+    if(!strcmp(name, "posix")) {
+        *backend = IO_BACKEND_POSIX;
+    } else if(!strcmp(name, "uring")) {
+        *backend = IO_BACKEND_URING;
+    } else {
+        return -1;
+    }
+    return 1;
+}
+
+void io_set_backend(enum io_backend backend)
+{
+    selected_backend = backend;
+}
+
+enum io_backend io_get_backend(void)
+{
+    return selected_backend;
+}
+
+int io_open(const char *filename, int flags, mode_t mode)
+{
+    stats_count_syscall();
+    return open(filename, flags, mode);
+}
+
+int io_openat(int dir_fd, const char *filename, int flags, mode_t mode)
+{
+    stats_count_syscall();
+    return openat(dir_fd, filename, flags, mode);
+}
+
+int io_close(int fd)
+{
+    stats_count_syscall();
+    return close(fd);
+}
+
+int io_fstat(int fd, struct stat *st)
+{
+    stats_count_syscall();
+    return fstat(fd, st);
+}
+
+off_t io_lseek(int fd, off_t offset, int whence)
+{
+    stats_count_syscall();
+    return lseek(fd, offset, whence);
+}
+
+int io_ftruncate(int fd, off_t size)
+{
+    stats_count_syscall();
+    return ftruncate(fd, size);
+}
+
+ssize_t io_read(int fd, void *buf, size_t size)
+{
+    ssize_t ret = read(fd, buf, size);
+
+    stats_count_syscall();
+    stats_count_read(ret);
+    return ret;
+}
+
+ssize_t io_write(int fd, const void *buf, size_t size)
+{
+    ssize_t ret = write(fd, buf, size);
+
+    stats_count_syscall();
+    stats_count_write(ret);
+    return ret;
+}
+
+ssize_t io_writev(int fd, const struct iovec *iov, int count)
+{
+    ssize_t ret = writev(fd, iov, count);
+
+    stats_count_syscall();
+    stats_count_write(ret);
+    return ret;
+}
+
+ssize_t io_pread(int fd, void *buf, size_t size, off_t offset)
+{
+    ssize_t ret = pread(fd, buf, size, offset);
+
+    stats_count_syscall();
+    stats_count_read(ret);
+    return ret;
+}
+
+ssize_t io_pwrite(int fd, const void *buf, size_t size, off_t offset)
+{
+    ssize_t ret = pwrite(fd, buf, size, offset);
+
+    stats_count_syscall();
+    stats_count_write(ret);
+    return ret;
+}
+
+/*
+ * copy_file_range() where the platform has it; elsewhere it fails with
+ * ENOSYS so callers take their buffered path.
+ */
+ssize_t io_copy_file_range(int in_fd, off_t *in_offset, int out_fd, off_t *out_offset, size_t size)
+{
+#ifdef __linux__
+    loff_t  in = *in_offset;
+    loff_t  out = *out_offset;
+    ssize_t ret = copy_file_range(in_fd, &in, out_fd, &out, size, 0);
+
+    stats_count_syscall();
+    stats_count_write(ret);
+    *in_offset = in;
+    *out_offset = out;
+    return ret;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* pwrite()s all of buf, retrying short writes. Returns -1 on failure. */
+int io_pwrite_all(int fd, const void *buf, size_t size, off_t offset)
+{
+    const char *data = buf;
+
+    while(size > 0) {
+        ssize_t written = io_pwrite(fd, data, size, offset);
+
+        if(written < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if(written <= 0) {
+            return -1;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef FILE_IO_H
+#define FILE_IO_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifndef WIN32
+#include <sys/uio.h>
+#endif
+
+/*
+ * How payload data is moved. IO_BACKEND_URING batches section reads and
+ * writes through io_uring where the kernel supports it and falls back
+ * to IO_BACKEND_POSIX, one pread/pwrite at a time, where it does not.
+ */
+enum io_backend {
+    IO_BACKEND_POSIX,
+    IO_BACKEND_URING
+};
+
+int             io_backend_from_name(const char *name, enum io_backend *backend);
+void            io_set_backend(enum io_backend backend);
+enum io_backend io_get_backend(void);
+
+/*
+ * Thin wrappers around the system calls bootimgtool uses for image and
+ * payload I/O. They behave exactly like the calls they wrap and account
+ * every call and transferred byte with the stats layer.
+ */
+int     io_open(const char *filename, int flags, mode_t mode);
+int     io_openat(int dir_fd, const char *filename, int flags, mode_t mode);
+int     io_close(int fd);
+int     io_fstat(int fd, struct stat *st);
+off_t   io_lseek(int fd, off_t offset, int whence);
+int     io_ftruncate(int fd, off_t size);
+ssize_t io_read(int fd, void *buf, size_t size);
+ssize_t io_write(int fd, const void *buf, size_t size);
+ssize_t io_writev(int fd, const struct iovec *iov, int count);
+ssize_t io_pread(int fd, void *buf, size_t size, off_t offset);
+ssize_t io_pwrite(int fd, const void *buf, size_t size, off_t offset);
+int     io_pwrite_all(int fd, const void *buf, size_t size, off_t offset);
+ssize_t io_copy_file_range(int in_fd, off_t *in_offset, int out_fd, off_t *out_offset, size_t size);
+
+#endif
@@ -0,0 +1,175 @@
+/* The SHA_CTX functions are deprecated in OpenSSL 3 but still shipped */
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include <openssl/sha.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image_id.h"
+#include "layout.h"
+#include "stats.h"
+
+/*
+ * The id is hashed with OpenSSL's SHA functions rather than through EVP.
+ * They run the same CPU-specific code (SHA-NI, ARMv8 crypto extensions)
+ * and keep their state in plain memory, which lets the repack cache
+ * save a hash part way through and pick it up again in a later run.
+ */
+int id_hash_from_name(const char *name, enum id_hash *type)
+{
+    if(!strcmp(name, "sha1")) {
+        *type = ID_HASH_SHA1;
+    } else if(!strcmp(name, "sha256")) {
+        *type = ID_HASH_SHA256;
+    } else {
+        return -1;
+    }
+    return 1;
+}
+
+const char *id_hash_name(enum id_hash type)
+{
+    return type == ID_HASH_SHA256 ? "sha256" : "sha1";
+}
+
+int image_id_init(struct image_id *id, enum id_hash type)
+{
+    struct image_id_state *state = stats_malloc(sizeof(struct image_id_state));
+
+    id->type = type;
+    id->ctx = state;
+
+    if(state == NULL) {
+        return -1;
+    }
+    state->type = type;
+
+    if((type == ID_HASH_SHA256 ? SHA256_Init(&state->ctx.sha256) : SHA1_Init(&state->ctx.sha1)) != 1) {
+        free(state);
+        id->ctx = NULL;
+        return -1;
+    }
+    return 1;
+}
+
+void image_id_update(struct image_id *id, const void *data, size_t size)
+{
+    struct image_id_state *state = id->ctx;
+    struct stats_timer    timer;
+
+    stats_begin(&timer);
+    if(id->type == ID_HASH_SHA256) {
+        SHA256_Update(&state->ctx.sha256, data, size);
+    } else {
+        SHA1_Update(&state->ctx.sha1, data, size);
+    }
+    stats_end(&timer, STATS_HASH);
+}
+
+void image_id_save(const struct image_id *id, struct image_id_state *state)
+{
+    memcpy(state, id->ctx, sizeof(struct image_id_state));
+}
+
+/* Returns -1 if state was saved from an id using a different hash */
+int image_id_restore(struct image_id *id, const struct image_id_state *state)
+{
+    if(state->type != id->type) {
+        return -1;
+    }
+    memcpy(id->ctx, state, sizeof(struct image_id_state));
+    return 1;
+}
+
+/* Hashes the header fields that follow the payload in the id */
+void image_id_update_header(struct image_id *id, const struct bootimg_header *hdr)
+{
+    image_id_update(id, &hdr->tags_addr, sizeof(hdr->tags_addr));
+    image_id_update(id, &hdr->page_size, sizeof(hdr->page_size));
+    image_id_update(id, &hdr->header_version, sizeof(hdr->header_version));
+    image_id_update(id, &hdr->os_version, sizeof(hdr->os_version));
+    image_id_update(id, hdr->name, sizeof(hdr->name));
+    image_id_update(id, hdr->cmdline, sizeof(hdr->cmdline));
+}
+
+/*
+ * Finishes the hash and stores it in digest, zero-filled to the size of
+ * the id field (SHA-1 leaves the last 12 bytes empty).
+ */
+int image_id_final(struct image_id *id, uint32_t digest[8])
+{
+    struct image_id_state *state = id->ctx;
+    unsigned char         md[SHA256_DIGEST_LENGTH];
+    size_t                md_size = id->type == ID_HASH_SHA256 ? SHA256_DIGEST_LENGTH : SHA_DIGEST_LENGTH;
+
+    if((id->type == ID_HASH_SHA256 ? SHA256_Final(md, &state->ctx.sha256) : SHA1_Final(md, &state->ctx.sha1)) != 1) {
+        return -1;
+    }
+
+    memset(digest, 0, sizeof(uint32_t) * 8);
+    memcpy(digest, md, md_size);
+    return 1;
+}
+
+void image_id_free(struct image_id *id)
+{
+    free(id->ctx);
+    id->ctx = NULL;
+}
+
+/*
+ * SHA-1 ids only fill the first 20 bytes of the id field, so an id with
+ * anything in the last 12 bytes was made with SHA-256.
+ */
+enum id_hash detect_id_hash(const struct bootimg_header *hdr)
+{
+    uint32_t id[8];
+
+    memcpy(id, hdr->id, sizeof(id));
+    return (id[5] | id[6] | id[7]) != 0 ? ID_HASH_SHA256 : ID_HASH_SHA1;
+}
+
+static int hash_mapped_section(struct image_id *id, const struct image_map *map, const struct section *section)
+{
+    if(section->offset > map->size || section->size > map->size - section->offset) {
+        return -1;
+    }
+    image_id_update(id, map->data + section->offset, section->size);
+    image_id_update(id, &section->size, sizeof(section->size));
+    return 1;
+}
+
+/*
+ * Recomputes the id of a mapped image the same way create_image() does,
+ * using the header fields in hdr (which may differ from the ones stored
+ * in the image). Returns -1 if a section lies outside the image or the
+ * header version has no id.
+ */
+int compute_image_id(const struct image_map *map, const struct bootimg_header *hdr,
+                     enum id_hash type, uint32_t digest[8])
+{
+    const struct header_format *format = header_format(hdr);
+    struct image_layout        layout;
+    struct image_id            id;
+    int                        ret = -1;
+
+    if(format == NULL || !format->has_id || compute_layout(hdr, &layout) < 0 || image_id_init(&id, type) < 0) {
+        return -1;
+    }
+
+    if(hash_mapped_section(&id, map, &layout.sections[SECTION_KERNEL]) < 0 ||
+       hash_mapped_section(&id, map, &layout.sections[SECTION_RAMDISK]) < 0) {
+        goto out;
+    }
+
+    if(hdr->second_size != 0 && hash_mapped_section(&id, map, &layout.sections[SECTION_SECOND]) < 0) {
+        goto out;
+    }
+
+    image_id_update_header(&id, hdr);
+    ret = image_id_final(&id, digest);
+
+out:
+    image_id_free(&id);
+    return ret;
+}
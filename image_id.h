@@ -0,0 +1,45 @@
+#ifndef IMAGE_ID_H
+#define IMAGE_ID_H
+
+#include <openssl/sha.h>
+#include <stddef.h>
+
+#include "bootimg.h"
+#include "image_map.h"
+
+/* Digest used for the id field of the header */
+enum id_hash {
+    ID_HASH_SHA1,
+    ID_HASH_SHA256
+};
+
+struct image_id {
+    void         *ctx;      /* a struct image_id_state */
+    enum id_hash type;
+};
+
+/* An id hashed part way, as plain bytes that can be stored and restored */
+struct image_id_state {
+    enum id_hash type;
+    union {
+        SHA_CTX    sha1;
+        SHA256_CTX sha256;
+    } ctx;
+};
+
+int         id_hash_from_name(const char *name, enum id_hash *type);
+const char *id_hash_name(enum id_hash type);
+
+int  image_id_init(struct image_id *id, enum id_hash type);
+void image_id_update(struct image_id *id, const void *data, size_t size);
+void image_id_update_header(struct image_id *id, const struct bootimg_header *hdr);
+void image_id_save(const struct image_id *id, struct image_id_state *state);
+int  image_id_restore(struct image_id *id, const struct image_id_state *state);
+int  image_id_final(struct image_id *id, uint32_t digest[8]);
+void image_id_free(struct image_id *id);
+
+enum id_hash detect_id_hash(const struct bootimg_header *hdr);
+int          compute_image_id(const struct image_map *map, const struct bootimg_header *hdr,
+                              enum id_hash type, uint32_t digest[8]);
+
+#endif
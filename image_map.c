@@ -0,0 +1,110 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#include "file_io.h"
+#include "image_map.h"
+#include "stats.h"
+
+#ifdef WIN32
+#include "win32.h"
+#endif
+
+int map_image(int fd, struct image_map *map)
+{
+    struct stat st;
+
+    memset(map, 0, sizeof(struct image_map));
+
+    if(io_fstat(fd, &st) < 0 || st.st_size <= 0) {
+        return -1;
+    }
+    map->size = st.st_size;
+
+#ifndef WIN32
+    stats_count_syscall();
+    map->data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if(map->data != MAP_FAILED) {
+        madvise(map->data, map->size, MADV_SEQUENTIAL);
+        map->mapped = 1;
+        return 1;
+    }
+    map->data = NULL;
+#endif
+
+    map->data = stats_malloc(map->size);
+
+    if(map->data == NULL) {
+        return -1;
+    }
+
+    if(io_pread(fd, map->data, map->size, 0) != (ssize_t) map->size) {
+        free(map->data);
+        map->data = NULL;
+        return -1;
+    }
+    return 1;
+}
+
+void unmap_image(struct image_map *map)
+{
+    if(map->data == NULL) {
+        return;
+    }
+
+#ifndef WIN32
+    if(map->mapped) {
+        stats_count_syscall();
+        munmap(map->data, map->size);
+    } else
+#endif
+    {
+        free(map->data);
+    }
+    map->data = NULL;
+    map->size = 0;
+}
+
+/*
+ * Writes size bytes starting at offset of the image to out_fd. Sections
+ * that would run past the end of the image are rejected rather than
+ * silently truncated.
+ */
+int write_section(const struct image_map *map, uint64_t offset, uint32_t size, int out_fd)
+{
+    const uint8_t      *data = NULL;
+    size_t             left = size;
+    struct stats_timer timer;
+
+    if(offset > map->size || size > map->size - offset) {
+        return -1;
+    }
+    data = map->data + offset;
+
+    /* Bytes taken from the mapping count as read even without a read() */
+    stats_count_read(size);
+    stats_begin(&timer);
+
+    while(left > 0) {
+        ssize_t written = io_write(out_fd, data, left);
+
+        if(written < 0) {
+            if(errno == EINTR)
+                continue;
+            stats_end(&timer, STATS_WRITE);
+            return -1;
+        }
+        data += written;
+        left -= written;
+    }
+    stats_end(&timer, STATS_WRITE);
+    return 1;
+}
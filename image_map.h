@@ -0,0 +1,24 @@
+#ifndef IMAGE_MAP_H
+#define IMAGE_MAP_H
+
+#include <stddef.h>
+
+#include "types.h"
+
+/*
+ * Read-only view of a whole image file. On POSIX systems the file is
+ * mmap'ed so sections can be handed straight to write() without being
+ * copied through a heap buffer first. Where mmap is not available the
+ * image is read into memory once instead.
+ */
+struct image_map {
+    uint8_t *data;
+    size_t   size;
+    int      mapped;
+};
+
+int  map_image(int fd, struct image_map *map);
+void unmap_image(struct image_map *map);
+int  write_section(const struct image_map *map, uint64_t offset, uint32_t size, int out_fd);
+
+#endif
@@ -0,0 +1,331 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bootimgtool.h"
+#include "file_io.h"
+#include "info_scan.h"
+#include "layout.h"
+#include "stats.h"
+#include "thread_pool.h"
+
+struct scan_file {
+    char *path;
+    int  explicit;    /* named on the command line rather than found in a directory */
+};
+
+struct scan {
+    struct scan_file *files;
+    size_t           count;
+    size_t           capacity;
+    enum info_format format;
+    pthread_mutex_t  output_lock;
+    int              failed;
+};
+
+/* nftw() has no user pointer, so the directory walk collects into this */
+static struct scan *walk_scan;
+
+static int add_file(struct scan *scan, const char *path, int explicit)
+{
+    if(scan->count == scan->capacity) {
+        size_t           capacity = scan->capacity ? scan->capacity * 2 : 256;
+        struct scan_file *files = realloc(scan->files, capacity * sizeof(struct scan_file));
+
+        if(files == NULL) {
+            return -1;
+        }
+        scan->files = files;
+        scan->capacity = capacity;
+    }
+
+    scan->files[scan->count].path = strdup(path);
+    scan->files[scan->count].explicit = explicit;
+
+    if(scan->files[scan->count].path == NULL) {
+        return -1;
+    }
+    scan->count++;
+    return 0;
+}
+
+static int walk_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void) ftw;
+
+    if(flag == FTW_F && S_ISREG(st->st_mode) && st->st_size >= (off_t) BOOT_HEADER_MIN_SIZE) {
+        return add_file(walk_scan, path, 0) < 0 ? -1 : 0;
+    }
+    return 0;
+}
+
+/* Bytes from 0x7f up are copied as they are, so UTF-8 paths and names survive */
+static void json_string(FILE *out, const uint8_t *value, size_t size)
+{
+    fputc('"', out);
+    for(size_t i = 0; i < size && value[i] != '\0'; i++) {
+        if(value[i] == '"' || value[i] == '\\') {
+            fprintf(out, "\\%c", value[i]);
+        } else if(value[i] < 0x20) {
+            fprintf(out, "\\u%04x", value[i]);
+        } else {
+            fputc(value[i], out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void csv_string(FILE *out, const uint8_t *value, size_t size)
+{
+    fputc('"', out);
+    for(size_t i = 0; i < size && value[i] != '\0'; i++) {
+        if(value[i] == '"') {
+            fputc('"', out);
+        }
+        fputc(value[i], out);
+    }
+    fputc('"', out);
+}
+
+static void id_hex(FILE *out, const struct bootimg_header *hdr)
+{
+    const uint8_t *id = (const uint8_t *) hdr + offsetof(struct bootimg_header, id);
+
+    for(size_t i = 0; i < sizeof(hdr->id); i++) {
+        fprintf(out, "%02x", id[i]);
+    }
+}
+
+static const char csv_columns[] =
+    "path,error,header_version,kernel_size,kernel_addr,ramdisk_size,ramdisk_addr,"
+    "second_size,second_addr,tags_addr,page_size,os_version,os_patch_level,name,cmdline,id,"
+    "header_size,recovery_dtbo_size,recovery_dtbo_offset,dtb_size,dtb_addr,signature_size\n";
+
+static void format_json(FILE *out, const char *path, const struct bootimg_header *hdr, const char *error)
+{
+    const struct header_format *format = header_format(hdr);
+
+    fputs("{\"path\":", out);
+    json_string(out, (const uint8_t *) path, strlen(path));
+
+    if(error != NULL) {
+        fprintf(out, ",\"error\":\"%s\"}\n", error);
+        return;
+    }
+
+    char version[OS_VERSION_SIZE];
+    char patch_level[OS_PATCH_LEVEL_SIZE];
+
+    fprintf(out, ",\"header_version\":%u,\"kernel_size\":%u,\"kernel_addr\":%u,\"ramdisk_size\":%u,"
+            "\"ramdisk_addr\":%u,\"second_size\":%u,\"second_addr\":%u,\"tags_addr\":%u,\"page_size\":%u,"
+            "\"os_version\":\"%s\",\"os_patch_level\":\"%s\",\"name\":",
+            hdr->header_version, hdr->kernel_size, hdr->kernel_addr, hdr->ramdisk_size, hdr->ramdisk_addr,
+            hdr->second_size, hdr->second_addr, hdr->tags_addr, hdr->page_size,
+            get_os_version(hdr->os_version, version), get_os_patch_level(hdr->os_version, patch_level));
+    json_string(out, hdr->name, sizeof(hdr->name));
+    fputs(",\"cmdline\":", out);
+    json_string(out, hdr->cmdline, format->cmdline_size);
+    fputs(",\"id\":\"", out);
+    id_hex(out, hdr);
+    fputc('"', out);
+
+    if(HEADER_HAS(format, header_size)) {
+        fprintf(out, ",\"header_size\":%u", hdr->header_size);
+    }
+
+    if(HEADER_HAS(format, recovery_dtbo_size)) {
+        fprintf(out, ",\"recovery_dtbo_size\":%u,\"recovery_dtbo_offset\":%llu",
+                hdr->recovery_dtbo_size, (unsigned long long) hdr->recovery_dtbo_offset);
+    }
+
+    if(HEADER_HAS(format, dtb_size)) {
+        fprintf(out, ",\"dtb_size\":%u,\"dtb_addr\":%llu", hdr->dtb_size, (unsigned long long) hdr->dtb_addr);
+    }
+
+    if(HEADER_HAS(format, signature_size)) {
+        fprintf(out, ",\"signature_size\":%u", hdr->signature_size);
+    }
+    fputs("}\n", out);
+}
+
+static void format_csv(FILE *out, const char *path, const struct bootimg_header *hdr, const char *error)
+{
+    const struct header_format *format = NULL;
+
+    csv_string(out, (const uint8_t *) path, strlen(path));
+
+    if(error != NULL) {
+        fprintf(out, ",%s,,,,,,,,,,,,,,,,,,,,\n", error);
+        return;
+    }
+    format = header_format(hdr);
+
+    char version[OS_VERSION_SIZE];
+    char patch_level[OS_PATCH_LEVEL_SIZE];
+
+    fprintf(out, ",,%u,%u,0x%x,%u,0x%x,%u,0x%x,0x%x,%u,%s,%s,", hdr->header_version, hdr->kernel_size,
+            hdr->kernel_addr, hdr->ramdisk_size, hdr->ramdisk_addr, hdr->second_size, hdr->second_addr,
+            hdr->tags_addr, hdr->page_size, get_os_version(hdr->os_version, version),
+            get_os_patch_level(hdr->os_version, patch_level));
+    csv_string(out, hdr->name, sizeof(hdr->name));
+    fputc(',', out);
+    csv_string(out, hdr->cmdline, format->cmdline_size);
+    fputc(',', out);
+    id_hex(out, hdr);
+
+    if(HEADER_HAS(format, header_size)) {
+        fprintf(out, ",%u", hdr->header_size);
+    } else {
+        fputc(',', out);
+    }
+
+    if(HEADER_HAS(format, recovery_dtbo_size)) {
+        fprintf(out, ",%u,%llu", hdr->recovery_dtbo_size, (unsigned long long) hdr->recovery_dtbo_offset);
+    } else {
+        fputs(",,", out);
+    }
+
+    if(HEADER_HAS(format, dtb_size)) {
+        fprintf(out, ",%u,0x%llx", hdr->dtb_size, (unsigned long long) hdr->dtb_addr);
+    } else {
+        fputs(",,", out);
+    }
+
+    if(HEADER_HAS(format, signature_size)) {
+        fprintf(out, ",%u\n", hdr->signature_size);
+    } else {
+        fputs(",\n", out);
+    }
+}
+
+static void format_result(struct scan *scan, FILE *out, const char *path,
+                          struct bootimg_header *hdr, const char *error)
+{
+    switch(scan->format) {
+        case INFO_JSON:
+            format_json(out, path, hdr, error);
+            break;
+        case INFO_CSV:
+            format_csv(out, path, hdr, error);
+            break;
+        case INFO_TEXT:
+            if(error != NULL) {
+                fprintf(stderr, "info: %s: %s\n", path, error);
+            } else {
+                fprintf(out, "%s:\n", path);
+                show_info(out, hdr);
+                fputc('\n', out);
+            }
+            break;
+    }
+}
+
+/*
+ * Probes one file and prints its result. Output is formatted into a
+ * private buffer first so that concurrent jobs emit whole records.
+ * Files found while walking a directory that are not boot images are
+ * skipped silently; named files that fail are reported.
+ */
+static void scan_job(size_t index, void *arg)
+{
+    struct scan            *scan = arg;
+    struct scan_file       *file = &scan->files[index];
+    struct bootimg_header hdr;
+    const char             *error = NULL;
+    char                   *text = NULL;
+    size_t                 size = 0;
+    FILE                   *out = NULL;
+    int                    fd = io_open(file->path, O_RDONLY, 0);
+
+    if(fd == -1) {
+        error = "could not open file";
+    } else {
+        if(probe_image(fd, &hdr) < 0) {
+            error = "not a valid image";
+        } else if(header_format(&hdr) == NULL) {
+            error = "unsupported header version";
+        }
+        io_close(fd);
+    }
+
+    if(error != NULL) {
+        if(!file->explicit) {
+            return;
+        }
+        __atomic_store_n(&scan->failed, 1, __ATOMIC_RELAXED);
+    }
+
+    if((out = open_memstream(&text, &size)) == NULL) {
+        __atomic_store_n(&scan->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    format_result(scan, out, file->path, &hdr, error);
+    fclose(out);
+
+    pthread_mutex_lock(&scan->output_lock);
+    fwrite(text, 1, size, stdout);
+    pthread_mutex_unlock(&scan->output_lock);
+    free(text);
+}
+
+int info_format_from_name(const char *name, enum info_format *format)
+{
+    if(!strcmp(name, "text")) {
+        *format = INFO_TEXT;
+    } else if(!strcmp(name, "json")) {
+        *format = INFO_JSON;
+    } else if(!strcmp(name, "csv")) {
+        *format = INFO_CSV;
+    } else {
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * Prints the header of every image among paths, descending into
+ * directories, using up to threads threads. Records come out in
+ * completion order, one JSON object or CSV row per line. Returns 1 if
+ * any named file could not be read as an image.
+ */
+int info_scan(char **paths, int count, enum info_format format, unsigned int threads)
+{
+    struct scan scan;
+    struct stat st;
+
+    memset(&scan, 0, sizeof(struct scan));
+    scan.format = format;
+
+    for(int i = 0; i < count; i++) {
+        if(stat(paths[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            walk_scan = &scan;
+            if(nftw(paths[i], walk_entry, 64, FTW_PHYS) != 0) {
+                fprintf(stderr, "info: could not scan %s\n", paths[i]);
+                scan.failed = 1;
+            }
+        } else if(add_file(&scan, paths[i], 1) < 0) {
+            scan.failed = 1;
+        }
+    }
+
+    if(format == INFO_CSV) {
+        fputs(csv_columns, stdout);
+    }
+
+    pthread_mutex_init(&scan.output_lock, NULL);
+    thread_pool_run(threads, scan.count, scan_job, &scan);
+    pthread_mutex_destroy(&scan.output_lock);
+    fflush(stdout);
+
+    for(size_t i = 0; i < scan.count; i++) {
+        free(scan.files[i].path);
+    }
+    free(scan.files);
+    return scan.failed ? 1 : 0;
+}
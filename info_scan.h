@@ -0,0 +1,13 @@
+#ifndef INFO_SCAN_H
+#define INFO_SCAN_H
+
+enum info_format {
+    INFO_TEXT,
+    INFO_JSON,
+    INFO_CSV
+};
+
+int info_format_from_name(const char *name, enum info_format *format);
+int info_scan(char **paths, int count, enum info_format format, unsigned int threads);
+
+#endif
@@ -0,0 +1,316 @@
+#include <string.h>
+
+#include "layout.h"
+
+#define FIELD(disk, name) FIELD_AS(disk, name, name)
+#define FIELD_AS(disk, disk_name, name) { offsetof(disk, disk_name), offsetof(struct bootimg_header, name), \
+                                          sizeof(((disk *) 0)->disk_name) }
+
+#define V0_FIELDS \
+    FIELD(struct bootimg_hdr_0_2, magic), \
+    FIELD(struct bootimg_hdr_0_2, kernel_size), \
+    FIELD(struct bootimg_hdr_0_2, kernel_addr), \
+    FIELD(struct bootimg_hdr_0_2, ramdisk_size), \
+    FIELD(struct bootimg_hdr_0_2, ramdisk_addr), \
+    FIELD(struct bootimg_hdr_0_2, second_size), \
+    FIELD(struct bootimg_hdr_0_2, second_addr), \
+    FIELD(struct bootimg_hdr_0_2, tags_addr), \
+    FIELD(struct bootimg_hdr_0_2, page_size), \
+    FIELD(struct bootimg_hdr_0_2, header_version), \
+    FIELD(struct bootimg_hdr_0_2, os_version), \
+    FIELD(struct bootimg_hdr_0_2, name), \
+    FIELD(struct bootimg_hdr_0_2, cmdline), \
+    FIELD(struct bootimg_hdr_0_2, id), \
+    FIELD(struct bootimg_hdr_0_2, extra_cmdline)
+
+#define V1_FIELDS V0_FIELDS, \
+    FIELD(struct bootimg_hdr_0_2, recovery_dtbo_size), \
+    FIELD(struct bootimg_hdr_0_2, recovery_dtbo_offset), \
+    FIELD(struct bootimg_hdr_0_2, header_size)
+
+#define V2_FIELDS V1_FIELDS, \
+    FIELD(struct bootimg_hdr_0_2, dtb_size), \
+    FIELD(struct bootimg_hdr_0_2, dtb_addr)
+
+#define V3_FIELDS(disk) \
+    FIELD(disk, magic), \
+    FIELD(disk, kernel_size), \
+    FIELD(disk, ramdisk_size), \
+    FIELD(disk, os_version), \
+    FIELD(disk, header_size), \
+    FIELD(disk, header_version), \
+    FIELD(disk, cmdline), \
+    FIELD(disk, extra_cmdline)
+
+#define VENDOR_V3_FIELDS(disk) \
+    FIELD(disk, magic), \
+    FIELD(disk, header_version), \
+    FIELD(disk, page_size), \
+    FIELD(disk, kernel_addr), \
+    FIELD(disk, ramdisk_addr), \
+    FIELD_AS(disk, vendor_ramdisk_size, ramdisk_size), \
+    FIELD(disk, cmdline), \
+    FIELD(disk, extra_cmdline), \
+    FIELD(disk, vendor_cmdline), \
+    FIELD(disk, tags_addr), \
+    FIELD(disk, name), \
+    FIELD(disk, header_size), \
+    FIELD(disk, dtb_size), \
+    FIELD(disk, dtb_addr)
+
+static const struct header_field v0_fields[] = { V0_FIELDS };
+static const struct header_field v1_fields[] = { V1_FIELDS };
+static const struct header_field v2_fields[] = { V2_FIELDS };
+static const struct header_field v3_fields[] = { V3_FIELDS(struct bootimg_hdr_v3) };
+static const struct header_field v4_fields[] = {
+    V3_FIELDS(struct bootimg_hdr_v4),
+    FIELD(struct bootimg_hdr_v4, signature_size)
+};
+static const struct header_field vendor_v3_fields[] = { VENDOR_V3_FIELDS(struct vendor_boot_hdr_v3) };
+static const struct header_field vendor_v4_fields[] = {
+    VENDOR_V3_FIELDS(struct vendor_boot_hdr_v4),
+    FIELD(struct vendor_boot_hdr_v4, vendor_ramdisk_table_size),
+    FIELD(struct vendor_boot_hdr_v4, vendor_ramdisk_table_entry_num),
+    FIELD(struct vendor_boot_hdr_v4, vendor_ramdisk_table_entry_size),
+    FIELD(struct vendor_boot_hdr_v4, bootconfig_size)
+};
+
+static const enum section_type v0_sections[] = {
+    SECTION_KERNEL, SECTION_RAMDISK, SECTION_SECOND
+};
+static const enum section_type v1_sections[] = {
+    SECTION_KERNEL, SECTION_RAMDISK, SECTION_SECOND, SECTION_RECOVERY_DTBO
+};
+static const enum section_type v2_sections[] = {
+    SECTION_KERNEL, SECTION_RAMDISK, SECTION_SECOND, SECTION_RECOVERY_DTBO, SECTION_DTB
+};
+static const enum section_type v3_sections[] = {
+    SECTION_KERNEL, SECTION_RAMDISK
+};
+static const enum section_type v4_sections[] = {
+    SECTION_KERNEL, SECTION_RAMDISK, SECTION_SIGNATURE
+};
+static const enum section_type vendor_v3_sections[] = {
+    SECTION_RAMDISK, SECTION_DTB
+};
+static const enum section_type vendor_v4_sections[] = {
+    SECTION_RAMDISK, SECTION_DTB, SECTION_VENDOR_RAMDISK_TABLE, SECTION_BOOTCONFIG
+};
+
+#define COUNT(array) (sizeof(array) / sizeof((array)[0]))
+#define FORMAT(version, disk_size, page_size, cmdline_size, has_id) \
+    { BOOT_MAGIC, BOOT_HEADER_VERSION_OFFSET, version, disk_size, page_size, cmdline_size, has_id, \
+      v##version##_fields, COUNT(v##version##_fields), v##version##_sections, COUNT(v##version##_sections) }
+#define VENDOR_FORMAT(version, disk_size) \
+    { VENDOR_BOOT_MAGIC, VENDOR_BOOT_HEADER_VERSION_OFFSET, version, disk_size, 0, VENDOR_BOOT_ARGS_SIZE, 0, \
+      vendor_v##version##_fields, COUNT(vendor_v##version##_fields), \
+      vendor_v##version##_sections, COUNT(vendor_v##version##_sections) }
+
+static const struct header_format formats[] = {
+    FORMAT(0, offsetof(struct bootimg_hdr_0_2, recovery_dtbo_size), 0, BOOT_ARGS_SIZE, 1),
+    FORMAT(1, offsetof(struct bootimg_hdr_0_2, dtb_size), 0, BOOT_ARGS_SIZE, 1),
+    FORMAT(2, sizeof(struct bootimg_hdr_0_2), 0, BOOT_ARGS_SIZE, 1),
+    FORMAT(3, sizeof(struct bootimg_hdr_v3), BOOT_HEADER_V3_PAGE_SIZE, BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE, 0),
+    FORMAT(4, sizeof(struct bootimg_hdr_v4), BOOT_HEADER_V3_PAGE_SIZE, BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE, 0),
+    VENDOR_FORMAT(3, sizeof(struct vendor_boot_hdr_v3)),
+    VENDOR_FORMAT(4, sizeof(struct vendor_boot_hdr_v4)),
+};
+
+/* The header field holding the size of each section */
+static const size_t section_sizes[SECTION_COUNT] = {
+    [SECTION_KERNEL]               = offsetof(struct bootimg_header, kernel_size),
+    [SECTION_RAMDISK]              = offsetof(struct bootimg_header, ramdisk_size),
+    [SECTION_SECOND]               = offsetof(struct bootimg_header, second_size),
+    [SECTION_RECOVERY_DTBO]        = offsetof(struct bootimg_header, recovery_dtbo_size),
+    [SECTION_DTB]                  = offsetof(struct bootimg_header, dtb_size),
+    [SECTION_SIGNATURE]            = offsetof(struct bootimg_header, signature_size),
+    [SECTION_VENDOR_RAMDISK_TABLE] = offsetof(struct bootimg_header, vendor_ramdisk_table_size),
+    [SECTION_BOOTCONFIG]           = offsetof(struct bootimg_header, bootconfig_size),
+};
+
+static const char *const section_names[SECTION_COUNT] = {
+    [SECTION_KERNEL]               = "kernel",
+    [SECTION_RAMDISK]              = "ramdisk",
+    [SECTION_SECOND]               = "second",
+    [SECTION_RECOVERY_DTBO]        = "recovery dtbo",
+    [SECTION_DTB]                  = "dtb",
+    [SECTION_SIGNATURE]            = "signature",
+    [SECTION_VENDOR_RAMDISK_TABLE] = "vendor ramdisk table",
+    [SECTION_BOOTCONFIG]           = "bootconfig",
+};
+
+/* Returns NULL for an image type or header version this tool does not know */
+const struct header_format *find_header_format(const uint8_t *magic, uint32_t header_version)
+{
+    for(size_t i = 0; i < COUNT(formats); i++) {
+        if(formats[i].version == header_version && memcmp(magic, formats[i].magic, BOOT_MAGIC_SIZE) == 0) {
+            return &formats[i];
+        }
+    }
+    return NULL;
+}
+
+const struct header_format *header_format(const struct bootimg_header *hdr)
+{
+    return find_header_format(hdr->magic, hdr->header_version);
+}
+
+/* Whether magic starts a boot or vendor_boot image, of any version */
+int is_known_magic(const uint8_t *magic)
+{
+    return memcmp(magic, BOOT_MAGIC, BOOT_MAGIC_SIZE) == 0 ||
+           memcmp(magic, VENDOR_BOOT_MAGIC, BOOT_MAGIC_SIZE) == 0;
+}
+
+/* Whether a version has the field at offset in struct bootimg_header */
+int header_has_field(const struct header_format *format, size_t offset)
+{
+    for(size_t i = 0; i < format->field_count; i++) {
+        if(format->fields[i].offset == offset) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int header_has_section(const struct header_format *format, enum section_type type)
+{
+    for(size_t i = 0; i < format->section_count; i++) {
+        if(format->sections[i] == type) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Converts the on-disk header at data to hdr. Returns 1 if it was
+ * converted, 0 for an image whose header version is unknown, of which
+ * only magic and header_version are filled in, and -1 if data is not a
+ * boot or vendor_boot image header at all.
+ */
+int decode_header(const void *data, size_t size, struct bootimg_header *hdr)
+{
+    const struct header_format *format = NULL;
+    uint32_t                   version = 0;
+
+    memset(hdr, 0, sizeof(struct bootimg_header));
+
+    if(size < BOOT_HEADER_MIN_SIZE || !is_known_magic(data)) {
+        return -1;
+    }
+    if(memcmp(data, VENDOR_BOOT_MAGIC, BOOT_MAGIC_SIZE) == 0) {
+        memcpy(&version, (const uint8_t *) data + VENDOR_BOOT_HEADER_VERSION_OFFSET, sizeof(version));
+    } else {
+        memcpy(&version, (const uint8_t *) data + BOOT_HEADER_VERSION_OFFSET, sizeof(version));
+    }
+    memcpy(hdr->magic, data, BOOT_MAGIC_SIZE);
+    hdr->header_version = version;
+
+    format = header_format(hdr);
+    if(format == NULL) {
+        return 0;
+    }
+
+    if(size < format->size) {
+        return -1;
+    }
+
+    for(size_t i = 0; i < format->field_count; i++) {
+        const struct header_field *field = &format->fields[i];
+
+        memcpy((uint8_t *) hdr + field->offset, (const uint8_t *) data + field->disk_offset, field->size);
+    }
+
+    if(format->page_size != 0) {
+        hdr->page_size = format->page_size;
+    }
+    return 1;
+}
+
+/*
+ * Writes hdr to data in the on-disk form of its version, dropping the
+ * fields that version does not have. Returns the size of the header,
+ * or 0 if the version is unknown or data is too small.
+ */
+size_t encode_header(const struct bootimg_header *hdr, void *data, size_t size)
+{
+    const struct header_format *format = header_format(hdr);
+
+    if(format == NULL || size < format->size) {
+        return 0;
+    }
+    memset(data, 0, format->size);
+
+    for(size_t i = 0; i < format->field_count; i++) {
+        const struct header_field *field = &format->fields[i];
+
+        memcpy((uint8_t *) data + field->disk_offset, (const uint8_t *) hdr + field->offset, field->size);
+    }
+    return format->size;
+}
+
+uint64_t page_align(uint64_t size, uint32_t page_size)
+{
+    return ((size + page_size - 1) / page_size) * page_size;
+}
+
+/* Bytes of header on disk for hdr's version, or 0 if it is unknown */
+uint32_t bootimg_header_size(const struct bootimg_header *hdr)
+{
+    const struct header_format *format = header_format(hdr);
+
+    return format != NULL ? format->size : 0;
+}
+
+uint32_t section_size(const struct bootimg_header *hdr, enum section_type type)
+{
+    uint32_t size = 0;
+
+    memcpy(&size, (const uint8_t *) hdr + section_sizes[type], sizeof(size));
+    return size;
+}
+
+/* The section's name in messages */
+const char *section_name(enum section_type type)
+{
+    return section_names[type];
+}
+
+/*
+ * Fills layout with the offset and size of each section of an image
+ * with header hdr, in the order its version puts them after the header
+ * pages. Sections the version does not have are left empty at the end.
+ * Returns -1 for an unknown version or a page size that makes the
+ * layout meaningless.
+ */
+int compute_layout(const struct bootimg_header *hdr, struct image_layout *layout)
+{
+    const struct header_format *format = header_format(hdr);
+    uint64_t                   offset = 0;
+
+    memset(layout, 0, sizeof(struct image_layout));
+
+    if(format == NULL || hdr->page_size == 0) {
+        return -1;
+    }
+
+    /* A vendor_boot header is larger than its smallest page size */
+    offset = page_align(format->size, hdr->page_size);
+
+    for(size_t i = 0; i < format->section_count; i++) {
+        struct section *section = &layout->sections[format->sections[i]];
+
+        section->offset = offset;
+        section->size = section_size(hdr, format->sections[i]);
+        offset += page_align(section->size, hdr->page_size);
+    }
+
+    for(int i = 0; i < SECTION_COUNT; i++) {
+        if(!header_has_section(format, i)) {
+            layout->sections[i].offset = offset;
+        }
+    }
+    layout->total_size = offset;
+    return 1;
+}
@@ -0,0 +1,69 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <stddef.h>
+
+#include "bootimg.h"
+
+enum section_type {
+    SECTION_KERNEL,
+    SECTION_RAMDISK,
+    SECTION_SECOND,
+    SECTION_RECOVERY_DTBO,
+    SECTION_DTB,
+    SECTION_SIGNATURE,
+    SECTION_VENDOR_RAMDISK_TABLE,
+    SECTION_BOOTCONFIG,
+    SECTION_COUNT
+};
+
+struct section {
+    uint64_t offset;
+    uint32_t size;
+};
+
+/* Where every section of an image lives, derived once from its header */
+struct image_layout {
+    struct section sections[SECTION_COUNT];
+    uint64_t       total_size;
+};
+
+/* One header field: where it is on disk and in struct bootimg_header */
+struct header_field {
+    uint16_t disk_offset;
+    uint16_t offset;
+    uint16_t size;
+};
+
+/* How a header version is laid out on disk and which sections follow it */
+struct header_format {
+    const char                *magic;           /* BOOT_MAGIC or VENDOR_BOOT_MAGIC */
+    uint32_t                  version_offset;   /* where header_version is on disk */
+    uint32_t                  version;
+    uint32_t                  size;             /* bytes of header on disk */
+    uint32_t                  page_size;        /* fixed page size, or 0 if the header has one */
+    uint32_t                  cmdline_size;     /* bytes of cmdline, which may run into extra_cmdline */
+    int                       has_id;
+    const struct header_field *fields;
+    size_t                    field_count;
+    const enum section_type   *sections;        /* in the order they follow the header */
+    size_t                    section_count;
+};
+
+#define HEADER_HAS(format, field) header_has_field(format, offsetof(struct bootimg_header, field))
+
+const struct header_format *find_header_format(const uint8_t *magic, uint32_t header_version);
+const struct header_format *header_format(const struct bootimg_header *hdr);
+int      is_known_magic(const uint8_t *magic);
+int      header_has_field(const struct header_format *format, size_t offset);
+int      header_has_section(const struct header_format *format, enum section_type type);
+int      decode_header(const void *data, size_t size, struct bootimg_header *hdr);
+size_t   encode_header(const struct bootimg_header *hdr, void *data, size_t size);
+
+uint64_t page_align(uint64_t size, uint32_t page_size);
+uint32_t bootimg_header_size(const struct bootimg_header *hdr);
+uint32_t section_size(const struct bootimg_header *hdr, enum section_type type);
+const char *section_name(enum section_type type);
+int      compute_layout(const struct bootimg_header *hdr, struct image_layout *layout);
+
+#endif
@@ -0,0 +1,228 @@
+#include <fcntl.h>
+#include <string.h>
+
+#include "bootimgtool.h"
+#include "disassemble.h"
+#include "libbootimg.h"
+#include "recipe.h"
+
+#ifdef WIN32
+#include "win32.h"
+#endif
+
+static void fill_info(struct bootimg_info *info)
+{
+    uint32_t os_version = info->hdr.os_version >> 11;
+    uint32_t os_patch_level = info->hdr.os_version & 0x7ff;
+
+    compute_layout(&info->hdr, &info->layout);
+    info->header_size = bootimg_header_size(&info->hdr);
+    info->os_release[0] = (os_version >> 14) & 0x7f;
+    info->os_release[1] = (os_version >> 7) & 0x7f;
+    info->os_release[2] = os_version & 0x7f;
+    info->os_patch_year = ((os_patch_level >> 4) & 0x7f) + 2000;
+    info->os_patch_month = os_patch_level & 0xf;
+}
+
+/* The header has to be of a version this library knows */
+static int check_header(const struct bootimg_header *hdr)
+{
+    const struct header_format *format = header_format(hdr);
+
+    if(format == NULL || hdr->page_size == 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int bootimg_parse(const void *image, size_t size, struct bootimg_info *info)
+{
+    memset(info, 0, sizeof(struct bootimg_info));
+
+    if(parse_header(image, size, &info->hdr) <= 0 || check_header(&info->hdr) < 0) {
+        return -1;
+    }
+    fill_info(info);
+    return 0;
+}
+
+int bootimg_parse_fd(int fd, struct bootimg_info *info)
+{
+    memset(info, 0, sizeof(struct bootimg_info));
+
+    if(probe_image(fd, &info->hdr) <= 0 || check_header(&info->hdr) < 0) {
+        return -1;
+    }
+    fill_info(info);
+    return 0;
+}
+
+int bootimg_section(const void *image, size_t size, const struct bootimg_info *info,
+                    enum section_type type, struct bootimg_span *span)
+{
+    const struct section *section;
+
+    if(type < 0 || type >= SECTION_COUNT) {
+        return -1;
+    }
+    section = &info->layout.sections[type];
+
+    /* A truncated image yields nothing rather than a span past its end */
+    if(section->offset > size || size - section->offset < section->size) {
+        return -1;
+    }
+    span->data = (const uint8_t*) image + section->offset;
+    span->size = section->size;
+    return 0;
+}
+
+int bootimg_compute_id(const void *image, size_t size, const struct bootimg_info *info,
+                       enum id_hash type, uint32_t digest[8])
+{
+    struct image_map map = { (uint8_t*) image, size, 0 };
+
+    return compute_image_id(&map, &info->hdr, type, digest) < 0 ? -1 : 0;
+}
+
+int bootimg_parse_recipe(const void *recipe, size_t size, struct bootimg_params *params)
+{
+    return parse_recipe_buffer(recipe, size, params);
+}
+
+/*
+ * The header create would write for these sections, without the id.
+ * Sections follow the same rules as create: the ramdisk of an image
+ * with an id is padded to 4 bytes, second needs an address and the
+ * others are only kept if the header version has them.
+ */
+static int build_header(const struct bootimg_params *params, const struct bootimg_span sections[SECTION_COUNT],
+                        struct bootimg_header *hdr)
+{
+    const struct header_format *format = params_format(params);
+
+    for(int i = 0; i < SECTION_COUNT; i++) {
+        if(sections[i].size > UINT32_MAX - 3) {
+            return -1;
+        }
+    }
+
+    if(format == NULL) {
+        return -1;
+    }
+
+    init_header(params, hdr);
+    hdr->kernel_size = sections[SECTION_KERNEL].size;
+    hdr->ramdisk_size = sections[SECTION_RAMDISK].size;
+    if(format->has_id) {
+        hdr->ramdisk_size = (hdr->ramdisk_size + 3) & ~3u;
+    }
+
+    if(header_has_section(format, SECTION_SECOND) && params->second_addr != 0 &&
+       sections[SECTION_SECOND].size != 0) {
+        hdr->second_size = sections[SECTION_SECOND].size;
+        hdr->second_addr = params->second_addr;
+    }
+
+    if(header_has_section(format, SECTION_DTB)) {
+        hdr->dtb_size = sections[SECTION_DTB].size;
+        hdr->dtb_addr = params->dtb_addr;
+    }
+
+    if(header_has_section(format, SECTION_SIGNATURE)) {
+        hdr->signature_size = sections[SECTION_SIGNATURE].size;
+    }
+
+    /* The table is taken as it is, so it has to be whole entries */
+    if(header_has_section(format, SECTION_VENDOR_RAMDISK_TABLE)) {
+        if(sections[SECTION_VENDOR_RAMDISK_TABLE].size % sizeof(struct vendor_ramdisk_table_entry) != 0) {
+            return -1;
+        }
+        hdr->vendor_ramdisk_table_size = sections[SECTION_VENDOR_RAMDISK_TABLE].size;
+        hdr->vendor_ramdisk_table_entry_num = hdr->vendor_ramdisk_table_size /
+                                              sizeof(struct vendor_ramdisk_table_entry);
+        hdr->vendor_ramdisk_table_entry_size = sizeof(struct vendor_ramdisk_table_entry);
+    }
+
+    if(header_has_section(format, SECTION_BOOTCONFIG)) {
+        hdr->bootconfig_size = sections[SECTION_BOOTCONFIG].size;
+    }
+
+    if(HEADER_HAS(format, header_size)) {
+        hdr->header_size = format->size;
+    }
+    return check_header(hdr);
+}
+
+size_t bootimg_build_size(const struct bootimg_params *params, const struct bootimg_span sections[SECTION_COUNT])
+{
+    struct bootimg_header hdr;
+    struct image_layout    layout;
+
+    if(build_header(params, sections, &hdr) < 0 || compute_layout(&hdr, &layout) < 0) {
+        return 0;
+    }
+    return layout.total_size;
+}
+
+int bootimg_build(const struct bootimg_params *params, const struct bootimg_span sections[SECTION_COUNT],
+                  enum id_hash hash, void *out, size_t capacity, size_t *size)
+{
+    struct bootimg_header hdr;
+    struct image_layout    layout;
+    struct image_map       map = { out, capacity, 0 };
+    uint8_t                *image = out;
+    uint32_t               digest[8];
+
+    if(build_header(params, sections, &hdr) < 0 || compute_layout(&hdr, &layout) < 0 ||
+       layout.total_size > capacity) {
+        return -1;
+    }
+
+    /* Padding is zeros, so clear the whole image and drop the sections in */
+    memset(image, 0, layout.total_size);
+    for(int i = 0; i < SECTION_COUNT; i++) {
+        if(layout.sections[i].size != 0) {
+            memcpy(image + layout.sections[i].offset, sections[i].data, sections[i].size);
+        }
+    }
+
+    if(header_format(&hdr)->has_id) {
+        if(compute_image_id(&map, &hdr, hash, digest) < 0) {
+            return -1;
+        }
+        memcpy(hdr.id, digest, sizeof(hdr.id));
+    }
+    encode_header(&hdr, image, layout.total_size);
+
+    *size = layout.total_size;
+    return 0;
+}
+
+void bootimg_ctx_init(struct bootimg_ctx *ctx)
+{
+    ctx->dir_fd = AT_FDCWD;
+    ctx->threads = 1;
+    ctx->hash = ID_HASH_SHA1;
+}
+
+int bootimg_create(const struct bootimg_ctx *ctx, const struct bootimg_params *params, const char *output)
+{
+    struct create_options options = { 0 };
+
+    options.threads = ctx->threads;
+    options.hash = ctx->hash;
+    options.format = CREATE_RAW;
+    options.ramdisk_compression = COMPRESSION_NONE;
+    options.ramdisk_level = -1;
+
+    return create_image_at(ctx->dir_fd, (struct bootimg_params*) params, &options, output) == 0 ? 0 : -1;
+}
+
+int bootimg_disassemble(const struct bootimg_ctx *ctx, const char *image)
+{
+    struct disassemble_options options = { 0 };
+
+    options.threads = ctx->threads;
+
+    return disassemble_image(image, ctx->dir_fd, &options) == 0 ? 0 : -1;
+}
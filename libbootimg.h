@@ -0,0 +1,61 @@
+#ifndef LIBBOOTIMG_H
+#define LIBBOOTIMG_H
+
+#include <stddef.h>
+
+#include "bootimg.h"
+#include "create_image.h"
+#include "image_id.h"
+#include "layout.h"
+
+/*
+ * libbootimg: the parts of bootimgtool that other programs embed.
+ *
+ * Everything below works on memory or descriptors the caller owns and
+ * keeps no state between calls, so any number of threads can use it at
+ * once as long as they do not share an output. The memory entry points
+ * do not allocate; the descriptor and path ones do what the matching
+ * bootimgtool command does. All of them return 0 on success and -1 on
+ * failure.
+ */
+
+/* A run of bytes owned by the caller */
+struct bootimg_span {
+    const void *data;
+    size_t     size;
+};
+
+/* What a parsed header says about an image */
+struct bootimg_info {
+    struct bootimg_header hdr;
+    struct image_layout    layout;
+    uint32_t               header_size;     /* bytes of hdr that the header version uses */
+    uint32_t               os_release[3];   /* a.b.c */
+    uint32_t               os_patch_year;
+    uint32_t               os_patch_month;
+};
+
+/* Settings for the descriptor based calls */
+struct bootimg_ctx {
+    int          dir_fd;        /* payloads and outputs are relative to this */
+    unsigned int threads;       /* worker threads, 1 by default */
+    enum id_hash hash;
+};
+
+int bootimg_parse(const void *image, size_t size, struct bootimg_info *info);
+int bootimg_parse_fd(int fd, struct bootimg_info *info);
+int bootimg_section(const void *image, size_t size, const struct bootimg_info *info,
+                    enum section_type type, struct bootimg_span *span);
+int bootimg_compute_id(const void *image, size_t size, const struct bootimg_info *info,
+                       enum id_hash type, uint32_t digest[8]);
+
+int    bootimg_parse_recipe(const void *recipe, size_t size, struct bootimg_params *params);
+size_t bootimg_build_size(const struct bootimg_params *params, const struct bootimg_span sections[SECTION_COUNT]);
+int    bootimg_build(const struct bootimg_params *params, const struct bootimg_span sections[SECTION_COUNT],
+                     enum id_hash hash, void *out, size_t capacity, size_t *size);
+
+void bootimg_ctx_init(struct bootimg_ctx *ctx);
+int  bootimg_create(const struct bootimg_ctx *ctx, const struct bootimg_params *params, const char *output);
+int  bootimg_disassemble(const struct bootimg_ctx *ctx, const char *image);
+
+#endif
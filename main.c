@@ -0,0 +1,703 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "avb.h"
+#include "batch.h"
+#include "bootimgtool.h"
+#include "compress.h"
+#include "create_image.h"
+#include "delta.h"
+#include "disassemble.h"
+#include "edit_image.h"
+#include "file_io.h"
+#include "info_scan.h"
+#include "recipe.h"
+#include "serve.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "verify.h"
+
+#ifdef WIN32
+#include "win32.h"
+#endif
+
+static int usage()
+{
+    fprintf(stdout, "Usage: bootimgtool [--stats[=json]] [--io=posix|uring] info | create | disassemble | edit | batch | verify | avb | diff | patch | serve\n\n");
+    fprintf(stdout, "Type bootimgtool <command> help for more information\n\n");
+    fprintf(stdout, "--stats\t\tPrints time spent per phase, bytes read and written,\n");
+    fprintf(stdout, "\t\tsyscalls and allocations to stderr when done\n");
+    fprintf(stdout, "--stats=json\tSame as --stats as a single line of JSON\n");
+    fprintf(stdout, "--io=uring\tMoves section data with batched io_uring requests\n");
+    fprintf(stdout, "\t\tinstead of one pread/pwrite at a time, where supported\n");
+    return 1;
+}
+
+static int usage_create()
+{
+    fprintf(stdout, "bootimgtool create [-j threads] [--hash sha1|sha256] [--sparse holes|android]\n");
+    fprintf(stdout, "                   [--compress-ramdisk gzip|xz|lz4|zstd[:level]] [--cache-dir dir]\n");
+    fprintf(stdout, "                   [--store dir] [-o filename]\n\n");
+    fprintf(stdout, "Creates a new image named filename\n\n");
+    fprintf(stdout, "-o, --output\tSpecifies the output filename\n");
+    fprintf(stdout, "-j, --jobs\tCopies sections and computes the id in parallel\n");
+    fprintf(stdout, "--hash\t\tDigest used for the image id (default sha1)\n");
+    fprintf(stdout, "--sparse\tLeaves page padding as holes in the file, or writes\n");
+    fprintf(stdout, "\t\tan Android sparse image for fastboot with android\n");
+    fprintf(stdout, "--compress-ramdisk\n");
+    fprintf(stdout, "\t\tCompresses the ramdisk on all threads while writing\n");
+    fprintf(stdout, "\t\tit. The recipe's ramdisk may also name a directory,\n");
+    fprintf(stdout, "\t\twhich is packed as a cpio archive.\n");
+    fprintf(stdout, "--cache-dir\tKeeps the id hash state of each section in dir so\n");
+    fprintf(stdout, "\t\tthat later builds skip hashing unchanged sections\n");
+    fprintf(stdout, "--store\t\tReads sections missing from the current directory\n");
+    fprintf(stdout, "\t\tfrom the section store in dir, by the digests that\n");
+    fprintf(stdout, "\t\tdisassemble --store recorded in the recipe\n");
+    fprintf(stdout, "\n");
+    fprintf(stdout, "If a file named recipe.cfg exists, bootimgtool will\n");
+    fprintf(stdout, "read that file and get needed parameters from it. In\n");
+    fprintf(stdout, "that case, only the -o parameter is needed.\n");
+}
+
+static int usage_disassemble()
+{
+    fprintf(stdout, "bootimgtool disassemble [-j threads] [--decompress] [--unpack dir] [--store dir]\n");
+    fprintf(stdout, "                        <filename>\n\n");
+    fprintf(stdout, "Parses filename and extracts kernel, ramdisk and\n");
+    fprintf(stdout, "other contents, and creates a recipe.cfg file with\n");
+    fprintf(stdout, "all the parameters of the image (kernel address, ramdisk\n");
+    fprintf(stdout, "address, command line, etc.) so it can be used by the create\n");
+    fprintf(stdout, "command to repack the image again.\n\n");
+    fprintf(stdout, "-j, --jobs\tExtracts up to threads sections at once\n");
+    fprintf(stdout, "--decompress\tAlso writes a gzip, xz, lz4 or zstd compressed\n");
+    fprintf(stdout, "\t\tkernel and ramdisk decompressed, as kernel and ramdisk\n");
+    fprintf(stdout, "--unpack\tUnpacks the ramdisk cpio archive into dir\n");
+    fprintf(stdout, "--store\t\tKeeps each section once in the content-addressed\n");
+    fprintf(stdout, "\t\tstore in dir, named by its SHA-256, and reflinks it\n");
+    fprintf(stdout, "\t\there, or hardlinks or copies it where that is not\n");
+    fprintf(stdout, "\t\tpossible. Sections the store already has are not\n");
+    fprintf(stdout, "\t\twritten again, and the recipe records each digest.\n");
+}
+
+static int usage_edit()
+{
+    fprintf(stdout, "bootimgtool edit <image> [options]\n\n");
+    fprintf(stdout, "Changes header fields of image in place and updates its\n");
+    fprintf(stdout, "id without rewriting the kernel, ramdisk or other sections.\n\n");
+    fprintf(stdout, "--cmdline <cmdline>\n");
+    fprintf(stdout, "--extra-cmdline <cmdline>\n");
+    fprintf(stdout, "--name <product name>\n");
+    fprintf(stdout, "--os-version <a.b.c>\n");
+    fprintf(stdout, "--os-patch-level <YYYY-MM>\n");
+    fprintf(stdout, "--kernel-addr, --ramdisk-addr, --second-addr,\n");
+    fprintf(stdout, "--tags-addr, --dtb-addr <address>\n");
+    fprintf(stdout, "--hash sha1|sha256\tDigest for the new id (default: the one\n");
+    fprintf(stdout, "\t\t\tthe image already uses)\n");
+    return 1;
+}
+
+static int usage_batch()
+{
+    fprintf(stdout, "bootimgtool batch [-j threads] <manifest>\n\n");
+    fprintf(stdout, "Runs every job listed in manifest on a pool of worker\n");
+    fprintf(stdout, "threads (one per CPU by default). Each line of the\n");
+    fprintf(stdout, "manifest is one of:\n\n");
+    fprintf(stdout, "  info <image>\n");
+    fprintf(stdout, "  disassemble <image> <output directory>\n");
+    fprintf(stdout, "  create <recipe directory> <output image>\n");
+    fprintf(stdout, "  verify <image>\n\n");
+    fprintf(stdout, "-j, --jobs\tNumber of worker threads\n");
+    return 1;
+}
+
+static int usage_serve()
+{
+    fprintf(stdout, "bootimgtool serve [-j threads] <socket>\n\n");
+    fprintf(stdout, "Listens on the Unix socket <socket> and runs the requests\n");
+    fprintf(stdout, "clients send on worker threads that stay up between\n");
+    fprintf(stdout, "them. A request is one line in the batch manifest format;\n");
+    fprintf(stdout, "each is answered with a line holding its exit status and\n");
+    fprintf(stdout, "the length of its output, followed by the output. Runs\n");
+    fprintf(stdout, "until interrupted.\n\n");
+    fprintf(stdout, "-j, --jobs\tNumber of worker threads (default: one per CPU)\n");
+    return 1;
+}
+
+static int usage_info()
+{
+    fprintf(stdout, "bootimgtool info [-j threads] [--format text|json|csv] <image|directory>...\n\n");
+    fprintf(stdout, "Displays information about <image>. Several images and\n");
+    fprintf(stdout, "directories can be given; directories are searched for\n");
+    fprintf(stdout, "boot images recursively and the headers are read in\n");
+    fprintf(stdout, "parallel.\n\n");
+    fprintf(stdout, "-j, --jobs\tNumber of threads (default: one per CPU)\n");
+    fprintf(stdout, "--format\tOutput format; json and csv print one line per image\n");
+    return 1;
+}
+
+static int usage_verify()
+{
+    fprintf(stdout, "bootimgtool verify [-j threads] <image>...\n\n");
+    fprintf(stdout, "Checks that each image's sections fit inside it, that\n");
+    fprintf(stdout, "its padding is zero and that its id matches its contents.\n");
+    fprintf(stdout, "Images are verified in parallel, each in a single pass,\n");
+    fprintf(stdout, "and the throughput is printed at the end. The exit status\n");
+    fprintf(stdout, "is 1 if any image fails.\n\n");
+    fprintf(stdout, "-j, --jobs\tNumber of threads (default: one per CPU)\n");
+    return 1;
+}
+
+static int usage_avb()
+{
+    fprintf(stdout, "bootimgtool avb [-j threads] <image>\n\n");
+    fprintf(stdout, "Prints the AVB footer, vbmeta header and descriptors of\n");
+    fprintf(stdout, "<image> and verifies them: the vbmeta hash and signature\n");
+    fprintf(stdout, "against its embedded key, and each hash and hashtree\n");
+    fprintf(stdout, "descriptor against its partition, looked up next to\n");
+    fprintf(stdout, "<image> as <partition name><extension> when it is not\n");
+    fprintf(stdout, "<image> itself. The exit status is 1 if anything fails.\n\n");
+    fprintf(stdout, "-j, --jobs\tHashes hashtree levels on up to threads threads\n");
+    return 1;
+}
+
+static int usage_diff()
+{
+    fprintf(stdout, "bootimgtool diff [-j threads] <source> <target> <delta>\n\n");
+    fprintf(stdout, "Writes to <delta> what it takes to turn the image <source>\n");
+    fprintf(stdout, "into the image <target>. The header, each section and\n");
+    fprintf(stdout, "anything after the last section are compared with the\n");
+    fprintf(stdout, "same part of <source> and stored as unchanged or as LZMA2\n");
+    fprintf(stdout, "primed with it.\n\n");
+    fprintf(stdout, "-j, --jobs\tEncodes parts on up to threads threads\n");
+    return 1;
+}
+
+static int usage_patch()
+{
+    fprintf(stdout, "bootimgtool patch [-j threads] <source> <delta> <target>\n\n");
+    fprintf(stdout, "Rebuilds in <target> the image <delta> was made for from\n");
+    fprintf(stdout, "the image <source> it was made against. The result is\n");
+    fprintf(stdout, "checked against the digest of the original target.\n\n");
+    fprintf(stdout, "-j, --jobs\tDecodes parts on up to threads threads\n");
+    return 1;
+}
+
+static int run_command(int argc, char *argv[])
+{
+    if(argc >= 2) 
+    {
+        if(!strcmp(argv[1], "info")) 
+        {
+            if(argc >= 3) 
+            {
+                if(!strcmp(argv[2], "help"))
+                {
+                    return usage_info();
+                }
+
+                enum info_format format = INFO_TEXT;
+                unsigned int     threads = 0;
+                struct stat      st;
+                char             **ars = argv + 2;
+                int              arc = argc - 2;
+
+                while(arc > 1 && (*ars)[0] == '-')
+                {
+                    if(!strcmp(*ars, "-j") || !strcmp(*ars, "--jobs"))
+                    {
+                        threads = atoi(*(ars + 1));
+
+                        if(threads == 0)
+                        {
+                            return usage_info();
+                        }
+                    }
+                    else if(!strcmp(*ars, "--format"))
+                    {
+                        if(info_format_from_name(*(ars + 1), &format) < 0)
+                        {
+                            fprintf(stderr, "info: unknown format %s\n", *(ars + 1));
+                            return 1;
+                        }
+                    }
+                    else
+                    {
+                        fprintf(stderr, "info: unknown flag %s\n", *ars);
+                        return 1;
+                    }
+                    ars += 2;
+                    arc -= 2;
+                }
+
+                if(arc == 0)
+                {
+                    return usage_info();
+                }
+
+                if(arc == 1 && format == INFO_TEXT && (stat(*ars, &st) < 0 || !S_ISDIR(st.st_mode)))
+                {
+                    return info_image(*ars, stdout);
+                }
+#ifndef WIN32
+                return info_scan(ars, arc, format, threads ? threads : thread_pool_default_size());
+#else
+                fprintf(stderr, "info: only one image at a time is supported\n");
+                return 1;
+#endif
+            } 
+            else 
+            {
+                fprintf(stderr, "info: need an image file\n");
+                return 1;
+            }
+        } 
+        else if(!strcmp(argv[1], "create")) 
+        {
+            if(argc >= 3)
+            {
+                if(!strcmp(argv[2], "help"))
+                {
+                    return usage_create();
+                }
+            }
+
+            struct bootimg_params params;
+            struct create_options options;
+            int                   fd = 0;
+            char                  *filename = NULL;
+
+            memset(&params, 0, sizeof(struct bootimg_params));
+            memset(&options, 0, sizeof(struct create_options));
+            options.threads = 1;
+            options.ramdisk_level = -1;
+
+            fd = open("recipe.cfg", O_RDONLY);
+
+            if(fd != -1) 
+            {
+                char **ars = argv + 2;
+                int  arc = argc - 2;
+                char *filename = NULL;
+
+               if(arc > 1) 
+               {
+                   while(arc > 0)
+                   {
+                       if(!strcmp(*ars, "-o") || !strcmp(*ars, "--output"))
+                        {
+                            filename = *(ars + 1);
+                            ars += 2;
+                            arc -= 2;
+                        }
+                        else if((!strcmp(*ars, "-j") || !strcmp(*ars, "--jobs")) && arc > 1)
+                        {
+                            options.threads = atoi(*(ars + 1));
+                            ars += 2;
+                            arc -= 2;
+
+                            if(options.threads == 0)
+                            {
+                                fprintf(stderr, "create: invalid number of threads\n");
+                                return 1;
+                            }
+                        }
+                        else if(!strcmp(*ars, "--hash") && arc > 1)
+                        {
+                            if(id_hash_from_name(*(ars + 1), &options.hash) < 0)
+                            {
+                                fprintf(stderr, "create: unknown hash %s\n", *(ars + 1));
+                                return 1;
+                            }
+                            ars += 2;
+                            arc -= 2;
+                        }
+                        else if(!strcmp(*ars, "--compress-ramdisk") && arc > 1)
+                        {
+                            if(compression_from_name(*(ars + 1), &options.ramdisk_compression,
+                                                     &options.ramdisk_level) < 0)
+                            {
+                                fprintf(stderr, "create: unsupported compression %s\n", *(ars + 1));
+                                return 1;
+                            }
+                            ars += 2;
+                            arc -= 2;
+                        }
+                        else if(!strcmp(*ars, "--cache-dir") && arc > 1)
+                        {
+                            options.cache_dir = *(ars + 1);
+                            ars += 2;
+                            arc -= 2;
+                        }
+                        else if(!strcmp(*ars, "--store") && arc > 1)
+                        {
+                            options.store_dir = *(ars + 1);
+                            ars += 2;
+                            arc -= 2;
+                        }
+                        else if(!strcmp(*ars, "--sparse") && arc > 1)
+                        {
+                            if(!strcmp(*(ars + 1), "holes"))
+                            {
+                                options.format = CREATE_HOLES;
+                            }
+                            else if(!strcmp(*(ars + 1), "android"))
+                            {
+                                options.format = CREATE_ANDROID_SPARSE;
+                            }
+                            else
+                            {
+                                fprintf(stderr, "create: unknown sparse format %s\n", *(ars + 1));
+                                return 1;
+                            }
+                            ars += 2;
+                            arc -= 2;
+                        }
+                        else
+                        {
+                            fprintf(stderr, "create: unknown flag %s\n", *ars);
+                            return 1;
+                        }
+
+                   }
+                   if(filename == NULL)
+                   {
+                       fprintf(stderr, "create: need to specify an  output filename\n");
+                       return 1;
+                   }
+                   parse_recipe(fd, &params);
+                   return create_image_at(AT_FDCWD, &params, &options, filename);
+               } 
+               else 
+               {
+                   fprintf(stderr, "create: insufficient parameters\n");
+                   close(fd);
+                   return 1;
+               }
+            } 
+            else 
+            {
+                /* TODO: create the image manually */
+            }
+        } 
+        else if(!strcmp(argv[1], "disassemble")) 
+        {
+            if(argc >= 3) 
+            {
+                if(!strcmp(argv[2], "help"))
+                {
+                    return usage_disassemble();
+                }
+
+                struct disassemble_options options = { 1, 0, NULL, NULL };
+                char                       **ars = argv + 2;
+                int                        arc = argc - 2;
+
+                while(arc > 1)
+                {
+                    if((!strcmp(*ars, "-j") || !strcmp(*ars, "--jobs")) && arc > 2)
+                    {
+                        options.threads = atoi(*(ars + 1));
+                        ars += 2;
+                        arc -= 2;
+                    }
+                    else if(!strcmp(*ars, "--decompress"))
+                    {
+                        options.decompress = 1;
+                        ars++;
+                        arc--;
+                    }
+                    else if(!strcmp(*ars, "--unpack") && arc > 2)
+                    {
+                        options.unpack_dir = *(ars + 1);
+                        ars += 2;
+                        arc -= 2;
+                    }
+                    else if(!strcmp(*ars, "--store") && arc > 2)
+                    {
+                        options.store_dir = *(ars + 1);
+                        ars += 2;
+                        arc -= 2;
+                    }
+                    else
+                    {
+                        fprintf(stderr, "disassemble: unknown flag %s\n", *ars);
+                        return 1;
+                    }
+                }
+
+                if(arc != 1 || options.threads == 0)
+                {
+                    return usage_disassemble();
+                }
+                return disassemble_image(*ars, AT_FDCWD, &options);
+            } 
+            else 
+            {
+                return usage_disassemble();
+            }
+        } 
+        else if(!strcmp(argv[1], "edit"))
+        {
+            struct header_edit edits[32];
+            size_t             count = 0;
+            enum id_hash       hash;
+            enum id_hash       *hash_override = NULL;
+            char               **ars = argv + 3;
+            int                arc = argc - 3;
+
+            if(argc < 4 || !strcmp(argv[2], "help"))
+            {
+                return usage_edit();
+            }
+
+            while(arc > 0)
+            {
+                if(arc < 2)
+                {
+                    fprintf(stderr, "edit: %s needs a value\n", *ars);
+                    return 1;
+                }
+
+                if(!strcmp(*ars, "--hash"))
+                {
+                    if(id_hash_from_name(*(ars + 1), &hash) < 0)
+                    {
+                        fprintf(stderr, "edit: unknown hash %s\n", *(ars + 1));
+                        return 1;
+                    }
+                    hash_override = &hash;
+                }
+                else if(count < sizeof(edits) / sizeof(edits[0]) &&
+                        edit_field_from_flag(*ars, &edits[count].field) > 0)
+                {
+                    edits[count++].value = *(ars + 1);
+                }
+                else
+                {
+                    fprintf(stderr, "edit: unknown flag %s\n", *ars);
+                    return 1;
+                }
+                ars += 2;
+                arc -= 2;
+            }
+            return edit_image(argv[2], edits, count, hash_override);
+        }
+        else if(!strcmp(argv[1], "avb"))
+        {
+            unsigned int threads = thread_pool_default_size();
+            char         **ars = argv + 2;
+            int          arc = argc - 2;
+
+            while(arc > 1)
+            {
+                if(!strcmp(*ars, "-j") || !strcmp(*ars, "--jobs"))
+                {
+                    threads = atoi(*(ars + 1));
+                    ars += 2;
+                    arc -= 2;
+                }
+                else
+                {
+                    fprintf(stderr, "avb: unknown flag %s\n", *ars);
+                    return 1;
+                }
+            }
+
+            if(arc != 1 || !strcmp(*ars, "help") || threads == 0)
+            {
+                return usage_avb();
+            }
+            return avb_image(*ars, threads, stdout);
+        }
+        else if(!strcmp(argv[1], "diff"))
+        {
+            unsigned int threads = thread_pool_default_size();
+            char         **ars = argv + 2;
+            int          arc = argc - 2;
+
+            while(arc > 3)
+            {
+                if(!strcmp(*ars, "-j") || !strcmp(*ars, "--jobs"))
+                {
+                    threads = atoi(*(ars + 1));
+                    ars += 2;
+                    arc -= 2;
+                }
+                else
+                {
+                    fprintf(stderr, "diff: unknown flag %s\n", *ars);
+                    return 1;
+                }
+            }
+
+            if(arc != 3 || !strcmp(*ars, "help") || threads == 0)
+            {
+                return usage_diff();
+            }
+            return diff_images(ars[0], ars[1], ars[2], threads);
+        }
+        else if(!strcmp(argv[1], "patch"))
+        {
+            unsigned int threads = thread_pool_default_size();
+            char         **ars = argv + 2;
+            int          arc = argc - 2;
+
+            while(arc > 3)
+            {
+                if(!strcmp(*ars, "-j") || !strcmp(*ars, "--jobs"))
+                {
+                    threads = atoi(*(ars + 1));
+                    ars += 2;
+                    arc -= 2;
+                }
+                else
+                {
+                    fprintf(stderr, "patch: unknown flag %s\n", *ars);
+                    return 1;
+                }
+            }
+
+            if(arc != 3 || !strcmp(*ars, "help") || threads == 0)
+            {
+                return usage_patch();
+            }
+            return patch_image(ars[0], ars[1], ars[2], threads);
+        }
+#ifndef WIN32
+        else if(!strcmp(argv[1], "batch"))
+        {
+            unsigned int threads = thread_pool_default_size();
+            char         **ars = argv + 2;
+            int          arc = argc - 2;
+
+            while(arc > 1)
+            {
+                if(!strcmp(*ars, "-j") || !strcmp(*ars, "--jobs"))
+                {
+                    threads = atoi(*(ars + 1));
+                    ars += 2;
+                    arc -= 2;
+                }
+                else
+                {
+                    fprintf(stderr, "batch: unknown flag %s\n", *ars);
+                    return 1;
+                }
+            }
+
+            if(arc != 1 || !strcmp(*ars, "help") || threads == 0)
+            {
+                return usage_batch();
+            }
+            return run_batch(*ars, threads);
+        }
+        else if(!strcmp(argv[1], "serve"))
+        {
+            unsigned int threads = thread_pool_default_size();
+            char         **ars = argv + 2;
+            int          arc = argc - 2;
+
+            while(arc > 1)
+            {
+                if(!strcmp(*ars, "-j") || !strcmp(*ars, "--jobs"))
+                {
+                    threads = atoi(*(ars + 1));
+                    ars += 2;
+                    arc -= 2;
+                }
+                else
+                {
+                    fprintf(stderr, "serve: unknown flag %s\n", *ars);
+                    return 1;
+                }
+            }
+
+            if(arc != 1 || !strcmp(*ars, "help") || threads == 0)
+            {
+                return usage_serve();
+            }
+            return run_server(*ars, threads);
+        }
+        else if(!strcmp(argv[1], "verify"))
+        {
+            unsigned int threads = thread_pool_default_size();
+            char         **ars = argv + 2;
+            int          arc = argc - 2;
+
+            while(arc > 1 && (*ars)[0] == '-')
+            {
+                if(!strcmp(*ars, "-j") || !strcmp(*ars, "--jobs"))
+                {
+                    threads = atoi(*(ars + 1));
+                    ars += 2;
+                    arc -= 2;
+                }
+                else
+                {
+                    fprintf(stderr, "verify: unknown flag %s\n", *ars);
+                    return 1;
+                }
+            }
+
+            if(arc == 0 || !strcmp(*ars, "help") || threads == 0)
+            {
+                return usage_verify();
+            }
+            return verify_images(ars, arc, threads);
+        }
+#endif
+        else 
+        {
+            fprintf(stderr, "Unknown operation: %s\n", argv[1]);
+            return usage();
+        }
+    } 
+    else 
+    {
+        return usage();
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int status = 0;
+
+    while(argc >= 2 && !strncmp(argv[1], "--", 2))
+    {
+        enum io_backend backend;
+
+        if(!strcmp(argv[1], "--stats"))
+        {
+            stats_enable(STATS_TEXT);
+        }
+        else if(!strcmp(argv[1], "--stats=json"))
+        {
+            stats_enable(STATS_JSON);
+        }
+        else if(!strncmp(argv[1], "--io=", 5) && io_backend_from_name(argv[1] + 5, &backend) > 0)
+        {
+            io_set_backend(backend);
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option: %s\n", argv[1]);
+            return usage();
+        }
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
+    status = run_command(argc, argv);
+
+    if(argc >= 2)
+    {
+        stats_report(stderr, argv[1]);
+    }
+    return status;
+}
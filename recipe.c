@@ -0,0 +1,307 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "file_io.h"
+#include "recipe.h"
+#include "stats.h"
+
+#ifdef WIN32
+#include "win32.h"
+#endif
+
+/* Where a key's value goes: a bootimg_params field, or one of the current fragment */
+struct recipe_key {
+    char   key[4];
+    int    string;      /* NUL terminated, at most size bytes with the NUL */
+    int    fragment;
+    size_t offset;
+    size_t size;
+};
+
+#define PARAM_SIZE(field)    sizeof(((struct bootimg_params *) 0)->field)
+#define FRAGMENT_SIZE(field) sizeof(((struct vendor_ramdisk_fragment *) 0)->field)
+
+#define PARAM_VALUE(key, field)     { key, 0, 0, offsetof(struct bootimg_params, field), PARAM_SIZE(field) }
+#define PARAM_STRING(key, field)    { key, 1, 0, offsetof(struct bootimg_params, field), PARAM_SIZE(field) }
+#define FRAGMENT_VALUE(key, field)  { key, 0, 1, offsetof(struct vendor_ramdisk_fragment, field), FRAGMENT_SIZE(field) }
+#define FRAGMENT_STRING(key, field) { key, 1, 1, offsetof(struct vendor_ramdisk_fragment, field), FRAGMENT_SIZE(field) }
+
+static const struct recipe_key keys[RTYPE_RESERVED] = {
+    [RTYPE_KNN] = PARAM_STRING("knn", kernel_filename),
+    [RTYPE_KNA] = PARAM_VALUE("kna", kernel_addr),
+    [RTYPE_RDN] = PARAM_STRING("rdn", ramdisk_filename),
+    [RTYPE_RDA] = PARAM_VALUE("rda", ramdisk_addr),
+    [RTYPE_SEN] = PARAM_STRING("sen", second_filename),
+    [RTYPE_SEA] = PARAM_VALUE("sea", second_addr),
+    [RTYPE_TAA] = PARAM_VALUE("taa", tags_addr),
+    [RTYPE_PAS] = PARAM_VALUE("pas", page_size),
+    [RTYPE_HEV] = PARAM_VALUE("hev", header_version),
+    [RTYPE_OSV] = PARAM_VALUE("osv", os_version),
+    [RTYPE_PNA] = PARAM_STRING("pna", product_name),
+    /* Version 3 and later have one command line that runs on into extra_cmdline and beyond */
+    [RTYPE_CMD] = { "cmd", 1, 0, offsetof(struct bootimg_params, cmdline),
+                    PARAM_SIZE(cmdline) + PARAM_SIZE(extra_cmdline) + PARAM_SIZE(vendor_cmdline) },
+    [RTYPE_IDV] = PARAM_VALUE("idv", id),
+    [RTYPE_ECM] = PARAM_STRING("ecm", extra_cmdline),
+    [RTYPE_REO] = PARAM_VALUE("reo", recovery_dtbo_offset),
+    [RTYPE_DTA] = PARAM_VALUE("dta", dtb_addr),
+    [RTYPE_DTN] = PARAM_STRING("dtn", dtb_filename),
+    [RTYPE_SGN] = PARAM_STRING("sgn", signature_filename),
+    [RTYPE_MAG] = PARAM_STRING("mag", magic),
+    [RTYPE_BCN] = PARAM_STRING("bcn", bootconfig_filename),
+    [RTYPE_VRN] = FRAGMENT_STRING("vrn", filename),
+    [RTYPE_VRT] = FRAGMENT_VALUE("vrt", type),
+    [RTYPE_VRM] = FRAGMENT_STRING("vrm", name),
+    [RTYPE_VRB] = FRAGMENT_VALUE("vrb", board_id),
+    [RTYPE_KNH] = PARAM_VALUE("knh", digests[SECTION_KERNEL]),
+    [RTYPE_RDH] = PARAM_VALUE("rdh", digests[SECTION_RAMDISK]),
+    [RTYPE_SEH] = PARAM_VALUE("seh", digests[SECTION_SECOND]),
+    [RTYPE_DTH] = PARAM_VALUE("dth", digests[SECTION_DTB]),
+    [RTYPE_SGH] = PARAM_VALUE("sgh", digests[SECTION_SIGNATURE]),
+    [RTYPE_BCH] = PARAM_VALUE("bch", digests[SECTION_BOOTCONFIG]),
+    [RTYPE_VRH] = FRAGMENT_VALUE("vrh", digest),
+};
+
+static const struct recipe_key *find_key(const uint8_t *key)
+{
+    for(size_t i = 0; i < RTYPE_RESERVED; i++) {
+        if(!memcmp(keys[i].key, key, 3)) {
+            return &keys[i];
+        }
+    }
+    return NULL;
+}
+
+void recipe_init(struct recipe *recipe)
+{
+    memset(&recipe->header, 0, sizeof(struct recipe_header));
+    memcpy(recipe->header.magic, RECIPE_MAGIC, RECIPE_MAGIC_SIZE);
+    recipe->header.version = RECIPE_VERSION;
+    recipe->overflow = 0;
+}
+
+/*
+ * Appends a field to the recipe. Strings that would not fit the params
+ * field create reads them into are refused, as are fields past the
+ * recipe's capacity; either marks the recipe so recipe_write() fails.
+ */
+int recipe_add(struct recipe *recipe, enum rtypes type, const void *value)
+{
+    const struct recipe_key *key = &keys[type];
+    struct recipe_header    *header = &recipe->header;
+    struct recipe_field     *field = &recipe->fields[header->field_count];
+    size_t                  size = key->string ? strnlen(value, key->size) + 1 : key->size;
+
+    if(size > key->size || header->field_count == RECIPE_MAX_FIELDS ||
+       size > RECIPE_DATA_SIZE - header->data_size) {
+        recipe->overflow = 1;
+        return -1;
+    }
+
+    memcpy(field->key, key->key, sizeof(field->key));
+    field->offset = header->data_size;
+    field->size = size;
+    memcpy(recipe->data + header->data_size, value, size);
+
+    header->field_count++;
+    header->data_size += size;
+    return 0;
+}
+
+/*
+ * Appends a value field whose value is not known yet and returns where
+ * it goes in the recipe, zeroed, or NULL if it does not fit. The value
+ * has to be filled in before the recipe is written.
+ */
+void *recipe_reserve(struct recipe *recipe, enum rtypes type)
+{
+    static const uint8_t zeros[64];
+    size_t               offset = recipe->header.data_size;
+
+    if(keys[type].string || keys[type].size > sizeof(zeros) || recipe_add(recipe, type, zeros) < 0) {
+        return NULL;
+    }
+    return recipe->data + offset;
+}
+
+/* Writes the header, the field table and the values with a single writev() */
+int recipe_write(const struct recipe *recipe, int fd)
+{
+    struct iovec       iov[3];
+    size_t             total = 0;
+    ssize_t            written = 0;
+    struct stats_timer timer;
+
+    if(recipe->overflow) {
+        return -1;
+    }
+
+    iov[0].iov_base = (void *) &recipe->header;
+    iov[0].iov_len = sizeof(struct recipe_header);
+    iov[1].iov_base = (void *) recipe->fields;
+    iov[1].iov_len = recipe->header.field_count * sizeof(struct recipe_field);
+    iov[2].iov_base = (void *) recipe->data;
+    iov[2].iov_len = recipe->header.data_size;
+    total = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+
+    stats_begin(&timer);
+    written = io_writev(fd, iov, 3);
+    stats_end(&timer, STATS_RECIPE);
+    return written == (ssize_t) total ? 0 : -1;
+}
+
+/*
+ * Stores one value in params. A fragment's file starts a new fragment
+ * that the fields after it describe. Strings longer than their field
+ * and values of the wrong size are refused.
+ */
+static int set_field(struct bootimg_params *params, const struct recipe_key *key,
+                     struct vendor_ramdisk_fragment **fragment, const uint8_t *value, size_t size)
+{
+    uint8_t *field = NULL;
+
+    if(key == &keys[RTYPE_VRN]) {
+        if(params->fragment_count == VENDOR_RAMDISK_MAX) {
+            return -1;
+        }
+        *fragment = &params->fragments[params->fragment_count++];
+        memset(*fragment, 0, sizeof(struct vendor_ramdisk_fragment));
+    } else if(key->fragment && *fragment == NULL) {
+        return -1;
+    }
+
+    field = (key->fragment ? (uint8_t *) *fragment : (uint8_t *) params) + key->offset;
+
+    if(key->string) {
+        if(size > key->size) {
+            return -1;
+        }
+        memset(field, 0, key->size);
+        memcpy(field, value, size);
+        field[key->size - 1] = 0;
+    } else {
+        if(size != key->size) {
+            return -1;
+        }
+        memcpy(field, value, size);
+    }
+    return 0;
+}
+
+/* A version 1 recipe: records of a key and a value, strings prefixed with their length */
+static int parse_recipe_v1(const uint8_t *data, size_t size, struct bootimg_params *params)
+{
+    struct vendor_ramdisk_fragment *fragment = NULL;
+    size_t pos = 0;
+    int    status = 0;
+
+    while(status == 0 && size - pos >= 3) {
+        const struct recipe_key *key = find_key(data + pos);
+        uint32_t                len = 0;
+
+        /* Records carry no length of their own, so nothing after an unknown key can be trusted */
+        if(key == NULL) {
+            return -1;
+        }
+        pos += 3;
+
+        if(key->string) {
+            if(size - pos < sizeof(uint32_t)) {
+                return -1;
+            }
+            memcpy(&len, data + pos, sizeof(uint32_t));
+            pos += sizeof(uint32_t);
+        } else {
+            len = key->size;
+        }
+
+        if(size - pos < len) {
+            return -1;
+        }
+        status = set_field(params, key, &fragment, data + pos, len);
+        pos += len;
+    }
+    return status;
+}
+
+static int parse_recipe_v2(const uint8_t *data, size_t size, struct bootimg_params *params)
+{
+    struct vendor_ramdisk_fragment *fragment = NULL;
+    struct recipe_header           header;
+    const uint8_t                  *values = NULL;
+    uint64_t                       table_size = 0;
+
+    memcpy(&header, data, sizeof(struct recipe_header));
+    table_size = (uint64_t) header.field_count * sizeof(struct recipe_field);
+
+    if(header.version != RECIPE_VERSION || table_size > size - sizeof(struct recipe_header) ||
+       header.data_size > size - sizeof(struct recipe_header) - table_size) {
+        return -1;
+    }
+    values = data + sizeof(struct recipe_header) + table_size;
+
+    for(uint32_t i = 0; i < header.field_count; i++) {
+        const struct recipe_key *key = NULL;
+        struct recipe_field     field;
+
+        memcpy(&field, data + sizeof(struct recipe_header) + i * sizeof(struct recipe_field),
+               sizeof(struct recipe_field));
+        if(field.offset > header.data_size || field.size > header.data_size - field.offset) {
+            return -1;
+        }
+
+        /* Fields from a newer writer are skipped; the table says where the next one is */
+        if((key = find_key(field.key)) == NULL) {
+            continue;
+        }
+
+        if(set_field(params, key, &fragment, values + field.offset, field.size) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Parses a recipe of either version from memory into params */
+int parse_recipe_buffer(const uint8_t *data, size_t size, struct bootimg_params *params)
+{
+    if(size >= sizeof(struct recipe_header) && !memcmp(data, RECIPE_MAGIC, RECIPE_MAGIC_SIZE)) {
+        return parse_recipe_v2(data, size, params);
+    }
+    return parse_recipe_v1(data, size, params);
+}
+
+int parse_recipe(int fd, struct bootimg_params *params)
+{
+    uint8_t     *data = NULL;
+    size_t      size = 0;
+    ssize_t     bytes_read = 0;
+    struct stat st;
+    struct stats_timer timer;
+    int         status = -1;
+
+    stats_begin(&timer);
+    if(io_fstat(fd, &st) < 0) {
+        goto out;
+    }
+
+    /* Recipes are a few kilobytes at most; read the whole thing and parse it in memory */
+    data = stats_malloc(st.st_size > 0 ? st.st_size : 1);
+    if(data == NULL) {
+        goto out;
+    }
+
+    while(size < (size_t) st.st_size &&
+          (bytes_read = io_read(fd, data + size, st.st_size - size)) > 0) {
+        size += bytes_read;
+    }
+    status = parse_recipe_buffer(data, size, params);
+
+out:
+    free(data);
+    io_close(fd);
+    stats_end(&timer, STATS_RECIPE);
+    return status;
+}
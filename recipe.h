@@ -0,0 +1,90 @@
+#ifndef RECIPE_H
+#define RECIPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "create_image.h"
+
+/*
+ * recipe.cfg: what disassemble saw and create needs to rebuild an image.
+ *
+ * Version 2 is a header, a table with the key, offset and size of every
+ * field, and the field values, all in host byte order. It is written
+ * with one writev() and parsed in place from a single read; fields whose
+ * key a reader does not know are skipped, so new ones can be added
+ * without breaking older readers. Version 1 files, which have no header
+ * and are a run of key and value records, are still read.
+ */
+#define RECIPE_MAGIC      "RCPE"
+#define RECIPE_MAGIC_SIZE 4
+#define RECIPE_VERSION    2
+
+/* Enough for every field of a vendor_boot v4 image with the most fragments */
+#define RECIPE_MAX_FIELDS 128
+#define RECIPE_DATA_SIZE  8192
+
+enum rtypes {
+    RTYPE_KNN,        /* "knn" - kernel name */
+    RTYPE_KNA,        /* "kna" - kernel address */
+    RTYPE_RDN,        /* "rdn" - ramdisk name */
+    RTYPE_RDA,        /* "rda" - ramdisk address */
+    RTYPE_SEN,        /* "sen" - second filename */
+    RTYPE_SEA,        /* "sea" - second address */
+    RTYPE_TAA,        /* "taa" - tags address */
+    RTYPE_PAS,        /* "pas" - page size */
+    RTYPE_HEV,        /* "hev" - header version */
+    RTYPE_OSV,        /* "osv" - os version */
+    RTYPE_PNA,        /* "pna" - product name */
+    RTYPE_CMD,        /* "cmd" - cmdline */
+    RTYPE_IDV,        /* "idv" - id */
+    RTYPE_ECM,        /* "ecm" - extra cmdline */
+    RTYPE_REO,        /* "reo" - recovery dtbo image offset */
+    RTYPE_DTA,        /* "dta" - DTB addr */
+    RTYPE_DTN,        /* "dtn" - DTB filename */
+    RTYPE_SGN,        /* "sgn" - boot signature filename */
+    RTYPE_MAG,        /* "mag" - image magic, if not a boot image */
+    RTYPE_BCN,        /* "bcn" - bootconfig filename */
+    RTYPE_VRN,        /* "vrn" - vendor ramdisk fragment filename, starts a fragment */
+    RTYPE_VRT,        /* "vrt" - fragment type */
+    RTYPE_VRM,        /* "vrm" - fragment name */
+    RTYPE_VRB,        /* "vrb" - fragment board id */
+    RTYPE_KNH,        /* "knh" - kernel SHA-256, for the section store */
+    RTYPE_RDH,        /* "rdh" - ramdisk SHA-256 */
+    RTYPE_SEH,        /* "seh" - second SHA-256 */
+    RTYPE_DTH,        /* "dth" - DTB SHA-256 */
+    RTYPE_SGH,        /* "sgh" - boot signature SHA-256 */
+    RTYPE_BCH,        /* "bch" - bootconfig SHA-256 */
+    RTYPE_VRH,        /* "vrh" - fragment SHA-256 */
+    RTYPE_RESERVED
+};
+
+struct recipe_header {
+    uint8_t  magic[RECIPE_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t field_count;
+    uint32_t data_size;     /* bytes of values after the field table */
+};
+
+struct recipe_field {
+    uint8_t  key[4];        /* three letters and a NUL */
+    uint32_t offset;        /* of the value, from the end of the table */
+    uint32_t size;
+};
+
+/* A version 2 recipe being put together in memory */
+struct recipe {
+    struct recipe_header header;
+    struct recipe_field  fields[RECIPE_MAX_FIELDS];
+    uint8_t              data[RECIPE_DATA_SIZE];
+    int                  overflow;      /* a field did not fit */
+};
+
+void  recipe_init(struct recipe *recipe);
+int   recipe_add(struct recipe *recipe, enum rtypes type, const void *value);
+void *recipe_reserve(struct recipe *recipe, enum rtypes type);
+int   recipe_write(const struct recipe *recipe, int fd);
+int   parse_recipe(int fd, struct bootimg_params *params);
+int   parse_recipe_buffer(const uint8_t *data, size_t size, struct bootimg_params *params);
+
+#endif
@@ -0,0 +1,200 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file_io.h"
+#include "repack_cache.h"
+
+#ifdef WIN32
+#include "win32.h"
+
+/* Without stable inode numbers a file's identity cannot be trusted, so there is no cache */
+int repack_cache_open(struct repack_cache *cache, const char *path, enum id_hash type)
+{
+    memset(cache, 0, sizeof(struct repack_cache));
+    cache->dir_fd = -1;
+    cache->type = type;
+    return -1;
+}
+
+size_t repack_cache_lookup(struct repack_cache *cache, const int fds[], size_t count)
+{
+    return 0;
+}
+
+int repack_cache_store(const struct repack_cache *cache)
+{
+    return -1;
+}
+
+void repack_cache_close(struct repack_cache *cache)
+{
+}
+#else
+
+#define CACHE_MAGIC      "BIRCACHE"
+#define CACHE_MAGIC_SIZE 8
+
+/* On-disk entry: this header, then count keys and count states */
+struct cache_entry_header {
+    uint8_t  magic[CACHE_MAGIC_SIZE];
+    uint32_t type;
+    uint32_t count;
+    uint32_t key_size;
+    uint32_t state_size;
+};
+
+struct cache_entry {
+    struct cache_entry_header header;
+    struct cache_key          keys[SECTION_COUNT];
+    struct image_id_state     states[SECTION_COUNT];
+};
+
+static int key_from_fd(int fd, struct cache_key *key)
+{
+    struct stat st;
+
+    if(io_fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+
+    memset(key, 0, sizeof(struct cache_key));
+    key->dev = st.st_dev;
+    key->ino = st.st_ino;
+    key->size = st.st_size;
+    key->mtime_sec = st.st_mtim.tv_sec;
+    key->mtime_nsec = st.st_mtim.tv_nsec;
+    key->ctime_sec = st.st_ctim.tv_sec;
+    key->ctime_nsec = st.st_ctim.tv_nsec;
+    return 0;
+}
+
+/* Entries are named after the hash and the first section's file */
+static void entry_name(const struct repack_cache *cache, char *name, size_t size)
+{
+    snprintf(name, size, "%s-%llx-%llx", id_hash_name(cache->type),
+             (unsigned long long) cache->keys[0].dev, (unsigned long long) cache->keys[0].ino);
+}
+
+int repack_cache_open(struct repack_cache *cache, const char *path, enum id_hash type)
+{
+    memset(cache, 0, sizeof(struct repack_cache));
+    cache->type = type;
+
+    if(mkdir(path, 0755) < 0 && errno != EEXIST) {
+        cache->dir_fd = -1;
+        return -1;
+    }
+
+    cache->dir_fd = io_open(path, O_RDONLY | O_DIRECTORY, 0);
+    return cache->dir_fd < 0 ? -1 : 0;
+}
+
+/*
+ * Identifies the files of the hashed sections, in id order, and loads
+ * the hash states saved for them. Returns how many leading sections are
+ * unchanged since, which is 0 if there is no usable entry.
+ */
+size_t repack_cache_lookup(struct repack_cache *cache, const int fds[], size_t count)
+{
+    struct cache_entry entry;
+    char               name[64];
+    ssize_t            bytes_read = 0;
+    size_t             hit = 0;
+    int                fd = -1;
+
+    cache->count = 0;
+    for(size_t i = 0; i < count && i < SECTION_COUNT; i++) {
+        if(key_from_fd(fds[i], &cache->keys[i]) < 0) {
+            break;
+        }
+        cache->count++;
+    }
+
+    if(cache->count == 0) {
+        return 0;
+    }
+
+    entry_name(cache, name, sizeof(name));
+    fd = io_openat(cache->dir_fd, name, O_RDONLY, 0);
+    if(fd < 0) {
+        return 0;
+    }
+    bytes_read = io_pread(fd, &entry, sizeof(entry), 0);
+    io_close(fd);
+
+    if(bytes_read < (ssize_t) sizeof(struct cache_entry_header) ||
+       memcmp(entry.header.magic, CACHE_MAGIC, CACHE_MAGIC_SIZE) != 0 ||
+       entry.header.type != cache->type || entry.header.count > SECTION_COUNT ||
+       entry.header.key_size != sizeof(struct cache_key) ||
+       entry.header.state_size != sizeof(struct image_id_state) ||
+       bytes_read != (ssize_t) sizeof(entry)) {
+        return 0;
+    }
+
+    while(hit < entry.header.count && hit < cache->count &&
+          memcmp(&entry.keys[hit], &cache->keys[hit], sizeof(struct cache_key)) == 0) {
+        cache->states[hit] = entry.states[hit];
+        hit++;
+    }
+    return hit;
+}
+
+/*
+ * Saves keys and states for all sections looked up. The entry is
+ * written under a temporary name and renamed into place, so concurrent
+ * builds never see half of one.
+ */
+int repack_cache_store(const struct repack_cache *cache)
+{
+    struct cache_entry entry;
+    char               name[64];
+    char               temp[96];
+    static unsigned long sequence;
+    int                fd = -1;
+    int                ret = -1;
+
+    if(cache->dir_fd < 0 || cache->count == 0) {
+        return -1;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.header.magic, CACHE_MAGIC, CACHE_MAGIC_SIZE);
+    entry.header.type = cache->type;
+    entry.header.count = cache->count;
+    entry.header.key_size = sizeof(struct cache_key);
+    entry.header.state_size = sizeof(struct image_id_state);
+    memcpy(entry.keys, cache->keys, sizeof(struct cache_key) * cache->count);
+    memcpy(entry.states, cache->states, sizeof(struct image_id_state) * cache->count);
+
+    entry_name(cache, name, sizeof(name));
+    snprintf(temp, sizeof(temp), "%s.%ld.%lu", name, (long) getpid(),
+             __atomic_fetch_add(&sequence, 1, __ATOMIC_RELAXED));
+
+    fd = io_openat(cache->dir_fd, temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        return -1;
+    }
+
+    if(io_pwrite_all(fd, &entry, sizeof(entry), 0) == 0) {
+        ret = renameat(cache->dir_fd, temp, cache->dir_fd, name);
+    }
+    io_close(fd);
+
+    if(ret < 0) {
+        unlinkat(cache->dir_fd, temp, 0);
+    }
+    return ret < 0 ? -1 : 0;
+}
+
+void repack_cache_close(struct repack_cache *cache)
+{
+    if(cache->dir_fd >= 0) {
+        io_close(cache->dir_fd);
+    }
+    cache->dir_fd = -1;
+}
+#endif
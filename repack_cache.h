@@ -0,0 +1,42 @@
+#ifndef REPACK_CACHE_H
+#define REPACK_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image_id.h"
+#include "layout.h"
+
+/*
+ * The id hashes the kernel, ramdisk and second stage in that order, so
+ * the hash state after any leading run of them depends on those files
+ * alone. The repack cache keeps that state after every section of a
+ * build, keyed by the files' identity, and a later build of the same
+ * files resumes the hash instead of reading them again.
+ */
+
+/* A payload file as it was when its hash state was saved */
+struct cache_key {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t  mtime_sec;
+    int64_t  mtime_nsec;
+    int64_t  ctime_sec;
+    int64_t  ctime_nsec;
+};
+
+struct repack_cache {
+    int                   dir_fd;
+    enum id_hash          type;
+    size_t                count;                    /* sections in keys and states */
+    struct cache_key      keys[SECTION_COUNT];
+    struct image_id_state states[SECTION_COUNT];    /* the id after each section */
+};
+
+int    repack_cache_open(struct repack_cache *cache, const char *path, enum id_hash type);
+size_t repack_cache_lookup(struct repack_cache *cache, const int fds[], size_t count);
+int    repack_cache_store(const struct repack_cache *cache);
+void   repack_cache_close(struct repack_cache *cache);
+
+#endif
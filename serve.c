@@ -0,0 +1,250 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "batch.h"
+#include "bootimgtool.h"
+#include "file_io.h"
+#include "serve.h"
+#include "thread_pool.h"
+
+/* Longest request line, enough for two paths */
+#define REQUEST_SIZE 8192
+
+struct server {
+    int listen_fd;
+};
+
+/* One worker's buffers, kept across the connections and requests it serves */
+struct worker {
+    char         request[REQUEST_SIZE];
+    size_t       used;
+    struct arena arena;
+};
+
+static const char *socket_path;
+
+static void stop_server(int signum)
+{
+    (void) signum;
+    unlink(socket_path);
+    _exit(0);
+}
+
+static int write_all(int fd, const void *data, size_t size)
+{
+    const char *p = data;
+
+    while(size > 0) {
+        ssize_t ret = write(fd, p, size);
+
+        if(ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if(ret <= 0) {
+            return -1;
+        }
+        p += ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+/* Sends "<status> <length>\n" and then length bytes of output */
+static int send_response(int fd, int status, const char *text, size_t size)
+{
+    char head[64];
+    int  length = snprintf(head, sizeof(head), "%d %zu\n", status, size);
+
+    return write_all(fd, head, length) < 0 || write_all(fd, text, size) < 0 ? -1 : 0;
+}
+
+static int handle_request(struct worker *worker, int fd, char *line, unsigned int lineno)
+{
+    struct batch_job job;
+    char             *text = NULL;
+    size_t           size = 0;
+    FILE             *out = open_memstream(&text, &size);
+    int              ret = 0;
+
+    if(out == NULL) {
+        return -1;
+    }
+
+    /* The answer says why a request failed, instead of the server's terminal */
+    set_error_stream(out);
+    if((ret = parse_batch_line(line, lineno, &job)) > 0) {
+        job.status = run_batch_job(&job, &worker->arena, out);
+        arena_reset(&worker->arena);
+    }
+    set_error_stream(NULL);
+    fclose(out);
+
+    ret = ret == 0 ? 0 : send_response(fd, ret < 0 ? 1 : job.status, text, size);
+    free(text);
+    return ret;
+}
+
+/* Answers requests on one connection, one per line, until the client hangs up */
+static void serve_connection(struct worker *worker, int fd)
+{
+    unsigned int lineno = 0;
+
+    worker->used = 0;
+
+    for(;;) {
+        ssize_t ret = read(fd, worker->request + worker->used, REQUEST_SIZE - worker->used);
+        char    *line = worker->request;
+        char    *end = NULL;
+
+        if(ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if(ret <= 0) {
+            return;
+        }
+        worker->used += ret;
+
+        while((end = memchr(line, '\n', worker->request + worker->used - line)) != NULL) {
+            *end = '\0';
+            if(handle_request(worker, fd, line, ++lineno) < 0) {
+                return;
+            }
+            line = end + 1;
+        }
+
+        worker->used -= line - worker->request;
+        memmove(worker->request, line, worker->used);
+
+        if(worker->used == REQUEST_SIZE) {
+            static const char too_long[] = "request too long\n";
+
+            send_response(fd, 1, too_long, sizeof(too_long) - 1);
+            return;
+        }
+    }
+}
+
+static void run_worker(size_t index, void *arg)
+{
+    struct server *server = arg;
+    struct worker *worker = malloc(sizeof(struct worker));
+
+    (void) index;
+
+    if(worker == NULL) {
+        return;
+    }
+    arena_init(&worker->arena);
+
+    for(;;) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+
+        if(fd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        serve_connection(worker, fd);
+        io_close(fd);
+    }
+
+    arena_destroy(&worker->arena);
+    free(worker);
+}
+
+/*
+ * Removes a socket left at path by a server that was killed. Anything
+ * else there, a socket a server still listens on included, is kept and
+ * fails the start.
+ */
+static int remove_stale_socket(const char *path, const struct sockaddr_un *addr)
+{
+    struct stat st;
+    int         fd = -1;
+    int         live = 0;
+
+    if(lstat(path, &st) < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    if(!S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "serve: %s exists and is not a socket\n", path);
+        return -1;
+    }
+
+    if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        return -1;
+    }
+    live = connect(fd, (const struct sockaddr *) addr, sizeof(struct sockaddr_un)) == 0;
+    io_close(fd);
+
+    if(live) {
+        fprintf(stderr, "serve: a server is already listening on %s\n", path);
+        return -1;
+    }
+    return unlink(path);
+}
+
+/*
+ * The serve command: listens on the Unix socket at path and runs the
+ * requests clients send on threads workers that stay up between them,
+ * so a build farm pays for process startup, library initialisation and
+ * cold caches once instead of per image. A request is a line in the
+ * batch manifest format; the answer is a line with the exit status and
+ * the length of what the command printed, followed by that output and
+ * any errors it reported.
+ * Runs until interrupted; returns 1 if the socket cannot be set up.
+ */
+int run_server(const char *path, unsigned int threads)
+{
+    struct server      server;
+    struct sockaddr_un addr;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "serve: socket path %s is too long\n", path);
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if(remove_stale_socket(path, &addr) < 0) {
+        return 1;
+    }
+
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(server.listen_fd < 0) {
+        fprintf(stderr, "serve: could not create a socket\n");
+        return 1;
+    }
+
+    /* Requests name any path the server can write, so only its owner may connect */
+    if(bind(server.listen_fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_un)) < 0 ||
+       chmod(path, 0600) < 0 || listen(server.listen_fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "serve: could not listen on %s: %s\n", path, strerror(errno));
+        io_close(server.listen_fd);
+        return 1;
+    }
+
+    socket_path = path;
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stop_server);
+    signal(SIGTERM, stop_server);
+
+    fprintf(stderr, "serve: listening on %s with %u workers\n", path, threads);
+    thread_pool_run(threads, threads, run_worker, &server);
+
+    io_close(server.listen_fd);
+    unlink(path);
+    return 1;
+}
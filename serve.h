@@ -0,0 +1,6 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+int run_server(const char *path, unsigned int threads);
+
+#endif
@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "file_io.h"
+#include "sparse_image.h"
+#include "stats.h"
+
+#ifdef WIN32
+#include "win32.h"
+#endif
+
+/* Blocks read and classified at a time */
+#define SPARSE_BATCH 256
+
+struct sparse_writer {
+    int      fd;
+    uint64_t offset;
+    uint32_t chunks;
+};
+
+static int emit(struct sparse_writer *w, const void *data, uint32_t size)
+{
+    if(io_pwrite_all(w->fd, data, size, w->offset) < 0) {
+        return -1;
+    }
+    w->offset += size;
+    return 0;
+}
+
+static int emit_chunk(struct sparse_writer *w, uint16_t type, uint32_t blocks, const void *data, uint32_t size)
+{
+    struct sparse_chunk_header chunk = { type, 0, blocks, sizeof(struct sparse_chunk_header) + size };
+
+    w->chunks++;
+    if(emit(w, &chunk, sizeof(chunk)) < 0) {
+        return -1;
+    }
+    return size > 0 ? emit(w, data, size) : 0;
+}
+
+/* Returns 1 if the block repeats a single 32-bit value, stored in *value */
+static int is_fill_block(const uint8_t *block, uint32_t *value)
+{
+    const uint32_t *words = (const uint32_t *) block;
+
+    for(size_t i = 1; i < SPARSE_BLOCK_SIZE / sizeof(uint32_t); i++) {
+        if(words[i] != words[0]) {
+            return 0;
+        }
+    }
+    *value = words[0];
+    return 1;
+}
+
+/*
+ * Converts the first size bytes of in_fd into an Android sparse image on
+ * out_fd. Blocks that repeat one 32-bit value (padding and holes among
+ * them) become fill chunks and everything else is stored raw, with runs
+ * of either kind merged into a single chunk. A trailing partial block is
+ * zero-filled, so the expanded image may be up to a block longer.
+ */
+int write_sparse_image(int in_fd, uint64_t size, int out_fd)
+{
+    struct sparse_header header = { SPARSE_HEADER_MAGIC, 1, 0, sizeof(struct sparse_header),
+                                    sizeof(struct sparse_chunk_header), SPARSE_BLOCK_SIZE, 0, 0, 0 };
+    struct sparse_writer w = { out_fd, sizeof(struct sparse_header), 0 };
+    uint8_t              *buffer = stats_malloc(SPARSE_BATCH * SPARSE_BLOCK_SIZE);
+    uint64_t             blocks = (size + SPARSE_BLOCK_SIZE - 1) / SPARSE_BLOCK_SIZE;
+    uint32_t             fill_value = 0;
+    uint32_t             fill_blocks = 0;
+    int                  ret = -1;
+    struct stats_timer   timer;
+
+    if(buffer == NULL || blocks > UINT32_MAX) {
+        free(buffer);
+        return -1;
+    }
+
+    stats_begin(&timer);
+    for(uint64_t block = 0; block < blocks;) {
+        uint32_t count = blocks - block > SPARSE_BATCH ? SPARSE_BATCH : blocks - block;
+        uint64_t offset = block * SPARSE_BLOCK_SIZE;
+        uint64_t want = size - offset < (uint64_t) count * SPARSE_BLOCK_SIZE ? size - offset
+                                                                             : (uint64_t) count * SPARSE_BLOCK_SIZE;
+        uint32_t raw_start = 0;
+        uint32_t raw_blocks = 0;
+
+        memset(buffer + want, 0, (size_t) count * SPARSE_BLOCK_SIZE - want);
+        if(io_pread(in_fd, buffer, want, offset) != (ssize_t) want) {
+            goto out;
+        }
+
+        for(uint32_t i = 0; i < count; i++) {
+            uint32_t value = 0;
+            int      fill = is_fill_block(buffer + (size_t) i * SPARSE_BLOCK_SIZE, &value);
+
+            if(fill_blocks > 0 && (!fill || value != fill_value)) {
+                if(emit_chunk(&w, CHUNK_TYPE_FILL, fill_blocks, &fill_value, sizeof(fill_value)) < 0) {
+                    goto out;
+                }
+                fill_blocks = 0;
+            }
+
+            if(fill) {
+                if(raw_blocks > 0) {
+                    if(emit_chunk(&w, CHUNK_TYPE_RAW, raw_blocks, buffer + (size_t) raw_start * SPARSE_BLOCK_SIZE,
+                                  raw_blocks * SPARSE_BLOCK_SIZE) < 0) {
+                        goto out;
+                    }
+                    raw_blocks = 0;
+                }
+                fill_value = value;
+                fill_blocks++;
+            } else {
+                if(raw_blocks == 0) {
+                    raw_start = i;
+                }
+                raw_blocks++;
+            }
+        }
+
+        /* Raw data lives in the buffer, so its run cannot carry over to the next batch */
+        if(raw_blocks > 0 && emit_chunk(&w, CHUNK_TYPE_RAW, raw_blocks,
+                                        buffer + (size_t) raw_start * SPARSE_BLOCK_SIZE,
+                                        raw_blocks * SPARSE_BLOCK_SIZE) < 0) {
+            goto out;
+        }
+        block += count;
+    }
+
+    if(fill_blocks > 0 && emit_chunk(&w, CHUNK_TYPE_FILL, fill_blocks, &fill_value, sizeof(fill_value)) < 0) {
+        goto out;
+    }
+
+    header.total_blks = blocks;
+    header.total_chunks = w.chunks;
+    if(io_pwrite_all(out_fd, &header, sizeof(header), 0) < 0) {
+        goto out;
+    }
+    ret = 0;
+
+out:
+    stats_end(&timer, STATS_WRITE);
+    free(buffer);
+    return ret;
+}
@@ -0,0 +1,35 @@
+#ifndef SPARSE_IMAGE_H
+#define SPARSE_IMAGE_H
+
+#include <stdint.h>
+
+/* Android sparse image format, as read by fastboot and simg2img */
+#define SPARSE_HEADER_MAGIC 0xed26ff3a
+#define SPARSE_BLOCK_SIZE   4096
+
+#define CHUNK_TYPE_RAW       0xcac1
+#define CHUNK_TYPE_FILL      0xcac2
+#define CHUNK_TYPE_DONT_CARE 0xcac3
+
+struct sparse_header {
+    uint32_t magic;
+    uint16_t major_version;
+    uint16_t minor_version;
+    uint16_t file_hdr_sz;
+    uint16_t chunk_hdr_sz;
+    uint32_t blk_sz;
+    uint32_t total_blks;
+    uint32_t total_chunks;
+    uint32_t image_checksum;
+} __attribute__((packed));
+
+struct sparse_chunk_header {
+    uint16_t chunk_type;
+    uint16_t reserved1;
+    uint32_t chunk_sz;      /* in blocks */
+    uint32_t total_sz;      /* in bytes, header included */
+} __attribute__((packed));
+
+int write_sparse_image(int in_fd, uint64_t size, int out_fd);
+
+#endif
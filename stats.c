@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+static const char *phase_names[STATS_PHASE_COUNT] = {
+    "open", "header", "recipe", "read", "hash", "write", "padding", "output", "compress", "decompress", "unpack"
+};
+
+struct stats {
+    enum stats_format format;
+    struct timespec   start_wall;
+    struct timespec   start_cpu;
+    uint64_t          wall_ns[STATS_PHASE_COUNT];
+    uint64_t          cpu_ns[STATS_PHASE_COUNT];
+    uint64_t          calls[STATS_PHASE_COUNT];
+    uint64_t          bytes_read;
+    uint64_t          bytes_written;
+    uint64_t          syscalls;
+    uint64_t          allocations;
+};
+
+static struct stats stats;
+
+static uint64_t elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return (uint64_t) (end->tv_sec - start->tv_sec) * 1000000000ull + end->tv_nsec - start->tv_nsec;
+}
+
+static void add(uint64_t *counter, uint64_t value)
+{
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+void stats_enable(enum stats_format format)
+{
+    memset(&stats, 0, sizeof(struct stats));
+    stats.format = format;
+    clock_gettime(CLOCK_MONOTONIC, &stats.start_wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &stats.start_cpu);
+}
+
+int stats_enabled(void)
+{
+    return stats.format != STATS_NONE;
+}
+
+void stats_begin(struct stats_timer *timer)
+{
+    if(stats.format == STATS_NONE) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &timer->wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &timer->cpu);
+}
+
+/*
+ * Charges the time since stats_begin() to phase. CPU time is that of the
+ * calling thread, so phases run by several threads add up their work.
+ */
+void stats_end(struct stats_timer *timer, enum stats_phase phase)
+{
+    struct timespec wall;
+    struct timespec cpu;
+
+    if(stats.format == STATS_NONE) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+
+    add(&stats.wall_ns[phase], elapsed_ns(&timer->wall, &wall));
+    add(&stats.cpu_ns[phase], elapsed_ns(&timer->cpu, &cpu));
+    add(&stats.calls[phase], 1);
+}
+
+void stats_count_read(int64_t bytes)
+{
+    if(stats.format != STATS_NONE && bytes > 0) {
+        add(&stats.bytes_read, bytes);
+    }
+}
+
+void stats_count_write(int64_t bytes)
+{
+    if(stats.format != STATS_NONE && bytes > 0) {
+        add(&stats.bytes_written, bytes);
+    }
+}
+
+void stats_count_syscall(void)
+{
+    if(stats.format != STATS_NONE) {
+        add(&stats.syscalls, 1);
+    }
+}
+
+void stats_count_alloc(void)
+{
+    if(stats.format != STATS_NONE) {
+        add(&stats.allocations, 1);
+    }
+}
+
+/* malloc() that shows up in the allocation count */
+void *stats_malloc(size_t size)
+{
+    stats_count_alloc();
+    return malloc(size);
+}
+
+static void report_text(FILE *out, const char *command, uint64_t wall, uint64_t cpu)
+{
+    fprintf(out, "%s: %.3f ms wall, %.3f ms cpu\n", command, wall / 1e6, cpu / 1e6);
+    fprintf(out, "  %-10s %8s %12s %12s\n", "phase", "calls", "wall ms", "cpu ms");
+
+    for(int i = 0; i < STATS_PHASE_COUNT; i++) {
+        if(stats.calls[i] == 0) {
+            continue;
+        }
+        fprintf(out, "  %-10s %8lu %12.3f %12.3f\n", phase_names[i], (unsigned long) stats.calls[i],
+                stats.wall_ns[i] / 1e6, stats.cpu_ns[i] / 1e6);
+    }
+    fprintf(out, "  bytes read %lu, bytes written %lu, syscalls %lu, allocations %lu\n",
+            (unsigned long) stats.bytes_read, (unsigned long) stats.bytes_written,
+            (unsigned long) stats.syscalls, (unsigned long) stats.allocations);
+}
+
+static void report_json(FILE *out, const char *command, uint64_t wall, uint64_t cpu)
+{
+    int first = 1;
+
+    fprintf(out, "{\"command\":\"%s\",\"wall_ns\":%lu,\"cpu_ns\":%lu,\"phases\":{",
+            command, (unsigned long) wall, (unsigned long) cpu);
+
+    for(int i = 0; i < STATS_PHASE_COUNT; i++) {
+        if(stats.calls[i] == 0) {
+            continue;
+        }
+        fprintf(out, "%s\"%s\":{\"calls\":%lu,\"wall_ns\":%lu,\"cpu_ns\":%lu}", first ? "" : ",",
+                phase_names[i], (unsigned long) stats.calls[i], (unsigned long) stats.wall_ns[i],
+                (unsigned long) stats.cpu_ns[i]);
+        first = 0;
+    }
+    fprintf(out, "},\"bytes_read\":%lu,\"bytes_written\":%lu,\"syscalls\":%lu,\"allocations\":%lu}\n",
+            (unsigned long) stats.bytes_read, (unsigned long) stats.bytes_written,
+            (unsigned long) stats.syscalls, (unsigned long) stats.allocations);
+}
+
+void stats_report(FILE *out, const char *command)
+{
+    struct timespec wall;
+    struct timespec cpu;
+
+    if(stats.format == STATS_NONE) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+
+    if(stats.format == STATS_JSON) {
+        report_json(out, command, elapsed_ns(&stats.start_wall, &wall), elapsed_ns(&stats.start_cpu, &cpu));
+    } else {
+        report_text(out, command, elapsed_ns(&stats.start_wall, &wall), elapsed_ns(&stats.start_cpu, &cpu));
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Lightweight instrumentation for --stats. Phase timers and counters are
+ * process-wide and updated atomically so worker threads can report into
+ * them; when stats are disabled every call returns immediately.
+ */
+enum stats_phase {
+    STATS_OPEN,       /* opening inputs and outputs, sizing them */
+    STATS_HEADER,     /* reading, validating or writing the header */
+    STATS_RECIPE,     /* reading or writing recipe.cfg */
+    STATS_READ,       /* reading payload data */
+    STATS_HASH,       /* computing the image id */
+    STATS_WRITE,      /* writing payload data */
+    STATS_PADDING,    /* writing page padding */
+    STATS_OUTPUT,     /* formatting results */
+    STATS_COMPRESS,   /* compressing payloads */
+    STATS_DECOMPRESS, /* decompressing payloads */
+    STATS_UNPACK,     /* unpacking the ramdisk archive */
+    STATS_PHASE_COUNT
+};
+
+enum stats_format {
+    STATS_NONE,
+    STATS_TEXT,
+    STATS_JSON
+};
+
+struct stats_timer {
+    struct timespec wall;
+    struct timespec cpu;
+};
+
+void stats_enable(enum stats_format format);
+int  stats_enabled(void);
+void stats_begin(struct stats_timer *timer);
+void stats_end(struct stats_timer *timer, enum stats_phase phase);
+void stats_count_read(int64_t bytes);
+void stats_count_write(int64_t bytes);
+void stats_count_syscall(void);
+void stats_count_alloc(void);
+void *stats_malloc(size_t size);
+void stats_report(FILE *out, const char *command);
+
+#endif
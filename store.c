@@ -0,0 +1,237 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "file_io.h"
+#include "image_map.h"
+#include "stats.h"
+#include "store.h"
+
+/* "aa/" and the other 62 hex digits */
+#define OBJECT_NAME_SIZE (3 + (STORE_DIGEST_SIZE - 1) * 2 + 1)
+
+static void object_name(const uint8_t digest[STORE_DIGEST_SIZE], char name[OBJECT_NAME_SIZE])
+{
+    sprintf(name, "%02x/", digest[0]);
+    for(size_t i = 1; i < STORE_DIGEST_SIZE; i++) {
+        sprintf(name + 3 + (i - 1) * 2, "%02x", digest[i]);
+    }
+}
+
+/* Opens the store at path, creating the directory if it is not there yet */
+int store_open(struct section_store *store, const char *path)
+{
+    if(mkdir(path, 0755) < 0 && errno != EEXIST) {
+        store->dir_fd = -1;
+        return -1;
+    }
+    store->dir_fd = io_open(path, O_RDONLY | O_DIRECTORY, 0);
+    return store->dir_fd < 0 ? -1 : 0;
+}
+
+void store_close(struct section_store *store)
+{
+    if(store->dir_fd != -1) {
+        io_close(store->dir_fd);
+        store->dir_fd = -1;
+    }
+}
+
+/* Whether a recipe recorded a digest, which is all zeros if not */
+int store_has_digest(const uint8_t digest[STORE_DIGEST_SIZE])
+{
+    for(size_t i = 0; i < STORE_DIGEST_SIZE; i++) {
+        if(digest[i] != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void store_digest(const uint8_t *data, size_t size, uint8_t digest[STORE_DIGEST_SIZE])
+{
+    struct stats_timer timer;
+
+    stats_begin(&timer);
+    SHA256(data, size, digest);
+    stats_end(&timer, STATS_HASH);
+}
+
+/*
+ * Writes a payload the store does not have yet under a name of its own
+ * and renames it into place, so concurrent writers of the same payload
+ * never expose a partial object.
+ */
+static int write_object(const struct section_store *store, const uint8_t *data, size_t size, const char *name)
+{
+    static unsigned long counter;
+    char                 temp[OBJECT_NAME_SIZE + 32];
+    char                 dir[3];
+    int                  fd = -1;
+    int                  ret = 0;
+    struct stats_timer   timer;
+
+    memcpy(dir, name, 2);
+    dir[2] = 0;
+    if(mkdirat(store->dir_fd, dir, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    snprintf(temp, sizeof(temp), "%s/.tmp.%ld.%lu", dir, (long) getpid(),
+             __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED));
+
+    fd = io_openat(store->dir_fd, temp, O_WRONLY | O_CREAT | O_EXCL, 0444);
+    if(fd == -1) {
+        return -1;
+    }
+
+    stats_begin(&timer);
+    ret = io_pwrite_all(fd, data, size, 0);
+    stats_end(&timer, STATS_WRITE);
+    io_close(fd);
+
+    if(ret < 0 || renameat(store->dir_fd, temp, store->dir_fd, name) < 0) {
+        unlinkat(store->dir_fd, temp, 0);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Makes filename in dir_fd a reflink of the store object: it shares the
+ * object's extents but is a file of its own, so writing to it leaves
+ * the store and every other image alone. Returns -1 if the filesystem
+ * cannot clone.
+ */
+static int clone_object(const struct section_store *store, const char *name, int dir_fd, const char *filename)
+{
+#ifdef FICLONE
+    int src_fd = io_openat(store->dir_fd, name, O_RDONLY, 0);
+    int dst_fd = -1;
+    int ret = -1;
+
+    if(src_fd == -1) {
+        return -1;
+    }
+
+    dst_fd = io_openat(dir_fd, filename, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if(dst_fd != -1) {
+        stats_count_syscall();
+        ret = ioctl(dst_fd, FICLONE, src_fd);
+        io_close(dst_fd);
+
+        if(ret < 0) {
+            unlinkat(dir_fd, filename, 0);
+        }
+    }
+    io_close(src_fd);
+    return ret < 0 ? -1 : 0;
+#else
+    (void) store;
+    (void) name;
+    (void) dir_fd;
+    (void) filename;
+    return -1;
+#endif
+}
+
+/*
+ * Whether the open object fd still holds the payload with the given
+ * digest. Objects are hardlinked into output directories where they
+ * cannot be reflinked, so one may have been written to since it was
+ * stored. Returns -1 if it cannot be read.
+ */
+static int object_matches(int fd, const uint8_t digest[STORE_DIGEST_SIZE])
+{
+    uint8_t          actual[STORE_DIGEST_SIZE];
+    struct image_map map;
+    struct stat      st;
+
+    if(io_fstat(fd, &st) < 0) {
+        return -1;
+    }
+
+    if(st.st_size == 0) {
+        store_digest((const uint8_t *) "", 0, actual);
+    } else if(map_image(fd, &map) < 0) {
+        return -1;
+    } else {
+        store_digest(map.data, map.size, actual);
+        stats_count_read(map.size);
+        unmap_image(&map);
+    }
+    return memcmp(actual, digest, STORE_DIGEST_SIZE) == 0;
+}
+
+/*
+ * Makes filename in dir_fd the payload with the given digest: the store
+ * object is written if it is new or no longer matches its digest, and
+ * then reflinked into place. Where the filesystem cannot clone it is
+ * hardlinked, which shares the file itself, and across filesystems the
+ * payload is written out as a plain copy. Returns -1 if none of them
+ * works.
+ */
+int store_put(const struct section_store *store, const uint8_t *data, size_t size,
+              const uint8_t digest[STORE_DIGEST_SIZE], int dir_fd, const char *filename)
+{
+    char name[OBJECT_NAME_SIZE];
+    int  fd = -1;
+    int  ret = 0;
+
+    object_name(digest, name);
+
+    /* Renaming over a changed object leaves the files linked to it alone */
+    if((fd = io_openat(store->dir_fd, name, O_RDONLY, 0)) != -1) {
+        ret = object_matches(fd, digest);
+        io_close(fd);
+    }
+    if(ret != 1 && write_object(store, data, size, name) < 0) {
+        return -1;
+    }
+
+    unlinkat(dir_fd, filename, 0);
+    if(clone_object(store, name, dir_fd, filename) == 0 ||
+       linkat(store->dir_fd, name, dir_fd, filename, 0) == 0) {
+        return 0;
+    }
+
+    fd = io_openat(dir_fd, filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) {
+        return -1;
+    }
+    ret = io_pwrite_all(fd, data, size, 0);
+    io_close(fd);
+    return ret;
+}
+
+/*
+ * Opens the payload with the given digest for reading, checking first
+ * that it still matches the digest. Returns -1 if the store does not
+ * have the payload and STORE_CORRUPT if it no longer matches.
+ */
+int store_get(const struct section_store *store, const uint8_t digest[STORE_DIGEST_SIZE])
+{
+    char name[OBJECT_NAME_SIZE];
+    int  fd = -1;
+    int  ret = 0;
+
+    object_name(digest, name);
+    if((fd = io_openat(store->dir_fd, name, O_RDONLY, 0)) == -1) {
+        return -1;
+    }
+
+    if((ret = object_matches(fd, digest)) != 1) {
+        io_close(fd);
+        return ret < 0 ? -1 : STORE_CORRUPT;
+    }
+    return fd;
+}
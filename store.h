@@ -0,0 +1,34 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A content-addressed store of section payloads. Each payload is kept
+ * once, read-only, as <store>/<first two hex digits of its SHA-256>/
+ * <the other 62>. disassemble --store puts every section it extracts
+ * there, reflinks it into the output directory, or hardlinks or copies
+ * it where the filesystem cannot clone, and records its digest in the
+ * recipe, so unpacking many images that share a kernel or dtb writes it
+ * once; create --store reads payloads the recipe's directory does not
+ * have from the store by digest and checks them against it.
+ */
+#define STORE_DIGEST_SIZE 32
+
+/* store_get() found the object but it no longer matches its digest */
+#define STORE_CORRUPT -2
+
+struct section_store {
+    int dir_fd;
+};
+
+int  store_open(struct section_store *store, const char *path);
+void store_close(struct section_store *store);
+int  store_has_digest(const uint8_t digest[STORE_DIGEST_SIZE]);
+void store_digest(const uint8_t *data, size_t size, uint8_t digest[STORE_DIGEST_SIZE]);
+int  store_put(const struct section_store *store, const uint8_t *data, size_t size,
+               const uint8_t digest[STORE_DIGEST_SIZE], int dir_fd, const char *filename);
+int  store_get(const struct section_store *store, const uint8_t digest[STORE_DIGEST_SIZE]);
+
+#endif
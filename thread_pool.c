@@ -0,0 +1,72 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thread_pool.h"
+
+struct thread_pool {
+    size_t          next;
+    size_t          count;
+    thread_pool_job job;
+    void            *arg;
+};
+
+static void *worker(void *data)
+{
+    struct thread_pool *pool = data;
+    size_t             index = 0;
+
+    while((index = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count) {
+        pool->job(index, pool->arg);
+    }
+    return NULL;
+}
+
+unsigned int thread_pool_default_size(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return cpus > 0 ? cpus : 1;
+#else
+    return 1;
+#endif
+}
+
+/*
+ * Runs job(0) .. job(count - 1) on up to threads worker threads and
+ * waits for all of them. The calling thread takes part as a worker, so
+ * threads == 1 runs everything inline without creating any thread.
+ */
+int thread_pool_run(unsigned int threads, size_t count, thread_pool_job job, void *arg)
+{
+    struct thread_pool pool = { 0, count, job, arg };
+    pthread_t          *tids = NULL;
+    unsigned int       started = 0;
+
+    if(threads > count) {
+        threads = count;
+    }
+
+    if(threads > 1) {
+        tids = malloc(sizeof(pthread_t) * (threads - 1));
+
+        if(tids == NULL) {
+            threads = 1;
+        }
+    }
+
+    for(; started + 1 < threads; started++) {
+        if(pthread_create(&tids[started], NULL, worker, &pool) != 0) {
+            break;
+        }
+    }
+
+    worker(&pool);
+
+    for(unsigned int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+    return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+
+typedef void (*thread_pool_job)(size_t index, void *arg);
+
+unsigned int thread_pool_default_size(void);
+int          thread_pool_run(unsigned int threads, size_t count, thread_pool_job job, void *arg);
+
+#endif
@@ -0,0 +1,436 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+#include "uring.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Requests in flight at once; every request holds one submission entry */
+#define URING_DEPTH 32
+/* Registered buffers for file reads, each holding one chunk */
+#define URING_BUFFERS 8
+#define URING_CHUNK (512 * 1024)
+/* A registered buffer of zeros, used for padding */
+#define URING_ZEROS (64 * 1024)
+
+struct uring_op {
+    int      busy;
+    int      writing;    /* 0 while a file read is outstanding */
+    int      ready;      /* read done, waiting for its turn at the hook */
+    size_t   transfer;
+    uint64_t pos;        /* offset of the chunk inside the transfer */
+    uint32_t len;
+    uint32_t done;       /* bytes written so far, writes can be short */
+    int      buffer;     /* registered buffer index or -1 */
+    uint64_t seq;        /* order of the read among all file reads */
+};
+
+struct uring {
+    int                 fd;
+    void                *sq_ring;
+    size_t              sq_ring_size;
+    void                *cq_ring;
+    size_t              cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t              sqes_size;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+    uint8_t             *buffers;
+    int                 free_buffers[URING_BUFFERS];
+    int                 free_count;
+    struct uring_op     ops[URING_DEPTH];
+    unsigned            pending;    /* queued but not yet submitted */
+    unsigned            inflight;
+};
+
+static uint8_t *buffer_at(struct uring *ring, int index)
+{
+    return ring->buffers + (size_t) index * URING_CHUNK;
+}
+
+/*
+ * Sets up a ring and registers the read buffers and the zero buffer with
+ * it. Returns NULL when io_uring is not usable, for instance on older
+ * kernels or when it is disabled by policy, so callers can fall back to
+ * plain pread/pwrite.
+ */
+struct uring *uring_create(void)
+{
+    struct io_uring_params params;
+    struct iovec           iov[URING_BUFFERS + 1];
+    struct uring           *ring = calloc(1, sizeof(struct uring));
+
+    if(ring == NULL) {
+        return NULL;
+    }
+    ring->fd = -1;
+    ring->sq_ring = ring->cq_ring = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+    ring->buffers = MAP_FAILED;
+
+    memset(&params, 0, sizeof(params));
+    stats_count_syscall();
+    ring->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+
+    if(ring->fd < 0) {
+        goto fail;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = 0;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ring == MAP_FAILED) {
+        goto fail;
+    }
+
+    if(ring->cq_ring_size == 0) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cq_ring == MAP_FAILED) {
+            goto fail;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) {
+        goto fail;
+    }
+
+    ring->sq_tail = (unsigned *) ((uint8_t *) ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) ((uint8_t *) ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) ((uint8_t *) ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *) ((uint8_t *) ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *) ((uint8_t *) ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) ((uint8_t *) ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((uint8_t *) ring->cq_ring + params.cq_off.cqes);
+
+    /* Anonymous pages, since registered buffers may not be file backed */
+    ring->buffers = mmap(NULL, (size_t) URING_BUFFERS * URING_CHUNK + URING_ZEROS, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring->buffers == MAP_FAILED) {
+        goto fail;
+    }
+
+    for(int i = 0; i < URING_BUFFERS; i++) {
+        iov[i].iov_base = buffer_at(ring, i);
+        iov[i].iov_len = URING_CHUNK;
+    }
+    iov[URING_BUFFERS].iov_base = buffer_at(ring, URING_BUFFERS);
+    iov[URING_BUFFERS].iov_len = URING_ZEROS;
+
+    stats_count_syscall();
+    if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS + 1) < 0) {
+        goto fail;
+    }
+    return ring;
+
+fail:
+    uring_destroy(ring);
+    return NULL;
+}
+
+void uring_destroy(struct uring *ring)
+{
+    if(ring == NULL) {
+        return;
+    }
+
+    if(ring->buffers != MAP_FAILED)
+        munmap(ring->buffers, (size_t) URING_BUFFERS * URING_CHUNK + URING_ZEROS);
+    if(ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if(ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if(ring->fd >= 0) {
+        stats_count_syscall();
+        close(ring->fd);
+    }
+    free(ring);
+}
+
+static void queue_sqe(struct uring *ring, struct uring_op *op, uint8_t opcode, int fd,
+                      const void *addr, uint32_t len, uint64_t offset, int buffer)
+{
+    unsigned            tail = *ring->sq_tail;
+    unsigned            index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = buffer >= 0 ? buffer : 0;
+    sqe->user_data = op - ring->ops;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+}
+
+/* Queues the write of what is left of the op's chunk */
+static void queue_write(struct uring *ring, const struct uring_transfer *transfers, struct uring_op *op)
+{
+    const struct uring_transfer *tr = &transfers[op->transfer];
+    uint64_t                    offset = tr->out_offset + op->pos + op->done;
+    uint32_t                    len = op->len - op->done;
+
+    op->writing = 1;
+
+    if(tr->data != NULL) {
+        queue_sqe(ring, op, IORING_OP_WRITE, tr->out_fd, tr->data + op->pos + op->done, len, offset, -1);
+    } else {
+        queue_sqe(ring, op, IORING_OP_WRITE_FIXED, tr->out_fd, buffer_at(ring, op->buffer) + op->done,
+                  len, offset, op->buffer);
+    }
+}
+
+static void release_op(struct uring *ring, struct uring_op *op)
+{
+    if(op->buffer >= 0 && op->buffer < URING_BUFFERS) {
+        ring->free_buffers[ring->free_count++] = op->buffer;
+    }
+    op->busy = 0;
+}
+
+static struct uring_op *free_op(struct uring *ring)
+{
+    for(int i = 0; i < URING_DEPTH; i++) {
+        if(!ring->ops[i].busy) {
+            return &ring->ops[i];
+        }
+    }
+    return NULL;
+}
+
+static int submit_and_wait(struct uring *ring)
+{
+    struct stats_timer timer;
+    int                ret = 0;
+
+    stats_begin(&timer);
+    do {
+        stats_count_syscall();
+        ret = syscall(__NR_io_uring_enter, ring->fd, ring->pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    } while(ret < 0 && errno == EINTR);
+    stats_end(&timer, STATS_WRITE);
+
+    if(ret < 0) {
+        return -1;
+    }
+    ring->inflight += ret;
+    ring->pending -= ret;
+    return 0;
+}
+
+/*
+ * Waits for every request already submitted to complete and discards
+ * the completions, so that none still reads or writes the caller's
+ * files and buffers once uring_run() has returned. Returns -1 if even
+ * waiting fails.
+ */
+static int drain_inflight(struct uring *ring)
+{
+    while(ring->inflight > 0) {
+        unsigned head = 0;
+        unsigned tail = 0;
+        int      ret = 0;
+
+        do {
+            stats_count_syscall();
+            ret = syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        } while(ret < 0 && errno == EINTR);
+
+        if(ret < 0) {
+            return -1;
+        }
+
+        head = *ring->cq_head;
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        ring->inflight -= tail - head;
+        __atomic_store_n(ring->cq_head, tail, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/*
+ * Runs all transfers with up to URING_DEPTH requests in flight. File
+ * data is read into registered buffers and written back out from them;
+ * each read chunk passes through hook in order first, so the caller can
+ * hash the data on its way to the output. Returns -1 if any request
+ * failed or a file turned out shorter than expected; requests already
+ * in flight are drained before returning. Requests queued but never
+ * submitted stay in the ring after a failure, so a ring that failed
+ * must be destroyed rather than run again.
+ */
+int uring_run(struct uring *ring, const struct uring_transfer *transfers, size_t count,
+              uring_read_hook hook, void *arg)
+{
+    size_t   next = 0;
+    uint64_t pos = 0;
+    uint64_t read_seq = 0;
+    uint64_t hook_seq = 0;
+    int      error = 0;
+
+    memset(ring->ops, 0, sizeof(ring->ops));
+    ring->free_count = 0;
+    ring->pending = 0;
+    ring->inflight = 0;
+
+    for(int i = 0; i < URING_BUFFERS; i++) {
+        ring->free_buffers[ring->free_count++] = i;
+    }
+
+    for(;;) {
+        struct uring_op *op = NULL;
+
+        while(!error && next < count && (op = free_op(ring)) != NULL) {
+            const struct uring_transfer *tr = &transfers[next];
+            uint64_t                    left = tr->size - pos;
+            int                         from_file = tr->data == NULL && tr->in_fd >= 0;
+            uint32_t                    limit = tr->data == NULL && !from_file ? URING_ZEROS : URING_CHUNK;
+
+            if(pos >= tr->size) {
+                next++;
+                pos = 0;
+                continue;
+            }
+
+            if(from_file && ring->free_count == 0) {
+                break;
+            }
+
+            memset(op, 0, sizeof(struct uring_op));
+            op->busy = 1;
+            op->transfer = next;
+            op->pos = pos;
+            op->len = left > limit ? limit : left;
+            op->buffer = -1;
+            pos += op->len;
+
+            if(from_file) {
+                op->buffer = ring->free_buffers[--ring->free_count];
+                op->seq = read_seq++;
+                queue_sqe(ring, op, IORING_OP_READ_FIXED, tr->in_fd, buffer_at(ring, op->buffer),
+                          op->len, tr->in_offset + op->pos, op->buffer);
+            } else {
+                if(tr->data == NULL) {
+                    op->buffer = URING_BUFFERS;
+                }
+                queue_write(ring, transfers, op);
+            }
+        }
+
+        if(ring->pending == 0 && ring->inflight == 0) {
+            break;
+        }
+
+        if(submit_and_wait(ring) < 0) {
+            drain_inflight(ring);
+            return -1;
+        }
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        for(; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+            op = &ring->ops[cqe->user_data];
+            ring->inflight--;
+
+            if(!op->writing) {
+                if(cqe->res != (int32_t) op->len) {
+                    error = 1;
+                    release_op(ring, op);
+                } else {
+                    stats_count_read(cqe->res);
+                    op->ready = 1;
+                }
+            } else if(cqe->res <= 0) {
+                error = 1;
+                release_op(ring, op);
+            } else {
+                stats_count_write(cqe->res);
+                op->done += cqe->res;
+
+                if(op->done < op->len && !error) {
+                    queue_write(ring, transfers, op);
+                } else {
+                    release_op(ring, op);
+                }
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        /* Reads complete out of order but must reach the hook in order */
+        for(int i = 0; i < URING_DEPTH; i++) {
+            op = &ring->ops[i];
+
+            if(!op->busy || !op->ready || op->seq != hook_seq) {
+                continue;
+            }
+            op->ready = 0;
+            hook_seq++;
+
+            if(error) {
+                release_op(ring, op);
+            } else {
+                if(hook != NULL) {
+                    hook(op->transfer, buffer_at(ring, op->buffer), op->len, arg);
+                }
+                queue_write(ring, transfers, op);
+            }
+            i = -1;
+        }
+    }
+    return error ? -1 : 0;
+}
+
+#else
+
+struct uring *uring_create(void)
+{
+    return NULL;
+}
+
+void uring_destroy(struct uring *ring)
+{
+}
+
+int uring_run(struct uring *ring, const struct uring_transfer *transfers, size_t count,
+              uring_read_hook hook, void *arg)
+{
+    return -1;
+}
+
+#endif
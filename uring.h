@@ -0,0 +1,35 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A batch of copies submitted through io_uring. Each transfer writes
+ * size bytes at out_offset of out_fd, taking them from data if it is
+ * not NULL, from in_fd at in_offset if in_fd is not -1, and zeros
+ * otherwise. File reads go through registered buffers.
+ */
+struct uring_transfer {
+    int           in_fd;
+    uint64_t      in_offset;
+    const uint8_t *data;
+    int           out_fd;
+    uint64_t      out_offset;
+    uint64_t      size;
+};
+
+/*
+ * Called for every chunk read from a file, in transfer and offset order,
+ * before the chunk is written out.
+ */
+typedef void (*uring_read_hook)(size_t index, const uint8_t *data, size_t size, void *arg);
+
+struct uring;
+
+struct uring *uring_create(void);
+void          uring_destroy(struct uring *ring);
+int           uring_run(struct uring *ring, const struct uring_transfer *transfers, size_t count,
+                        uring_read_hook hook, void *arg);
+
+#endif
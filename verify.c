@@ -0,0 +1,250 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "avb.h"
+#include "bootimgtool.h"
+#include "file_io.h"
+#include "image_id.h"
+#include "image_map.h"
+#include "layout.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "verify.h"
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int fail(struct verify_result *result, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(result->error, sizeof(result->error), format, args);
+    va_end(args);
+    return -1;
+}
+
+/* Whether size bytes at data are all zero, without a zero buffer to compare against */
+static int is_zero(const uint8_t *data, uint64_t size)
+{
+    return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+}
+
+static void id_hex(char *out, const uint32_t id[8])
+{
+    const uint8_t *bytes = (const uint8_t *) id;
+
+    for(size_t i = 0; i < sizeof(uint32_t) * 8; i++) {
+        sprintf(out + i * 2, "%02x", bytes[i]);
+    }
+}
+
+/*
+ * Checks that every section the header describes lies inside the image
+ * and that the padding after the header and after each section is zero,
+ * as create writes it.
+ */
+static int verify_layout(const struct image_map *map, const struct bootimg_header *hdr,
+                         const struct header_format *format, const struct image_layout *layout,
+                         struct verify_result *result)
+{
+    uint64_t header_end = page_align(format->size, hdr->page_size);
+
+    if(layout->total_size > map->size) {
+        return fail(result, "image is truncated: %llu bytes, its header describes %llu",
+                    (unsigned long long) map->size, (unsigned long long) layout->total_size);
+    }
+
+    if(HEADER_HAS(format, header_size) && hdr->header_size != format->size) {
+        return fail(result, "header size %u does not match version %u (%u)", hdr->header_size,
+                    hdr->header_version, format->size);
+    }
+
+    if(!is_zero(map->data + format->size, header_end - format->size)) {
+        return fail(result, "nonzero padding after the header");
+    }
+
+    for(size_t i = 0; i < format->section_count; i++) {
+        const struct section *section = &layout->sections[format->sections[i]];
+        uint64_t             end = section->offset + section->size;
+
+        if(!is_zero(map->data + end, section->offset + page_align(section->size, hdr->page_size) - end)) {
+            return fail(result, "nonzero padding after the %s at offset %llu", section_name(format->sections[i]),
+                        (unsigned long long) end);
+        }
+    }
+
+    if(header_has_section(format, SECTION_VENDOR_RAMDISK_TABLE)) {
+        const struct section *ramdisk = &layout->sections[SECTION_RAMDISK];
+        const struct section *table = &layout->sections[SECTION_VENDOR_RAMDISK_TABLE];
+        uint32_t             entry_size = hdr->vendor_ramdisk_table_entry_size;
+
+        if(entry_size < sizeof(struct vendor_ramdisk_table_entry) ||
+           (uint64_t) entry_size * hdr->vendor_ramdisk_table_entry_num > table->size) {
+            return fail(result, "invalid vendor ramdisk table");
+        }
+
+        for(uint32_t i = 0; i < hdr->vendor_ramdisk_table_entry_num; i++) {
+            struct vendor_ramdisk_table_entry entry;
+
+            memcpy(&entry, map->data + table->offset + (uint64_t) i * entry_size, sizeof(entry));
+            if(entry.ramdisk_offset > ramdisk->size || entry.ramdisk_size > ramdisk->size - entry.ramdisk_offset) {
+                return fail(result, "vendor ramdisk %u lies outside the vendor ramdisk", i);
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Checks one image: that its header is one this tool knows, that its
+ * sections and padding are where and what create would have written,
+ * that its id, if it has one, matches its contents and that its AVB
+ * footer, if it has one, verifies. The image is mapped once and read
+ * front to back, hashing with whichever digest the stored id was made
+ * with. Returns 0 if the image is intact and -1
+ * with result->error set otherwise.
+ */
+int verify_image(const char *filename, struct verify_result *result)
+{
+    struct bootimg_header      hdr;
+    const struct header_format *format = NULL;
+    struct image_layout        layout;
+    struct image_map           map;
+    struct timespec            start;
+    uint32_t                   digest[8];
+    int                        fd = -1;
+    int                        ret = -1;
+
+    memset(result, 0, sizeof(struct verify_result));
+    memset(&map, 0, sizeof(struct image_map));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    fd = io_open(filename, O_RDONLY, 0);
+    if(fd == -1) {
+        return fail(result, "could not open file");
+    }
+
+    if(map_image(fd, &map) < 0) {
+        fail(result, "could not map image");
+        goto out;
+    }
+    result->size = map.size;
+    stats_count_read(map.size);
+
+    /* Everything up to the end of the image is read, so start reading all of it ahead */
+    if(map.mapped) {
+        madvise(map.data, map.size, MADV_WILLNEED);
+    }
+
+    if(parse_header(map.data, map.size, &hdr) < 0) {
+        fail(result, "not a valid image");
+        goto out;
+    }
+
+    if((format = header_format(&hdr)) == NULL) {
+        fail(result, "unsupported header version %u", hdr.header_version);
+        goto out;
+    }
+
+    if(hdr.page_size == 0 || (hdr.page_size & (hdr.page_size - 1)) != 0 || compute_layout(&hdr, &layout) < 0) {
+        fail(result, "invalid page size %u", hdr.page_size);
+        goto out;
+    }
+
+    if(format->has_id) {
+        if(layout.total_size > map.size || compute_image_id(&map, &hdr, detect_id_hash(&hdr), digest) < 0) {
+            fail(result, "image is truncated: %llu bytes, its header describes %llu",
+                 (unsigned long long) map.size, (unsigned long long) layout.total_size);
+            goto out;
+        }
+
+        if(memcmp(digest, hdr.id, sizeof(hdr.id)) != 0) {
+            char stored[65];
+            char computed[65];
+
+            id_hex(stored, hdr.id);
+            id_hex(computed, digest);
+            fail(result, "id %s does not match the contents, which hash to %s", stored, computed);
+            goto out;
+        }
+    }
+
+    ret = verify_layout(&map, &hdr, format, &layout, result);
+
+    /* A signed image's hash descriptor covers the same bytes, so check it while they are mapped */
+    if(ret == 0 && avb_verify_image(filename, &map, 1, NULL, result->error, sizeof(result->error)) < 0) {
+        ret = -1;
+    }
+
+out:
+    unmap_image(&map);
+    io_close(fd);
+    result->seconds = elapsed(&start);
+    return ret;
+}
+
+struct verification {
+    char            **paths;
+    pthread_mutex_t output_lock;
+    uint64_t        bytes;
+    int             failed;
+};
+
+static void verify_job(size_t index, void *arg)
+{
+    struct verification  *verification = arg;
+    struct verify_result result;
+    const char           *path = verification->paths[index];
+    int                  ret = verify_image(path, &result);
+    struct stats_timer   timer;
+
+    __atomic_fetch_add(&verification->bytes, result.size, __ATOMIC_RELAXED);
+
+    stats_begin(&timer);
+    pthread_mutex_lock(&verification->output_lock);
+    if(ret < 0) {
+        verification->failed++;
+        fprintf(stdout, "%s: FAILED: %s\n", path, result.error);
+    } else {
+        fprintf(stdout, "%s: OK, %.1f MB at %.1f MB/s\n", path, result.size / 1e6,
+                result.seconds > 0 ? result.size / 1e6 / result.seconds : 0);
+    }
+    pthread_mutex_unlock(&verification->output_lock);
+    stats_end(&timer, STATS_OUTPUT);
+}
+
+/*
+ * Verifies every image in paths on up to threads threads, printing one
+ * line per image in completion order and then the total throughput.
+ * Returns 1 if any image failed, so the exit status can gate uploads.
+ */
+int verify_images(char **paths, int count, unsigned int threads)
+{
+    struct verification verification;
+    struct timespec     start;
+    double              seconds = 0;
+
+    memset(&verification, 0, sizeof(struct verification));
+    verification.paths = paths;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_init(&verification.output_lock, NULL);
+    thread_pool_run(threads, count, verify_job, &verification);
+    pthread_mutex_destroy(&verification.output_lock);
+    seconds = elapsed(&start);
+
+    fprintf(stdout, "%d images, %d failed, %.1f MB in %.3f s (%.1f MB/s)\n", count, verification.failed,
+            verification.bytes / 1e6, seconds, seconds > 0 ? verification.bytes / 1e6 / seconds : 0);
+    return verification.failed ? 1 : 0;
+}
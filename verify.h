@@ -0,0 +1,17 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* What verifying one image found */
+struct verify_result {
+    uint64_t size;          /* bytes in the image file */
+    double   seconds;
+    char     error[256];    /* empty if the image is intact */
+};
+
+int verify_image(const char *filename, struct verify_result *result);
+int verify_images(char **paths, int count, unsigned int threads);
+
+#endif
@@ -1,12 +1,66 @@
+#include <io.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
+#include <windows.h>
 
 #include "win32.h"
 
+/*
+ * pread() and pwrite() pass the offset in an OVERLAPPED instead of
+ * seeking, so that threads copying sections through one descriptor do
+ * not move each other's file position. Unlike POSIX, they leave the
+ * position after the data they transferred.
+ */
+static OVERLAPPED at_offset(off_t offset)
+{
+    OVERLAPPED overlapped;
+
+    memset(&overlapped, 0, sizeof(OVERLAPPED));
+    overlapped.Offset = (DWORD) ((uint64_t) offset & 0xffffffff);
+    overlapped.OffsetHigh = (DWORD) ((uint64_t) offset >> 32);
+    return overlapped;
+}
+
 ssize_t pread(int fd, void *buf, size_t size, off_t offset)
 {
-    int current_pos = lseek(fd, 0, SEEK_CUR);
-    lseek(fd, offset, SEEK_SET);
-    ssize_t bytes_read = read(fd, buf, size);
-    lseek(fd, current_pos, SEEK_SET);
+    HANDLE     handle = (HANDLE) _get_osfhandle(fd);
+    OVERLAPPED overlapped = at_offset(offset);
+    DWORD      bytes_read = 0;
+
+    if(size > 0x7fffffff)
+        size = 0x7fffffff;
+
+    if(!ReadFile(handle, buf, (DWORD) size, &bytes_read, &overlapped))
+        return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
     return bytes_read;
-}
\ No newline at end of file
+}
+ssize_t writev(int fd, const struct iovec *iov, int count)
+{
+    ssize_t total = 0;
+
+    for(int i = 0; i < count; i++) {
+        ssize_t bytes_written = write(fd, iov[i].iov_base, iov[i].iov_len);
+
+        if(bytes_written < 0)
+            return total > 0 ? total : -1;
+        total += bytes_written;
+        if((size_t) bytes_written < iov[i].iov_len)
+            break;
+    }
+    return total;
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t size, off_t offset)
+{
+    HANDLE     handle = (HANDLE) _get_osfhandle(fd);
+    OVERLAPPED overlapped = at_offset(offset);
+    DWORD      bytes_written = 0;
+
+    if(size > 0x7fffffff)
+        size = 0x7fffffff;
+
+    if(!WriteFile(handle, buf, (DWORD) size, &bytes_written, &overlapped))
+        return -1;
+    return bytes_written;
+}
@@ -1,4 +1,12 @@
 ssize_t pread(int fd, void *buf, size_t size, off_t offset);
+ssize_t pwrite(int fd, const void *buf, size_t size, off_t offset);
+
+struct iovec {
+    void   *iov_base;
+    size_t iov_len;
+};
+
+ssize_t writev(int fd, const struct iovec *iov, int count);
 
 #define open(filename, flags, ...) \
 ({                                 \
@@ -16,3 +24,7 @@ ssize_t pread(int fd, void *buf, size_t size, off_t offset);
         fd = fileno(fs);           \
     fd;                            \
 })
+
+/* Directory-relative opens only support the current directory */
+#define AT_FDCWD -100
+#define openat(dir_fd, filename, flags, ...) open(filename, flags)